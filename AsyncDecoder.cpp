@@ -0,0 +1,164 @@
+#include "AsyncDecoder.hpp"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <exception>
+
+// The one stage the decoder times, from a request's submission until its result is ready //
+static const TimingStats::Stage latency_stages[] = {{"request", -1}};
+
+static size_t roundUpToPowerOfTwo(size_t x) {
+  size_t p = 1;
+  while (p < x) p <<= 1;
+  return p;
+}
+
+AsyncDecoder::AsyncDecoder(poplar::Device &ipuDevice, size_t queue_capacity, size_t max_batch_size,
+                           bool do_iDCT_on_IPU)
+    : m_capacity(roundUpToPowerOfTwo(std::max<size_t>(queue_capacity, 2))),
+      m_max_batch_size(std::max<size_t>(max_batch_size, 1)),
+      m_enqueue_pos(0),
+      m_dequeue_pos(0),
+      m_stop(false),
+      m_reader(ipuDevice, do_iDCT_on_IPU),
+      m_latencies(latency_stages, 1, true),
+      m_num_batches(0),
+      m_total_queue_depth(0),
+      m_max_queue_depth(0) {
+  m_slots.reset(new Slot[m_capacity]);
+  for (size_t i = 0; i < m_capacity; ++i) m_slots[i].sequence.store(i, std::memory_order_relaxed);
+  m_worker = std::thread(&AsyncDecoder::workerLoop, this);
+}
+
+AsyncDecoder::~AsyncDecoder() {
+  {
+    std::lock_guard<std::mutex> lock(m_wake_mutex);
+    m_stop.store(true, std::memory_order_release);
+  }
+  m_not_empty.notify_one();
+  m_worker.join();
+}
+
+std::future<AsyncDecoder::DecodedImage> AsyncDecoder::submit(const uint8_t *data, size_t size) {
+  Request request;
+  request.input = {data, size};
+  request.submit_time = TimingStats::now();
+  std::future<DecodedImage> result = request.promise.get_future();
+
+  // Backpressure: sleep until the worker frees a slot //
+  while (!tryEnqueue(request)) {
+    std::unique_lock<std::mutex> lock(m_wake_mutex);
+    m_not_full.wait(lock, [this] { return queueDepth() < m_capacity; });
+  }
+  // Taking the lock orders this after the worker's last look at the ring, if it is about to sleep //
+  {
+    std::lock_guard<std::mutex> lock(m_wake_mutex);
+  }
+  m_not_empty.notify_one();
+  return result;
+}
+
+size_t AsyncDecoder::queueDepth() const {
+  return m_enqueue_pos.load(std::memory_order_relaxed) - m_dequeue_pos.load(std::memory_order_relaxed);
+}
+
+// Each slot's sequence number says whose turn it is: == pos means free for the producer claiming
+// pos, == pos + 1 means filled and ready for the consumer. (Vyukov's bounded queue, one consumer.)
+bool AsyncDecoder::tryEnqueue(Request &request) {
+  size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+  Slot *slot;
+  while (true) {
+    slot = &m_slots[pos & (m_capacity - 1)];
+    size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if (diff == 0) {
+      if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      return false;  // Full
+    } else {
+      pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+  slot->request = std::move(request);
+  slot->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool AsyncDecoder::tryDequeue(Request &request) {
+  size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+  Slot *slot = &m_slots[pos & (m_capacity - 1)];
+  if (slot->sequence.load(std::memory_order_acquire) != pos + 1) return false;  // Empty
+  request = std::move(slot->request);
+  slot->sequence.store(pos + m_capacity, std::memory_order_release);
+  m_dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+  return true;
+}
+
+// Whether the next request to dequeue has been filled in, not just claimed //
+bool AsyncDecoder::hasRequest() const {
+  size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+  return m_slots[pos & (m_capacity - 1)].sequence.load(std::memory_order_acquire) == pos + 1;
+}
+
+void AsyncDecoder::workerLoop() {
+  std::vector<Request> batch;
+  std::vector<JPGReader::Input> inputs;
+
+  while (true) {
+    size_t depth = queueDepth();
+    batch.clear();
+    Request request;
+    while (batch.size() < m_max_batch_size && tryDequeue(request)) batch.push_back(std::move(request));
+
+    if (batch.empty()) {
+      std::unique_lock<std::mutex> lock(m_wake_mutex);
+      m_not_empty.wait(lock, [this] { return hasRequest() || m_stop.load(std::memory_order_acquire); });
+      if (!hasRequest()) break;
+      continue;
+    }
+    // Likewise for producers waiting on the slots just freed //
+    {
+      std::lock_guard<std::mutex> lock(m_wake_mutex);
+    }
+    m_not_full.notify_all();
+
+    inputs.clear();
+    for (auto &r : batch) inputs.push_back(r.input);
+    std::vector<DecodedImage> outputs;
+    try {
+      outputs = m_reader.decodeBatch(inputs);
+    } catch (...) {
+      // Fail the requests rather than the worker, which carries on with the next batch //
+      std::exception_ptr error = std::current_exception();
+      for (auto &r : batch) r.promise.set_exception(error);
+      continue;
+    }
+
+    std::lock_guard<std::mutex> lock(m_stats_mutex);
+    ++m_num_batches;
+    m_total_queue_depth += depth;
+    m_max_queue_depth = std::max(m_max_queue_depth, depth);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      m_latencies.record(0, batch[i].submit_time);
+      batch[i].promise.set_value(std::move(outputs[i]));
+    }
+  }
+}
+
+void AsyncDecoder::printStats() {
+  std::lock_guard<std::mutex> lock(m_stats_mutex);
+  if (!m_num_batches) return;
+  printf(
+      "+-------------------------------+-----------+\n"
+      "|               Request latency | Time (ms) |\n"
+      "+-------------------------------+-----------+\n");
+  printf("|%30s | % 9.3f |\n", "p50", m_latencies.percentileMilliseconds(0, 0.50));
+  printf("|%30s | % 9.3f |\n", "p90", m_latencies.percentileMilliseconds(0, 0.90));
+  printf("|%30s | % 9.3f |\n", "p99", m_latencies.percentileMilliseconds(0, 0.99));
+  printf("|%30s | % 9.3f |\n", "max", m_latencies.maxMilliseconds(0));
+  printf("+-------------------------------+-----------+\n");
+  printf("%llu requests, queue depth mean %.1f max %zu (capacity %zu)\n",
+         (unsigned long long)m_latencies.count(0), (double)m_total_queue_depth / m_num_batches, m_max_queue_depth,
+         m_capacity);
+}
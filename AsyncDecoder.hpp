@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "JPGReader.hpp"
+
+// Lets many threads share one JPGReader (and so one attached IPU). Requests go through a bounded
+// lock-free multi-producer single-consumer ring to a worker thread that owns the reader and feeds
+// whatever has queued up into JPGReader::decodeBatch. The worker sleeps while the ring is empty, and
+// producers while it is full.
+class AsyncDecoder {
+ public:
+  typedef JPGReader::DecodedImage DecodedImage;
+
+  AsyncDecoder(poplar::Device& ipuDevice, size_t queue_capacity = 64, size_t max_batch_size = 16,
+               bool do_iDCT_on_IPU = true);
+  ~AsyncDecoder();
+
+  // The buffer is borrowed, not copied, and must stay alive until the future is ready.
+  // Blocks while the queue is full, so producers cannot outrun the device. If the batch the
+  // request went in throws, the future rethrows it.
+  std::future<DecodedImage> submit(const uint8_t* data, size_t size);
+
+  size_t queueDepth() const;
+  void printStats();
+
+ private:
+  struct Request {
+    JPGReader::Input input;
+    std::promise<DecodedImage> promise;
+    uint64_t submit_time;  // A TimingStats::now() reading
+  };
+
+  struct Slot {
+    std::atomic<size_t> sequence;
+    Request request;
+  };
+
+  bool tryEnqueue(Request& request);
+  bool tryDequeue(Request& request);
+  bool hasRequest() const;
+  void workerLoop();
+
+  std::unique_ptr<Slot[]> m_slots;
+  size_t m_capacity;
+  size_t m_max_batch_size;
+  alignas(64) std::atomic<size_t> m_enqueue_pos;
+  alignas(64) std::atomic<size_t> m_dequeue_pos;
+  std::atomic<bool> m_stop;
+
+  JPGReader m_reader;
+  std::thread m_worker;
+
+  // Guards nothing but the sleeps, so a wake-up can't slip in between checking the ring and waiting //
+  std::mutex m_wake_mutex;
+  std::condition_variable m_not_empty;
+  std::condition_variable m_not_full;
+
+  // Only the totals are kept, so the stats take the same memory however long the decoder runs //
+  std::mutex m_stats_mutex;
+  TimingStats m_latencies;
+  uint64_t m_num_batches;
+  uint64_t m_total_queue_depth;
+  size_t m_max_queue_depth;
+};
@@ -1,87 +1,155 @@
 #include "CPUReader.hpp"
 
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include <chrono>
-#include <numeric>
+#include <new>
 #include <stdexcept>
 
 #define SAFEDELETE(ptr)   \
   do {                    \
     if (nullptr != ptr) { \
-      delete ptr;         \
+      delete[] ptr;       \
       ptr = nullptr;      \
     }                     \
   } while (0)
 
+// In the order of CPUReader::Stage, all on the host's row of a trace //
+static const TimingStats::Stage timing_stages[] = {
+    {"read", 0},
+    {"readFromMemory", 0},
+    {"decode", 0},
+    {"decodeSOF", 0},
+    {"decodeDHT", 0},
+    {"decodeDQT", 0},
+    {"decodeDRI", 0},
+    {"decodeScanCPU", 0},
+    {"skipBlock", 0},
+    {"upsampleAndColourTransform", 0},
+};
+static_assert(sizeof(timing_stages) / sizeof(timing_stages[0]) == CPUReader::NUM_STAGES,
+              "A stage is missing a name");
+
 CPUReader::CPUReader()
     : m_ready_to_decode(false),
       m_buf(nullptr),
+      m_mapped_buf(nullptr),
+      m_mapped_size(0),
       m_error(NO_ERROR),
       m_pixels(nullptr),
+      m_pixels_capacity(0),
       m_restart_interval(0),
-      m_num_bufbits(0) {
+      m_iDCT_kernel(iDCTSelectKernel()),
+      m_pixel_format(PIXEL_FORMAT_RGB24),
+      m_colour_transform_avx2(false),
+      timings(timing_stages, NUM_STAGES, TIMINGSTATS) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  m_colour_transform_avx2 = __builtin_cpu_supports("avx2");
+#endif
   for (auto &channel : m_channels) {
     channel.pixels = nullptr;
+    channel.pixels_capacity = 0;
   }
 }
 
 void CPUReader::read(const char *filename) {
   if (m_ready_to_decode) flush();
+  uint64_t start_time = TimingStats::now();
+
+  // Map the file rather than copying it, so the parser reads straight from the page cache //
+  struct stat file_stat;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) throw std::runtime_error("Failed to create jpg reader");
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size < 6) {
+    close(fd);
+    throw std::runtime_error("Failed to create jpg reader");
+  }
+  m_mapped_size = file_stat.st_size;
+  m_mapped_buf = mmap(NULL, m_mapped_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (m_mapped_buf == MAP_FAILED) {
+    m_mapped_buf = nullptr;
+    throw std::runtime_error("Failed to create jpg reader");
+  }
+  madvise(m_mapped_buf, m_mapped_size, MADV_SEQUENTIAL);
+
+  if (!startParse((const unsigned char *)m_mapped_buf, m_mapped_size)) {
+    unmapFile();
+    throw std::runtime_error("Failed to create jpg reader");
+  }
 
-  FILE *f = NULL;
-  f = fopen(filename, "r");
-  if (NULL == f) goto FAILURE;
-  fseek(f, 0, SEEK_END);
-  m_size = ftell(f);
+  timings.record(stage_read, start_time, m_size);
+}
 
-  m_buf = new unsigned char[m_size];
-  if (NULL == m_buf) goto FAILURE;
-  fseek(f, 0, SEEK_SET);
-  if (fread(m_buf, 1, m_size, f) != m_size) goto FAILURE;
-  fclose(f);
-  f = NULL;
+void CPUReader::readFromMemory(const uint8_t *data, size_t size) {
+  if (m_ready_to_decode) flush();
+  uint64_t start_time = TimingStats::now();
+
+  if (!startParse(data, size)) throw std::runtime_error("Failed to create jpg reader");
+
+  timings.record(stage_readFromMemory, start_time, size);
+}
+
+// Point the parser at a complete JPEG held elsewhere. Nothing is copied //
+bool CPUReader::startParse(const unsigned char *data, size_t size) {
+  if (NULL == data || size < 6) return false;
 
   // Check Magics //
-  if ((m_buf[0] != 0xFF) || (m_buf[1] != 0xD8) || (m_buf[m_size - 2] != 0xFF) || (m_buf[m_size - 1] != 0xD9))
-    goto FAILURE;
+  if ((data[0] != 0xFF) || (data[1] != 0xD8) || (data[size - 2] != 0xFF) || (data[size - 1] != 0xD9))
+    return false;
 
-  if (m_size < 6) goto FAILURE;
+  m_buf = data;
+  m_size = size;
   m_end = m_buf + m_size;
   m_pos = m_buf + 2;
 
   m_ready_to_decode = true;
-  return;
+  return true;
+}
 
-FAILURE:
-  if (NULL != f) fclose(f);
-  SAFEDELETE(m_buf);
-  throw std::runtime_error("Failed to create jpg reader");
+void CPUReader::unmapFile() {
+  if (nullptr != m_mapped_buf) {
+    munmap(m_mapped_buf, m_mapped_size);
+    m_mapped_buf = nullptr;
+    m_mapped_size = 0;
+  }
 }
 
+// The pixel buffers outlive the image, for the next one to reuse //
 void CPUReader::flush() {
-  SAFEDELETE(m_buf);
+  m_buf = nullptr;
+  unmapFile();
+  m_ready_to_decode = false;
+}
+
+CPUReader::~CPUReader() {
+  flush();
   for (auto &channel : m_channels) SAFEDELETE(channel.pixels);
   SAFEDELETE(m_pixels);
-  m_ready_to_decode = false;
 }
 
-CPUReader::~CPUReader() { flush(); }
+// Buffers only ever grow, to fit the largest image the reader has decoded, so once it has seen one as
+// big as the next that decode allocates nothing. Returns false if the memory isn't there //
+bool CPUReader::reserveBuffer(unsigned char *&buffer, size_t &capacity, size_t size) {
+  if (size <= capacity) return true;
+  delete[] buffer;
+  buffer = new (std::nothrow) unsigned char[size];
+  capacity = buffer ? size : 0;
+  return buffer != nullptr;
+}
 
 int CPUReader::decode() {
   if (!m_ready_to_decode) {
     throw std::runtime_error(".read() not called before .decode()");
   }
   // Reset state in case we've already called decode since calling read (e.g. profiling)
-  for (auto &channel : m_channels) {
-    SAFEDELETE(channel.pixels);
-  }
-  SAFEDELETE(m_pixels);
   m_error = NO_ERROR;
   m_restart_interval = 0;
-  m_num_bufbits = 0;
 
-  auto start_time = std::chrono::high_resolution_clock::now();
+  uint64_t start_time = TimingStats::now();
 
   // Main format block parsing loop //
   while (!m_error) {
@@ -96,35 +164,36 @@ int CPUReader::decode() {
     m_pos += 2;
     switch (m_pos[-1]) {
       case 0xC0:
-        callAndTime(&CPUReader::decodeSOF, "decodeSOF");
+        callAndTime(&CPUReader::decodeSOF, stage_decodeSOF);
         break;
       case 0xC4:
-        callAndTime(&CPUReader::decodeDHT, "decodeDHT");
+        callAndTime(&CPUReader::decodeDHT, stage_decodeDHT);
         break;
       case 0xDB:
-        callAndTime(&CPUReader::decodeDQT, "decodeDQT");
+        callAndTime(&CPUReader::decodeDQT, stage_decodeDQT);
         break;
       case 0xDD:
-        callAndTime(&CPUReader::decodeDRI, "decodeDRI");
+        callAndTime(&CPUReader::decodeDRI, stage_decodeDRI);
         break;
       case 0xDA:
-        callAndTime(&CPUReader::decodeScanCPU, "decodeScanCPU");
+        callAndTime(&CPUReader::decodeScanCPU, stage_decodeScanCPU, m_num_MCUs_x * m_num_MCUs_y);
         break;
       case 0xFE:
-        callAndTime(&CPUReader::skipBlock, "skipBlock");
+        callAndTime(&CPUReader::skipBlock, stage_skipBlock);
         break;
       case 0xD9:
         break;
       default:
         if ((m_pos[-1] & 0xF0) == 0xE0)
-          callAndTime(&CPUReader::skipBlock, "skipBlock");
+          callAndTime(&CPUReader::skipBlock, stage_skipBlock);
         else
           m_error = SYNTAX_ERROR;
     }
 
     // Finished //
     if (m_pos[-1] == 0xD9 && m_pos == m_end) {
-      callAndTime(&CPUReader::upsampleAndColourTransform, "upsampleAndColourTransform");
+      callAndTime(&CPUReader::upsampleAndColourTransform, stage_upsampleAndColourTransform,
+                  m_num_MCUs_x * m_num_MCUs_y);
       break;
     }
   }
@@ -134,11 +203,7 @@ int CPUReader::decode() {
     return m_error;
   }
 
-  if (TIMINGSTATS) {
-    auto elapsed = std::chrono::high_resolution_clock::now() - start_time;
-    auto dt = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-    timings["decode"].push_back(dt);
-  }
+  timings.record(stage_decode, start_time, m_size, m_num_MCUs_x * m_num_MCUs_y);
 
   return NO_ERROR;
 }
@@ -149,6 +214,12 @@ void CPUReader::write(const char *filename) {
     printf("Couldn't open output file %s\n", filename);
     return;
   }
+  if (m_num_channels > 1 && m_pixel_format == PIXEL_FORMAT_RGBA32) {
+    fprintf(f, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", m_width, m_height);
+    fwrite(m_pixels, 1, m_width * m_height * 4, f);
+    fclose(f);
+    return;
+  }
   fprintf(f, "P%d\n%d %d\n255\n", (m_num_channels > 1) ? 6 : 5, m_width, m_height);
   fwrite((m_num_channels == 1) ? m_channels[0].pixels : m_pixels, 1, m_width * m_height * m_num_channels, f);
   fclose(f);
@@ -159,7 +230,7 @@ unsigned short CPUReader::read16(const unsigned char *pos) { return (pos[0] << 8
 void CPUReader::skipBlock() { m_pos += read16(m_pos); }
 
 void CPUReader::decodeSOF() {
-  unsigned char *block = m_pos;
+  const unsigned char *block = m_pos;
   unsigned int block_len = read16(block);
   if (block_len < 9 || block + block_len >= m_end) THROW(SYNTAX_ERROR);
   if (block[2] != 8) THROW(UNSUPPORTED_ERROR);
@@ -209,21 +280,20 @@ void CPUReader::decodeSOF() {
         ((chan->height < 3) && (chan->samples_y != samples_y_max)))
       THROW(UNSUPPORTED_ERROR);
 
-    chan->pixels = new unsigned char[chan->stride * m_num_MCUs_y * (chan->samples_y << 3)];
-    if (!chan->pixels) THROW(OOM_ERROR);
+    size_t size = (size_t)chan->stride * m_num_MCUs_y * (chan->samples_y << 3);
+    if (!reserveBuffer(chan->pixels, chan->pixels_capacity, size)) THROW(OOM_ERROR);
   }
   if (m_num_channels == 3) {
-    m_pixels = new unsigned char[m_width * m_height * 3];
-    if (!m_pixels) THROW(OOM_ERROR);
+    if (!reserveBuffer(m_pixels, m_pixels_capacity, (size_t)m_width * m_height * m_pixel_format)) THROW(OOM_ERROR);
   }
 
   m_pos += block_len;
 }
 
 void CPUReader::decodeDHT() {
-  unsigned char *pos = m_pos;
+  const unsigned char *pos = m_pos;
   unsigned int block_len = read16(pos);
-  unsigned char *block_end = pos + block_len;
+  const unsigned char *block_end = pos + block_len;
   if (block_end >= m_end) THROW(SYNTAX_ERROR);
   pos += 2;
 
@@ -234,7 +304,7 @@ void CPUReader::decodeDHT() {
     unsigned char table_id = (val | (val >> 3)) & 3;  // AC and DC
     DhtVlc *vlc = &m_vlc_tables[table_id][0];
 
-    unsigned char *tuple = pos + 17;
+    const unsigned char *tuple = pos + 17;
     int remain = 65536, spread = 65536;
     for (int code_len = 1; code_len <= 16; code_len++) {
       spread >>= 1;
@@ -264,7 +334,7 @@ void CPUReader::decodeDHT() {
 
 void CPUReader::decodeDRI() {
   unsigned int block_len = read16(m_pos);
-  unsigned char *block_end = m_pos + block_len;
+  const unsigned char *block_end = m_pos + block_len;
   if ((block_len < 2) || (block_end >= m_end)) THROW(SYNTAX_ERROR);
   m_restart_interval = read16(m_pos + 2);
   m_pos = block_end;
@@ -272,9 +342,9 @@ void CPUReader::decodeDRI() {
 
 void CPUReader::decodeDQT() {
   unsigned int block_len = read16(m_pos);
-  unsigned char *block_end = m_pos + block_len;
+  const unsigned char *block_end = m_pos + block_len;
   if (block_end >= m_end) THROW(SYNTAX_ERROR);
-  unsigned char *pos = m_pos + 2;
+  const unsigned char *pos = m_pos + 2;
 
   while (pos + 65 <= block_end) {
     unsigned char table_id = pos[0];
@@ -289,33 +359,16 @@ void CPUReader::decodeDQT() {
 
 bool CPUReader::isGreyScale() { return m_num_channels == 1; }
 
+void CPUReader::setPixelFormat(PixelFormat format) { m_pixel_format = format; }
+
 // ----------------- Utilities for timing (profiling) ------------------------ //
 
-void CPUReader::callAndTime(void (CPUReader::*method)(), const std::string name) {
-  if (TIMINGSTATS) {
-    auto t = std::chrono::high_resolution_clock::now();
-    (this->*method)();
-    auto elapsed = std::chrono::high_resolution_clock::now() - t;
-    long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-    timings[name].push_back(microseconds);
-  } else {
-    (this->*method)();
-  }
+// A stage's bytes are how far it moved m_pos //
+void CPUReader::callAndTime(void (CPUReader::*method)(), Stage stage, uint64_t MCUs) {
+  uint64_t start_time = TimingStats::now();
+  const unsigned char *start_pos = m_pos;
+  (this->*method)();
+  timings.record(stage, start_time, m_pos > start_pos ? m_pos - start_pos : 0, MCUs);
 }
 
-void CPUReader::printTimingStats() {
-  printf(
-      "+-------------------------------+-----------+\n"
-      "|                        Method | Time (ms) |\n"
-      "+-------------------------------+-----------+\n");
-  for (const auto &item : timings) {
-    double total_microseconds = std::accumulate(item.second.begin(), item.second.end(), 0.);
-    double avg_milliseconds = total_microseconds / (1000. * item.second.size());
-    if (avg_milliseconds > 0.005) {
-      printf("|%30s | % 9.3f |\n", item.first.c_str(), avg_milliseconds);
-    } else {
-      printf("|%30s |         - |\n", item.first.c_str());
-    }
-  }
-  printf("+-------------------------------+-----------+\n");
-}
\ No newline at end of file
+void CPUReader::printTimingStats() { timings.print(); }
\ No newline at end of file
@@ -1,8 +1,15 @@
 #pragma once
 
+#include <stdint.h>
+
 #include <map>
+#include <string>
 #include <vector>
 
+#include "TimingStats.hpp"
+#include "bitReader.h"
+#include "iDCT.h"
+
 #ifndef TIMINGSTATS
 #define TIMINGSTATS 1
 #endif
@@ -22,6 +29,10 @@ typedef struct _DhtVlc
 } DhtVlc;
 
 
+// Layout of colour output, by bytes per pixel: packed RGB, or RGB with an opaque alpha byte //
+enum PixelFormat { PIXEL_FORMAT_RGB24 = 3, PIXEL_FORMAT_RGBA32 = 4 };
+
+
 typedef struct _ColourChannel
 {
     int id;
@@ -29,16 +40,35 @@ typedef struct _ColourChannel
     int width, height;
     int samples_x, samples_y, stride;
     unsigned char *pixels;
+    size_t pixels_capacity;
     int dc_cumulative_val;
 } ColourChannel;
 
 
 class CPUReader
 {
+public:
+    // What timings keeps a histogram of, with the JPEG bytes consumed and MCUs decoded //
+    enum Stage {
+        stage_read,
+        stage_readFromMemory,
+        stage_decode,
+        stage_decodeSOF,
+        stage_decodeDHT,
+        stage_decodeDQT,
+        stage_decodeDRI,
+        stage_decodeScanCPU,
+        stage_skipBlock,
+        stage_upsampleAndColourTransform,
+        NUM_STAGES
+    };
+
 private:
     bool m_ready_to_decode;
-    unsigned char *m_buf, *m_pos, *m_end;
-    unsigned int m_size;
+    const unsigned char *m_buf, *m_pos, *m_end;
+    void *m_mapped_buf;
+    size_t m_mapped_size;
+    size_t m_size;
     unsigned short m_width, m_height;
     unsigned short m_num_MCUs_x, m_num_MCUs_y;
     unsigned short m_MCU_size_x, m_MCU_size_y;
@@ -46,12 +76,19 @@ private:
     int m_error;
     ColourChannel m_channels[3];
     unsigned char *m_pixels;
+    size_t m_pixels_capacity;
     DhtVlc m_vlc_tables[4][65536];
     unsigned char m_dq_tables[4][64];
     int m_restart_interval;
-    unsigned int m_bufbits;
-    unsigned char m_num_bufbits;
+    BitReader m_bits;
     int m_block_space[64];
+    IDCTKernel m_iDCT_kernel;
+    PixelFormat m_pixel_format;
+    bool m_colour_transform_avx2;
+
+    bool startParse(const unsigned char *data, size_t size);
+    void unmapFile();
+    bool reserveBuffer(unsigned char *&buffer, size_t &capacity, size_t size);
 
     unsigned short read16(const unsigned char *pos);
 
@@ -64,28 +101,31 @@ private:
     void decodeScanCPU();
     void decodeBlock(ColourChannel* channel, unsigned char* out);
     int getVLC(DhtVlc *vlc_table, unsigned char *code);
-    int getBits(int num_bits);
-    int showBits(int num_bits);
 
     void upsampleAndColourTransform();
-    void upsampleChannel(ColourChannel* channel);
+    void upsampleShifts(const ColourChannel* channel, int* xshift, int* yshift);
     void iDCT_row(int* D);
     void iDCT_col(const int* D, unsigned char *out, int stride);
 
-    void callAndTime(void (CPUReader::*method)(), const std::string name);
+    void callAndTime(void (CPUReader::*method)(), Stage stage, uint64_t MCUs = 0);
 
 public:
     CPUReader();
     ~CPUReader();
 
+    // Map the file into memory and parse it in place //
     void read(const char* filename);
+    // Borrow a caller-owned buffer, which must outlive the next decode() //
+    void readFromMemory(const uint8_t* data, size_t size);
     int decode();
     void write(const char* filename);
     void flush();
     bool isGreyScale();
+    // Layout of the colour pixels written by the next decode(). RGB24 by default //
+    void setPixelFormat(PixelFormat format);
 
     void printTimingStats();
-    std::map<std::string, std::vector<long>> timings;
+    TimingStats timings;
 
 };
 
@@ -105,58 +105,128 @@ void CPUReader::iDCT_col(const int *D, unsigned char *out, int stride) {
   *out = clip(((x7 - x1) >> 14) + 128);
 }
 
-void CPUReader::upsampleChannel(ColourChannel *channel) {
-  int x, y, xshift = 0, yshift = 0;
-  unsigned char *out, *lout;
-  while (channel->width < m_width) {
-    channel->width <<= 1;
-    ++xshift;
+// Chroma is upsampled on the fly, by reading each output pixel's samples at (x >> xshift, y >> yshift) //
+void CPUReader::upsampleShifts(const ColourChannel *channel, int *xshift, int *yshift) {
+  int width = channel->width, height = channel->height;
+  for (*xshift = 0; width < m_width; ++*xshift) width <<= 1;
+  for (*yshift = 0; height < m_height; ++*yshift) height <<= 1;
+}
+
+// One row of YCbCr to RGB(A), starting at pixel x. The reference for the vector kernel below //
+static void colourTransformRow(const unsigned char *py, const unsigned char *pcb, const unsigned char *pcr,
+                               const int xshifts[3], int x, int width, unsigned char *out, int bytes_per_pixel) {
+  for (out += x * bytes_per_pixel; x < width; ++x, out += bytes_per_pixel) {
+    int y = py[x >> xshifts[0]] << 8;
+    int cb = pcb[x >> xshifts[1]] - 128;
+    int cr = pcr[x >> xshifts[2]] - 128;
+    out[0] = clip((y + 359 * cr + 128) >> 8);
+    out[1] = clip((y - 88 * cb - 183 * cr + 128) >> 8);
+    out[2] = clip((y + 454 * cb + 128) >> 8);
+    if (bytes_per_pixel == 4) out[3] = 0xFF;
   }
-  while (channel->height < m_height) {
-    channel->height <<= 1;
-    ++yshift;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+
+// Byte shuffles that interleave 16 R, G and B values into three 16 byte chunks of RGB24 //
+struct RGBInterleave {
+  __m128i masks[3][3];  // [chunk][component]
+  RGBInterleave() {
+    for (int chunk = 0; chunk < 3; ++chunk) {
+      for (int component = 0; component < 3; ++component) {
+        alignas(16) signed char mask[16];
+        for (int i = 0; i < 16; ++i) {
+          int byte = chunk * 16 + i;
+          mask[i] = (byte % 3 == component) ? byte / 3 : -128;
+        }
+        masks[chunk][component] = _mm_load_si128((const __m128i *)mask);
+      }
+    }
   }
-  out = new unsigned char[channel->width * channel->height];
-  if (!out) THROW(OOM_ERROR);
+};
 
-  for (y = 0, lout = out; y < channel->height; ++y, lout += channel->width) {
-    unsigned char *lin = &channel->pixels[(y >> yshift) * channel->stride];
-    for (x = 0; x < channel->width; ++x) lout[x] = lin[x >> xshift];
+// 16 samples of a row whose samples are repeated 1 << xshift times, for xshift 0 or 1 //
+static inline __attribute__((target("avx2"))) __m256i loadSamples(const unsigned char *row, int x, int xshift) {
+  __m128i samples;
+  if (xshift) {
+    samples = _mm_loadl_epi64((const __m128i *)&row[x >> 1]);
+    samples = _mm_unpacklo_epi8(samples, samples);
+  } else {
+    samples = _mm_loadu_si128((const __m128i *)&row[x]);
   }
+  return _mm256_cvtepu8_epi16(samples);
+}
 
-  channel->stride = channel->width;
-  delete channel->pixels;
-  channel->pixels = out;
+static inline __attribute__((target("avx2"))) __m128i packPixels(__m256i values) {
+  return _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(values, values), 0x08));
 }
 
-void CPUReader::upsampleAndColourTransform() {
-  int i;
-  ColourChannel *channel;
-  for (i = 0, channel = &m_channels[0]; i < m_num_channels; ++i, ++channel) {
-    if ((channel->width < m_width) || (channel->height < m_height)) upsampleChannel(channel);
-    if ((channel->width < m_width) || (channel->height < m_height)) {
-      fprintf(stderr, "Logical error?\n");
-      THROW(SYNTAX_ERROR);
+// 16 pixels at a time in 16 bit lanes. The integer formula is split so every term fits, without
+// changing the result: 256y + 359cr + 128 >> 8 is y + cr + (103cr + 128 >> 8), and likewise
+// -183cr = -256cr + 73cr and 454cb = 512cb - 58cb. Saturating packs do the clipping. Handles luma at
+// full width and chroma at full or half width, and returns the first pixel left to the scalar row //
+static __attribute__((target("avx2"))) int colourTransformRowAVX2(const unsigned char *py, const unsigned char *pcb,
+                                                                  const unsigned char *pcr, const int xshifts[3],
+                                                                  int width, unsigned char *out,
+                                                                  int bytes_per_pixel) {
+  if (xshifts[0] || xshifts[1] > 1 || xshifts[2] > 1) return 0;
+  static const RGBInterleave interleave;
+  const __m256i k128 = _mm256_set1_epi16(128);
+  const __m128i alpha = _mm_set1_epi8((char)0xFF);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m256i y = loadSamples(py, x, 0);
+    __m256i cb = _mm256_sub_epi16(loadSamples(pcb, x, xshifts[1]), k128);
+    __m256i cr = _mm256_sub_epi16(loadSamples(pcr, x, xshifts[2]), k128);
+
+    __m256i r_terms = _mm256_mullo_epi16(cr, _mm256_set1_epi16(103));
+    __m256i g_terms = _mm256_sub_epi16(_mm256_mullo_epi16(cr, _mm256_set1_epi16(73)),
+                                       _mm256_mullo_epi16(cb, _mm256_set1_epi16(88)));
+    __m256i b_terms = _mm256_mullo_epi16(cb, _mm256_set1_epi16(-58));
+    __m256i r = _mm256_add_epi16(_mm256_add_epi16(y, cr), _mm256_srai_epi16(_mm256_add_epi16(r_terms, k128), 8));
+    __m256i g = _mm256_add_epi16(_mm256_sub_epi16(y, cr), _mm256_srai_epi16(_mm256_add_epi16(g_terms, k128), 8));
+    __m256i b = _mm256_add_epi16(_mm256_add_epi16(y, _mm256_add_epi16(cb, cb)),
+                                 _mm256_srai_epi16(_mm256_add_epi16(b_terms, k128), 8));
+    __m128i r8 = packPixels(r), g8 = packPixels(g), b8 = packPixels(b);
+
+    if (bytes_per_pixel == 4) {
+      __m128i rg_low = _mm_unpacklo_epi8(r8, g8), rg_high = _mm_unpackhi_epi8(r8, g8);
+      __m128i ba_low = _mm_unpacklo_epi8(b8, alpha), ba_high = _mm_unpackhi_epi8(b8, alpha);
+      __m128i *rgba = (__m128i *)&out[x * 4];
+      _mm_storeu_si128(&rgba[0], _mm_unpacklo_epi16(rg_low, ba_low));
+      _mm_storeu_si128(&rgba[1], _mm_unpackhi_epi16(rg_low, ba_low));
+      _mm_storeu_si128(&rgba[2], _mm_unpacklo_epi16(rg_high, ba_high));
+      _mm_storeu_si128(&rgba[3], _mm_unpackhi_epi16(rg_high, ba_high));
+    } else {
+      __m128i *rgb = (__m128i *)&out[x * 3];
+      for (int chunk = 0; chunk < 3; ++chunk) {
+        const __m128i *masks = interleave.masks[chunk];
+        __m128i bytes = _mm_or_si128(_mm_shuffle_epi8(r8, masks[0]), _mm_shuffle_epi8(g8, masks[1]));
+        _mm_storeu_si128(&rgb[chunk], _mm_or_si128(bytes, _mm_shuffle_epi8(b8, masks[2])));
+      }
     }
   }
+  return x;
+}
+#endif
+
+void CPUReader::upsampleAndColourTransform() {
   if (m_num_channels == 3) {
-    // convert to RGB //
+    // Convert to RGB, upsampling the chroma as it is read rather than into planes of its own //
+    const unsigned char *rows[3];
+    int xshifts[3], yshifts[3];
+    for (int i = 0; i < 3; ++i) upsampleShifts(&m_channels[i], &xshifts[i], &yshifts[i]);
     unsigned char *prgb = m_pixels;
-    const unsigned char *py = m_channels[0].pixels;
-    const unsigned char *pcb = m_channels[1].pixels;
-    const unsigned char *pcr = m_channels[2].pixels;
-    for (int yy = m_height; yy; --yy) {
-      for (int x = 0; x < m_width; ++x) {
-        register int y = py[x] << 8;
-        register int cb = pcb[x] - 128;
-        register int cr = pcr[x] - 128;
-        *prgb++ = clip((y + 359 * cr + 128) >> 8);
-        *prgb++ = clip((y - 88 * cb - 183 * cr + 128) >> 8);
-        *prgb++ = clip((y + 454 * cb + 128) >> 8);
+    for (int y = 0; y < m_height; ++y, prgb += m_width * m_pixel_format) {
+      for (int i = 0; i < 3; ++i) rows[i] = &m_channels[i].pixels[(y >> yshifts[i]) * m_channels[i].stride];
+      int x = 0;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+      if (m_colour_transform_avx2) {
+        x = colourTransformRowAVX2(rows[0], rows[1], rows[2], xshifts, m_width, prgb, m_pixel_format);
       }
-      py += m_channels[0].stride;
-      pcb += m_channels[1].stride;
-      pcr += m_channels[2].stride;
+#endif
+      colourTransformRow(rows[0], rows[1], rows[2], xshifts, x, m_width, prgb, m_pixel_format);
     }
   } else if (m_channels[0].width != m_channels[0].stride) {
     // grayscale -> only remove stride
@@ -4,7 +4,7 @@
 #include "CPUReader.hpp"
 
 void CPUReader::decodeScanCPU() {
-  unsigned char *pos = m_pos;
+  const unsigned char *pos = m_pos;
   unsigned int header_len = read16(pos);
   if (pos + header_len >= m_end) THROW(SYNTAX_ERROR);
   pos += 2;
@@ -20,7 +20,8 @@ void CPUReader::decodeScanCPU() {
     channel->ac_id = (pos[1] & 1) | 2;
   }
   if (pos[0] || (pos[1] != 63) || pos[2]) THROW(UNSUPPORTED_ERROR);
-  pos = m_pos = m_pos + header_len;
+  m_pos += header_len;
+  bitReaderStart(&m_bits, m_pos, m_end);
 
   int restart_count = m_restart_interval;
 
@@ -36,6 +37,7 @@ void CPUReader::decodeScanCPU() {
                            block_x * channel->samples_x + sample_x)
                           << 3;
             decodeBlock(channel, &channel->pixels[out_pos]);
+            if (m_bits.error) THROW(m_bits.error);
             if (m_error) return;
           }
         }
@@ -43,8 +45,8 @@ void CPUReader::decodeScanCPU() {
 
       if (m_restart_interval && !(--restart_count)) {
         // Byte align //
-       m_num_bufbits &= 0xF8;
-        int marker_bits = getBits(16);
+        bitReaderAlign(&m_bits);
+        int marker_bits = bitReaderGet(&m_bits, 16);
         if ((marker_bits & 0xFF00) != 0xFF00) {
           THROW(SYNTAX_ERROR);
         }
@@ -53,6 +55,7 @@ void CPUReader::decodeScanCPU() {
       }
     }
   }
+  m_pos = m_bits.pos;
 }
 
 void CPUReader::decodeBlock(ColourChannel *channel, unsigned char *out) {
@@ -75,70 +78,22 @@ void CPUReader::decodeBlock(ColourChannel *channel, unsigned char *out) {
   } while (coef < 63);
 
   // Invert the DCT //
+  if (m_iDCT_kernel.block_int) {
+    m_iDCT_kernel.block_int(block, out, channel->stride);
+    return;
+  }
   for (coef = 0; coef < 64; coef += 8) iDCT_row(&block[coef]);
   for (coef = 0; coef < 8; ++coef) iDCT_col(&block[coef], &out[coef], channel->stride);
 }
 
 int CPUReader::getVLC(DhtVlc *vlc_table, unsigned char *code) {
-  int symbol = showBits(16);
+  int symbol = bitReaderShow(&m_bits, 16);
   DhtVlc vlc = vlc_table[symbol];
   if (!vlc.num_bits) {
     m_error = SYNTAX_ERROR;
     return 0;
   }
-  m_num_bufbits -= vlc.num_bits;
+  m_bits.num_bufbits -= vlc.num_bits;
   if (code) *code = vlc.tuple;
-  unsigned char num_bits = vlc.tuple & 0x0F;
-  if (!num_bits) return 0;
-  int value = getBits(num_bits);
-  if (value < (1 << (num_bits - 1))) value += ((-1) << num_bits) + 1;
-  return value;
-}
-
-// This only shows the bits, but doesn't move past them //
-int CPUReader::showBits(int num_bits) {
-  unsigned char newbyte;
-  if (!num_bits) return 0;
-
-  while (m_num_bufbits < num_bits) {
-    if (m_pos >= m_end) {
-      m_bufbits = (m_bufbits << 8) | 0xFF;
-      m_num_bufbits += 8;
-      continue;
-    }
-    newbyte = *m_pos++;
-    m_bufbits = (m_bufbits << 8) | newbyte;
-    m_num_bufbits += 8;
-    if (newbyte != 0xFF) continue;
-
-    if (m_pos >= m_end) goto FAILURE;
-
-    // Handle byte stuffing //
-    unsigned char follow_byte = *m_pos++;
-    switch (follow_byte) {
-      case 0x00:
-      case 0xFF:
-      case 0xD9:
-        break;
-      default:
-        if ((follow_byte & 0xF8) != 0xD0) {
-          goto FAILURE;
-        } else {
-          m_bufbits = (m_bufbits << 8) | newbyte;
-          m_num_bufbits += 8;
-        }
-    }
-  }
-  return (m_bufbits >> (m_num_bufbits - num_bits)) & ((1 << num_bits) - 1);
-
-FAILURE:
-  m_error = SYNTAX_ERROR;
-  return 0;
-}
-
-// Show the bits AND move past them //
-int CPUReader::getBits(int num_bits) {
-  int res = showBits(num_bits);
-  m_num_bufbits -= num_bits;
-  return res;
+  return bitReaderGetValue(&m_bits, vlc.tuple & 0x0F);
 }
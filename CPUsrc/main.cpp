@@ -1,9 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <atomic>
+#include <fstream>
+#include <iterator>
 #include <memory>
+#include <new>
+#include <vector>
 
 #include "CPUReader.hpp"
 
+// Global allocation counter. The reader keeps its planes between images, so the timed loop below
+// should see none //
+static std::atomic<long> g_allocations(0);
+
+void *operator new(size_t size) {
+  ++g_allocations;
+  if (void *ptr = malloc(size ? size : 1)) return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
 
 int main(int argc, char** argv) {
   if (argc < 2) {
@@ -18,16 +36,26 @@ int main(int argc, char** argv) {
   reader->write(reader->isGreyScale() ? "outfile.pgm" : "outfile.ppm");
 
   if (TIMINGSTATS) {
-    // Warmup
+    // Warmup //
     for (auto i = 0; i < 20; ++i) {
       reader->read(filename);
       reader->decode();
     }
-    reader->timings.clear();
+    reader->timings.reset();
+    long allocations_before = g_allocations;
     for (auto i = 0; i < 100; ++i) {
       reader->read(filename);
       reader->decode();
     }
+    printf("Heap allocations per decode after warmup: %.2f\n", (g_allocations - allocations_before) / 100.);
+
+    // Same again, but decoding from a buffer the caller already holds in memory //
+    std::ifstream file(filename, std::ios::binary);
+    std::vector<uint8_t> file_bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    for (auto i = 0; i < 100; ++i) {
+      reader->readFromMemory(file_bytes.data(), file_bytes.size());
+      reader->decode();
+    }
     reader->printTimingStats();
   }
 
@@ -8,6 +8,8 @@
 #endif
 
 #include "format.h"
+#include "bitReader.h"
+#include "iDCT.h"
 
 #define NO_ERROR 0
 #define SYNTAX_ERROR 1
@@ -62,9 +64,9 @@ typedef struct _JPG {
   DhtVlcNode vlc_trees[4][MAX_DHTVLC_NODES];
   unsigned char dq_tables[4][64];
   int restart_interval;
-  unsigned int bufbits;
-  unsigned char num_bufbits;
+  BitReader bits;
   int block_space[64];
+  IDCTKernel idct_kernel;
   unsigned char* scratch_space;
   unsigned int scratch_size, scratch_pos;
 } JPG;
@@ -79,8 +81,6 @@ void decodeDHT(JPG* jpg);
 void decodeDQT(JPG *jpg);
 void decodeDRI(JPG *jpg);
 unsigned short read16(const unsigned char *pos);
-int showBits(JPG* jpg, int num_bits);
-int getBits(JPG* jpg, int num_bits);
 int getVLC(JPG* jpg, int dht_id, unsigned char* code);
 void decodeBlock(JPG* jpg, ColourChannel* c, unsigned char* out);
 void decodeScanCPU(JPG* jpg);
@@ -317,6 +317,7 @@ int readJPG(
   jpg.end = jpg.buf + insize;
   jpg.pos = jpg.buf + 2;
   jpg.error = NO_ERROR;
+  jpg.idct_kernel = iDCTSelectKernel();
 
   // Check Magics //
   if((jpg.buf[0]        != 0xFF) || (jpg.buf[1]        != 0xD8) ||
@@ -378,69 +379,15 @@ int readJPG(
 }
 
 
-// This only shows the bits, but doesn't move past them //
-int showBits(JPG* jpg, int num_bits){
-  unsigned char newbyte;
-  if(!num_bits) return 0;
-
-  while (jpg->num_bufbits < num_bits){
-    if(jpg->pos >= jpg->end){
-      jpg->bufbits = (jpg->bufbits << 8) | 0xFF;
-      jpg->num_bufbits += 8;
-      continue;
-    }
-    newbyte = *jpg->pos++;
-    jpg->bufbits = (jpg->bufbits << 8) | newbyte;
-    jpg->num_bufbits += 8;
-    if (newbyte != 0xFF)
-      continue;
-	
-    if(jpg->pos >= jpg->end)
-      goto overflow_error;
-    
-    // Handle byte stuffing //
-    unsigned char follow_byte = *jpg->pos++;
-    switch (follow_byte){
-    case 0x00:
-    case 0xFF:
-    case 0xD9:
-      break;
-    default:
-      if ((follow_byte & 0xF8) != 0xD0){
-	printf("The follow_byte case that doesn't have to be 0x00?\n");
-	goto overflow_error;
-      } else {
-	printf("The acceptable non-zero followbyte case?\n");
-	jpg->bufbits = (jpg->bufbits << 8) | newbyte;
-	jpg->num_bufbits += 8;
-      }
-    }
-  }
-  return (jpg->bufbits >> (jpg->num_bufbits - num_bits)) & ((1 << num_bits) - 1);
-
- overflow_error:
-  printf("Huffman decode overflow?\n");
-  jpg->error = SYNTAX_ERROR;
-  return 0;
-}
-
 // ----------------------------------------------------------------------------------------------- //
 // --------------------------------------- DECODE SCAN ------------------------------------------- //
 // ----------------------------------------------------------------------------------------------- //
 
 
-// Show the bits AND move past them //
-int getBits(JPG* jpg, int num_bits){
-  int res = showBits(jpg, num_bits);
-  jpg->num_bufbits -= num_bits;
-  return res;
-}
-
-
 int getVLC(JPG* jpg, int dht_id, unsigned char* code){
 
   // Decode huffman tree
-  int bits = showBits(jpg, 16);
+  int bits = bitReaderShow(&jpg->bits, 16);
   DhtVlcNode *tree = &jpg->vlc_trees[dht_id][0];
   unsigned current_node = 0;
   int bits_used = 0;
@@ -451,16 +398,11 @@ int getVLC(JPG* jpg, int dht_id, unsigned char* code){
     if (tree[current_node].children[0] == 0) break;
   }
   unsigned char tuple = tree[current_node].tuple;
-  jpg->num_bufbits -= bits_used;
+  jpg->bits.num_bufbits -= bits_used;
 
   // Extract value bit according to tuple
   if(code) *code = tuple;
-  unsigned char val_bits = tuple & 0x0F;
-  if (!val_bits) return 0;
-  int value = getBits(jpg, val_bits);
-  if (value < (1 << (val_bits - 1)))
-    value += ((-1) << val_bits) + 1;
-  return value; 
+  return bitReaderGetValue(&jpg->bits, tuple & 0x0F);
 }
 
 
@@ -484,6 +426,10 @@ void decodeBlock(JPG* jpg, ColourChannel* channel, unsigned char* out){
   } while(coef < 63);
 
   // Invert the DCT //
+  if (jpg->idct_kernel.block_int) {
+    jpg->idct_kernel.block_int(block, out, channel->stride);
+    return;
+  }
   for (coef = 0;  coef < 64;  coef += 8)
     iDCT_row(&block[coef]);
   for (coef = 0;  coef < 8;  ++coef)
@@ -507,7 +453,8 @@ void decodeScanCPU(JPG* jpg){
     channel->ac_id = (pos[1] & 1) | 2;
   }
   if (pos[0] || (pos[1] != 63) || pos[2]) THROW(UNSUPPORTED_ERROR);
-  pos = jpg->pos = jpg->pos + header_len;
+  jpg->pos += header_len;
+  bitReaderStart(&jpg->bits, jpg->pos, jpg->end);
 
 
   int restart_interval = jpg->restart_interval;
@@ -528,6 +475,7 @@ void decodeScanCPU(JPG* jpg){
             int out_pos = ((block_y * channel->samples_y + sample_y) * channel->stride
               + block_x * channel->samples_x + sample_x) << 3;
             decodeBlock(jpg, channel, &channel->pixels[out_pos]);
+            if (jpg->bits.error) THROW(jpg->bits.error);
             if (jpg->error) return;
           }
         }
@@ -535,8 +483,8 @@ void decodeScanCPU(JPG* jpg){
 
       if (restart_interval && !(--restart_count)){
         // Byte align //
-        jpg->num_bufbits &= 0xF8;
-        i = getBits(jpg, 16);
+        bitReaderAlign(&jpg->bits);
+        i = bitReaderGet(&jpg->bits, 16);
         if (((i & 0xFFF8) != 0xFFD0) || ((i & 7) != next_restart_index)) 
           THROW(SYNTAX_ERROR);
         next_restart_index = (next_restart_index + 1) & 7;
@@ -546,7 +494,7 @@ void decodeScanCPU(JPG* jpg){
       }
     }
   }
- 
+  jpg->pos = jpg->bits.pos;
 }
 
 
@@ -1,63 +1,176 @@
 #include "JPGReader.hpp"
 
+#include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include <chrono>
-#include <numeric>
+#include <algorithm>
 #include <stdexcept>
 
-JPGReader::JPGReader(poplar::Device &ipuDevice, bool do_iDCT_on_IPU, bool m_do_decompress_on_IPU)
-    : m_ready_to_decode(false),
-      m_do_iDCT_on_IPU(do_iDCT_on_IPU),
-      m_do_decompress_on_IPU(m_do_decompress_on_IPU),
+// In the order of JPGReader::Stage. Device runs go on a row of the trace of their own //
+static const TimingStats::Stage timing_stages[] = {
+    {"read", 0},
+    {"readFromMemory", 0},
+    {"decode", 0},
+    {"decodeInto", 0},
+    {"decodeBatch", 0},
+    {"decodeHost", 0},
+    {"decodeSOF", 0},
+    {"decodeDHT", 0},
+    {"decodeDQT", 0},
+    {"decodeDRI", 0},
+    {"decodeScanCPU", 0},
+    {"decodeScanProgressive", 0},
+    {"finishProgressive", 0},
+    {"skipBlock", 0},
+    {"indexScan", 0},
+    {"packScanSegments", 0},
+    {"packCoefficients", 0},
+    {"upsampleAndColourTransformIPU", 0},
+    {"ipuRun", 1},
+    {"ipuCopyParams", 1},
+    {"ipuCopyPacked", 1},
+    {"ipuCopyY", 1},
+    {"ipuCopyCb", 1},
+    {"ipuCopyCr", 1},
+    {"ipuHuffman", 1},
+    {"ipuPostprocess", 1},
+    {"ipuRasterGather", 1},
+    {"ipuCopyPixels", 1},
+    {"ipuPostprocessFastestTile", -1},
+    {"ipuPostprocessSlowestTile", -1},
+    {"buildIpuGraph", 0},
+};
+static_assert(sizeof(timing_stages) / sizeof(timing_stages[0]) == JPGReader::NUM_STAGES,
+              "A stage is missing a name");
+
+JPGReader::JPGReader(poplar::Device &ipuDevice, bool do_iDCT_on_IPU, bool do_decompress_on_IPU,
+                     const std::string &executable_cache_dir, bool profile_IPU)
+    : timings(timing_stages, NUM_STAGES, TIMINGSTATS),
+      m_ready_to_decode(false),
+      m_do_iDCT_on_IPU(do_iDCT_on_IPU || do_decompress_on_IPU),
+      m_do_decompress_on_IPU(do_decompress_on_IPU),
+      m_progressive(false),
+      m_allow_streaming(true),
+      m_raster_on_IPU(false),
+      m_output_format(PixelFormat::RGB24),
+      m_streamed(false),
+      m_strip_MCU_rows(0),
+      m_executable_cache_dir(executable_cache_dir),
+      m_profile_IPU(profile_IPU),
+      m_IPU_cycles_per_microsecond(ipuDevice.getTarget().getTileClockFrequency() / 1e6),
+      m_IPU_cycle_stamps(2 * (NUM_IPU_PHASES + 1)),
       m_ipu_graph(ipuDevice.getTarget()),
-      m_num_tiles(ipuDevice.getTarget().getNumTiles() * THREADS_PER_TILE),
+      m_num_IPUs(ipuDevice.getTarget().getNumIPUs()),
+      m_tiles_per_IPU(ipuDevice.getTarget().getTilesPerIPU() * THREADS_PER_TILE),
+      m_num_tiles(m_num_IPUs * m_tiles_per_IPU),
+      m_IPU_pixels(m_tiles_per_IPU * MAX_PIXELS_PER_TILE),
       m_max_pixels(m_num_tiles * MAX_PIXELS_PER_TILE),
+      m_IPU_params_table(m_num_IPUs * PARAMS_SIZE),
+      m_IPU_quant_table(m_num_IPUs * 3 * 64),
+      m_IPU_huffman_table(m_do_decompress_on_IPU ? m_num_IPUs * 4 * HUFFMAN_TABLE_SIZE : 0),
+      m_buf(nullptr),
+      m_mapped_buf(nullptr),
+      m_mapped_size(0),
+      m_first_IPU(0),
+      m_image_IPUs(m_num_IPUs),
+      m_first_tile(0),
       m_error(NO_ERROR),
+      m_min_scale_shift(0),
+      m_scale_shift(0),
       m_pixels(m_max_pixels * 3),
+      m_coefficient_format(coefficients_dense),
+      m_packed_bytes(m_num_tiles * PACKED_BYTES_PER_TILE),
+      m_inflight_packed_bytes(m_num_tiles * PACKED_BYTES_PER_TILE),
+      m_huffman_tables(4 * HUFFMAN_TABLE_SIZE),
       m_restart_interval(0),
-      m_num_bufbits(0) {
-  for (auto &channel : m_channels) {
-    channel.pixels.resize(m_max_pixels);
-    channel.frequencies.resize(m_max_pixels);
+      m_thread_pool(new ThreadPool(std::max(1u, std::thread::hardware_concurrency()))),
+      m_packing(false),
+      m_next_IPU(0),
+      m_iDCT_kernel(iDCTSelectKernel()) {
+  for (int c = 0; c < 3; ++c) {
+    m_channels[c].pixels.resize(m_max_pixels);
+    m_channels[c].frequencies.resize(m_max_pixels);
+    m_inflight_pixels[c].resize(m_max_pixels);
+    m_inflight_frequencies[c].resize(m_max_pixels);
   }
+  m_upsample_buffer.resize(m_max_pixels);
+  if (m_profile_IPU) m_postprocess_cycles.resize(m_num_tiles);
+  if (m_do_decompress_on_IPU) m_huffman_errors.resize(m_num_tiles);
+  memset(m_dht_code_counts, 0, sizeof(m_dht_code_counts));
   buildIpuGraph(ipuDevice);
 };
 
 void JPGReader::read(const char *filename) {
   if (m_ready_to_decode) flush();
+  uint64_t start_time = TimingStats::now();
+
+  // Map the file rather than copying it, so the parser reads straight from the page cache //
+  struct stat file_stat;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) throw std::runtime_error("Failed to read file");
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size < 6) {
+    close(fd);
+    throw std::runtime_error("Failed to read file");
+  }
+  m_mapped_size = file_stat.st_size;
+  m_mapped_buf = mmap(NULL, m_mapped_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (m_mapped_buf == MAP_FAILED) {
+    m_mapped_buf = nullptr;
+    throw std::runtime_error("Failed to read file");
+  }
+  madvise(m_mapped_buf, m_mapped_size, MADV_SEQUENTIAL);
 
-  FILE *f = NULL;
-  f = fopen(filename, "r");
-  if (NULL == f) goto FAILURE;
-  fseek(f, 0, SEEK_END);
-  m_size = ftell(f);
+  if (!startParse((const unsigned char *)m_mapped_buf, m_mapped_size)) {
+    unmapFile();
+    throw std::runtime_error("Failed to read file");
+  }
 
-  m_buf = std::vector<unsigned char>(m_size);
-  fseek(f, 0, SEEK_SET);
-  if (fread(m_buf.data(), 1, m_size, f) != m_size) goto FAILURE;
-  fclose(f);
-  f = NULL;
+  timings.record(stage_read, start_time, m_size);
+}
+
+void JPGReader::readFromMemory(const uint8_t *data, size_t size) {
+  if (m_ready_to_decode) flush();
+  uint64_t start_time = TimingStats::now();
+
+  if (!startParse(data, size)) throw std::runtime_error("Failed to read buffer");
+
+  timings.record(stage_readFromMemory, start_time, size);
+}
+
+// Point the parser at a complete JPEG held elsewhere. Nothing is copied //
+bool JPGReader::startParse(const unsigned char *data, size_t size) {
+  if (NULL == data || size < 6) return false;
 
   // Check Magics //
-  if ((m_buf[0] != 0xFF) || (m_buf[1] != 0xD8) || (m_buf[m_size - 2] != 0xFF) || (m_buf[m_size - 1] != 0xD9))
-    goto FAILURE;
+  if ((data[0] != 0xFF) || (data[1] != 0xD8) || (data[size - 2] != 0xFF) || (data[size - 1] != 0xD9))
+    return false;
 
-  if (m_size < 6) goto FAILURE;
-  m_end = m_buf.data() + m_size;
-  m_pos = m_buf.data() + 2;
+  m_buf = data;
+  m_size = size;
+  m_end = m_buf + m_size;
+  m_pos = m_buf + 2;
 
   m_ready_to_decode = true;
-  return;
+  return true;
+}
 
-FAILURE:
-  if (NULL != f) fclose(f);
-  throw std::runtime_error("Failed to read file");
+void JPGReader::unmapFile() {
+  if (nullptr != m_mapped_buf) {
+    munmap(m_mapped_buf, m_mapped_size);
+    m_mapped_buf = nullptr;
+    m_mapped_size = 0;
+  }
 }
 
 void JPGReader::flush() {
   m_ready_to_decode = false;
-  m_buf.clear();
+  m_buf = nullptr;
+  m_pos = m_end = nullptr;
+  unmapFile();
 }
 
 JPGReader::~JPGReader() { flush(); }
@@ -66,13 +179,213 @@ int JPGReader::decode() {
   if (!m_ready_to_decode) {
     throw std::runtime_error(".read() not called before .decode()");
   }
+  uint64_t start_time = TimingStats::now();
+
+  m_output_format = PixelFormat::RGB24;
+  decodeHost();
+  // A streamed image has already been through the device, strip by strip //
+  if (!m_error && !m_streamed) {
+    callAndTime(&JPGReader::upsampleAndColourTransformIPU, stage_upsampleAndColourTransformIPU,
+                m_num_MCUs_x * m_num_MCUs_y);
+  }
+
+  if (m_error) {
+    fprintf(stderr, "Decode failed with error code %d\n", m_error);
+    return m_error;
+  }
+
+  timings.record(stage_decode, start_time, m_size, m_num_MCUs_x * m_num_MCUs_y);
+
+  return NO_ERROR;
+}
+
+// Like decode(), but the pixels end up in the caller's buffer, converted on the way out of m_pixels, or
+// for a streamed image out of the strips assembled in m_raster_pixels. The device skips the colour
+// transform for formats that want YCbCr //
+int JPGReader::decodeInto(uint8_t *dst, size_t stride, PixelFormat format) {
+  if (!m_ready_to_decode) {
+    throw std::runtime_error(".read() not called before .decodeInto()");
+  }
+  uint64_t start_time = TimingStats::now();
+
+  m_output_format = format;
+  decodeHost();
+  if (m_error) {
+    fprintf(stderr, "Decode failed with error code %d\n", m_error);
+    return m_error;
+  }
+
+  const int bytes_per_pixel[] = {3, 3, 4, 4, 1, 1, 1};
+  size_t min_stride = (size_t)m_width * bytes_per_pixel[(int)format];
+  // Chroma rows are half the stride for I420, and hold a whole pair for an odd last column //
+  if (format == PixelFormat::I420 || format == PixelFormat::NV12) min_stride = ((m_width + 1) / 2) * 2;
+  if (stride < min_stride) throw std::runtime_error("decodeInto() stride is too small for the image");
+
+  if (m_streamed) {
+    for (int y = 0; y < m_height; ++y) {
+      storePixelRun(&m_raster_pixels[(size_t)y * m_width * 3], m_width, 0, y, dst, stride, format, m_height);
+    }
+  } else {
+    uint64_t device_start_time = TimingStats::now();
+    packCoefficients(m_num_MCUs_x * m_num_MCUs_y);
+    stageIPUInputs();
+    size_t size = stride * m_height;
+    int direct_IPUs = 0;
+    if (format == PixelFormat::RGB24 && rasterStride() * 3u == stride) direct_IPUs = connectOutputBuffer(dst, size);
+    // Whatever the run does, later ones must not write to dst, which the caller may free //
+    auto reconnect_direct_IPUs = [&]() {
+      for (int ipu = m_first_IPU; ipu < m_first_IPU + direct_IPUs; ++ipu) {
+        connectPixelStreams(ipu, &m_pixels[ipu * m_IPU_pixels * 3]);
+      }
+    };
+    try {
+      runProgram(this, postprocessProgram(subsamplingMode()));
+    } catch (...) {
+      reconnect_direct_IPUs();
+      throw;
+    }
+    reconnect_direct_IPUs();
+    if (direct_IPUs) {
+      // The rows were already in place, the IPUs whose copies didn't fit just left theirs in m_pixels //
+      size_t direct_size = std::min(size, (size_t)direct_IPUs * m_IPU_pixels * 3);
+      memcpy(dst + direct_size, &m_pixels[(size_t)m_first_tile * MAX_PIXELS_PER_TILE * 3 + direct_size], size - direct_size);
+    } else {
+      linearisePixels(currentLayout(), dst, stride, format);
+    }
+    timings.record(stage_upsampleAndColourTransformIPU, device_start_time, 0, m_num_MCUs_x * m_num_MCUs_y);
+    if (m_coefficient_format == coefficients_huffman && huffmanFailed(currentLayout())) {
+      m_error = SYNTAX_ERROR;
+      fprintf(stderr, "Decode failed with error code %d\n", m_error);
+      return m_error;
+    }
+  }
+
+  timings.record(stage_decodeInto, start_time, m_size, m_num_MCUs_x * m_num_MCUs_y);
+
+  return NO_ERROR;
+}
+
+// Point the pixel streams of the current image's IPUs at the caller's buffer, as far as the copies they
+// will make fit in its size bytes. The image's raster rows start at its first IPU's slice, and each IPU
+// copies a whole transfer size, so usually all but the last of a big image's do. Returns how many //
+int JPGReader::connectOutputBuffer(unsigned char *outbuf, size_t size) {
+  const int N = NUM_TRANSFER_SIZES;
+  int num_IPUs = 0;
+  for (; num_IPUs < m_image_IPUs; ++num_IPUs) {
+    int transfer_size = m_IPU_params_table[(m_first_IPU + num_IPUs) * PARAMS_SIZE + param_transfer_size];
+    if (!transfer_size) break;
+    size_t end = (size_t)num_IPUs * m_IPU_pixels * 3 + transferTiles((transfer_size - 1) % N) * MAX_PIXELS_PER_TILE * 3;
+    if (end > size) break;
+    connectPixelStreams(m_first_IPU + num_IPUs, &outbuf[(size_t)num_IPUs * m_IPU_pixels * 3]);
+  }
+  return num_IPUs;
+}
+
+void JPGReader::connectPixelStreams(unsigned ipu, unsigned char *pixels) {
+  for (unsigned size = 0; size < NUM_TRANSFER_SIZES; ++size) {
+    m_ipuEngine->connectStream(m_pixel_stream_names[ipu * NUM_TRANSFER_SIZES + size], pixels);
+  }
+}
+
+// Every device run goes through here, from the host thread or a BackgroundJob, so each shows up in the
+// trace on the device's row //
+void JPGReader::runProgram(void *reader, unsigned program) {
+  JPGReader *self = static_cast<JPGReader *>(reader);
+  uint64_t start_time = TimingStats::now();
+
+  // The raster gather covers what the largest of the IPUs' transfers moves //
+  const int N = NUM_TRANSFER_SIZES;
+  int gather_size = 0;
+  for (unsigned ipu = 0; ipu < self->m_num_IPUs; ++ipu) {
+    int size = self->m_IPU_params_table[ipu * PARAMS_SIZE + param_transfer_size];
+    if (size) gather_size = std::max(gather_size, (size - 1) % N + 1);
+  }
+  int IPU_segments =
+      gather_size ? self->transferTiles(gather_size - 1) * MAX_PIXELS_PER_TILE / RASTER_SEGMENT_PIXELS : 0;
+  for (unsigned ipu = 0; ipu < self->m_num_IPUs; ++ipu) {
+    self->m_IPU_params_table[ipu * PARAMS_SIZE + param_raster_gather_size] = gather_size;
+    self->m_IPU_params_table[ipu * PARAMS_SIZE + param_raster_IPU_segments] = IPU_segments;
+  }
+
+  self->m_ipuEngine->run(program);
+  self->timings.record(stage_ipuRun, start_time);
+  if (self->m_profile_IPU) self->recordIPUProfile(program, start_time);
+
+  // Only IPUs given entropy coded data can have found it bad //
+  for (unsigned ipu = 0; ipu < self->m_num_IPUs; ++ipu) {
+    if (self->m_IPU_params_table[ipu * PARAMS_SIZE + param_coefficient_format] == coefficients_huffman) {
+      self->m_ipuEngine->readTensor("huffman_errors", self->m_huffman_errors.data(),
+                                    self->m_huffman_errors.data() + self->m_huffman_errors.size());
+      break;
+    }
+  }
+}
+
+// Whether the Huffman vertices of the image's tiles found bad data, after a run that decoded its scan.
+// Tiles past the image's hold stale bytes, so their flags mean nothing //
+bool JPGReader::huffmanFailed(const TileLayout &layout) {
+  for (int tile = layout.first_tile; tile < layout.first_tile + layout.num_active_tiles; ++tile) {
+    if (m_huffman_errors[tile]) return true;
+  }
+  return false;
+}
+
+// Time each phase of the run that just finished from the cycle stamps between them, placing them in
+// the trace as if the device started the moment the host asked it to. Phases the program skipped are
+// left out. The params tell what each IPU's copies moved //
+void JPGReader::recordIPUProfile(unsigned program, uint64_t start_time) {
+  if (!timings.enabled()) return;
+  m_ipuEngine->readTensor("cycle_stamps", m_IPU_cycle_stamps.data(),
+                          m_IPU_cycle_stamps.data() + m_IPU_cycle_stamps.size());
+  m_ipuEngine->readTensor("postprocess_cycles", m_postprocess_cycles.data(),
+                          m_postprocess_cycles.data() + m_postprocess_cycles.size());
+
+  uint64_t bytes[NUM_STAGES] = {};
+  unsigned fastest_tile = ~0u, slowest_tile = 0;
+  size_t coefficient_bytes = m_do_iDCT_on_IPU ? sizeof(short) : 1;
+  for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+    bytes[stage_ipuCopyParams] += PARAMS_SIZE * sizeof(int) + 3 * 64;
+    if (m_do_decompress_on_IPU) bytes[stage_ipuCopyParams] += 4 * HUFFMAN_TABLE_SIZE * sizeof(int);
+    int size = m_IPU_params_table[ipu * PARAMS_SIZE + param_transfer_size];
+    if (!size) continue;
+    if (size > (int)NUM_TRANSFER_SIZES) {
+      bytes[stage_ipuCopyPacked] += transferTiles(size - 1 - NUM_TRANSFER_SIZES) * PACKED_BYTES_PER_TILE;
+    } else {
+      for (int c = 0; c < 3; ++c) {
+        bytes[stage_ipuCopyY + c] += transferTiles(size - 1) * MAX_PIXELS_PER_TILE * coefficient_bytes;
+      }
+    }
+    bytes[stage_ipuCopyPixels] += transferTiles((size - 1) % NUM_TRANSFER_SIZES) * MAX_PIXELS_PER_TILE * 3;
+    for (unsigned tile = ipu * m_tiles_per_IPU; tile < (ipu + 1) * m_tiles_per_IPU; ++tile) {
+      fastest_tile = std::min(fastest_tile, m_postprocess_cycles[tile]);
+      slowest_tile = std::max(slowest_tile, m_postprocess_cycles[tile]);
+    }
+  }
+
+  double ticks_per_cycle = timings.ticksPerMicrosecond() / m_IPU_cycles_per_microsecond;
+  auto stamp = [&](int i) { return uint64_t(m_IPU_cycle_stamps[2 * i + 1]) << 32 | m_IPU_cycle_stamps[2 * i]; };
+  for (int phase = 0; phase < NUM_IPU_PHASES; ++phase) {
+    int stage = stage_ipuCopyParams + phase;
+    if (stage == stage_ipuHuffman && !m_do_decompress_on_IPU) continue;
+    if (stage == stage_ipuRasterGather && program < (unsigned)NUM_SUBSAMPLINGS) continue;
+    uint64_t offset = stamp(phase) - stamp(0), cycles = stamp(phase + 1) - stamp(phase);
+    timings.recordSpan(stage, start_time + uint64_t(offset * ticks_per_cycle), uint64_t(cycles * ticks_per_cycle),
+                       bytes[stage]);
+  }
+  if (slowest_tile) {
+    timings.recordSpan(stage_ipuPostprocessFastestTile, start_time, uint64_t(fastest_tile * ticks_per_cycle));
+    timings.recordSpan(stage_ipuPostprocessSlowestTile, start_time, uint64_t(slowest_tile * ticks_per_cycle));
+  }
+}
+
+// Parse all header blocks and entropy decode the scan into the channel buffers, stopping at EOI //
+void JPGReader::decodeHost() {
   // CLeanup decoder state that could persist from previous decode
   m_error = NO_ERROR;
   m_restart_interval = 0;
-  m_num_bufbits = 0;
-  for (auto tree : m_dht_trees) tree[0] = {{0, 0}, 0};
-
-  auto start_time = std::chrono::high_resolution_clock::now();
+  m_progressive = false;
+  m_streamed = false;
+  m_coefficient_format = coefficients_dense;
 
   // Main format block parsing loop //
   while (!m_error) {
@@ -88,52 +401,156 @@ int JPGReader::decode() {
 
     switch (m_pos[-1]) {
       case 0xC0:
-        callAndTime(&JPGReader::decodeSOF, "decodeSOF");
+      case 0xC2:
+        m_progressive = (m_pos[-1] == 0xC2);
+        callAndTime(&JPGReader::decodeSOF, stage_decodeSOF);
         break;
       case 0xC4:
-        callAndTime(&JPGReader::decodeDHT, "decodeDHT");
+        callAndTime(&JPGReader::decodeDHT, stage_decodeDHT);
         break;
       case 0xDB:
-        callAndTime(&JPGReader::decodeDQT, "decodeDQT");
+        callAndTime(&JPGReader::decodeDQT, stage_decodeDQT);
         break;
       case 0xDD:
-        callAndTime(&JPGReader::decodeDRI, "decodeDRI");
+        callAndTime(&JPGReader::decodeDRI, stage_decodeDRI);
         break;
       case 0xDA:
-        callAndTime(&JPGReader::decodeScanCPU, "decodeScanCPU");
+        if (m_progressive) {
+          callAndTime(&JPGReader::decodeScanProgressive, stage_decodeScanProgressive, m_num_MCUs_x * m_num_MCUs_y);
+        } else {
+          callAndTime(&JPGReader::decodeScanCPU, stage_decodeScanCPU, m_num_MCUs_x * m_num_MCUs_y);
+        }
         break;
       case 0xFE:
-        callAndTime(&JPGReader::skipBlock, "skipBlock");
+        callAndTime(&JPGReader::skipBlock, stage_skipBlock);
         break;
       case 0xD9:
         break;
       default:
         if ((m_pos[-1] & 0xF0) == 0xE0) {
-          callAndTime(&JPGReader::skipBlock, "skipBlock");
+          callAndTime(&JPGReader::skipBlock, stage_skipBlock);
         } else {
           m_error = SYNTAX_ERROR;
         }
     }
 
     // Finished //
-    if (m_pos[-1] == 0xD9 && m_pos == m_end) {
-      callAndTime(&JPGReader::upsampleAndColourTransformIPU, "upsampleAndColourTransformIPU");
-      break;
+    if (m_pos[-1] == 0xD9 && m_pos == m_end) break;
+  }
+
+  // Progressive scans only leave quantised coefficients behind, finish them once all have arrived //
+  if (!m_error && m_progressive) callAndTime(&JPGReader::finishProgressive, stage_finishProgressive);
+}
+
+// Pipeline a batch through two sets of buffers: while the IPUs colour-transform one group of images
+// out of the in-flight set, the host Huffman decodes the next group into the channel buffers. Images
+// are packed onto the IPUs, so a group is as many as fit on the device at once, and it is launched as
+// soon as it fills it. The sets are swapped between groups, which is O(1) because only the vectors'
+// storage pointers move. The params table is only rewritten once the previous run has finished, so it
+// needs no second copy. A streamed image collects the previous group itself before its first strip
+// goes to the device.
+std::vector<JPGReader::DecodedImage> JPGReader::decodeBatch(const std::vector<Input> &inputs) {
+  std::vector<DecodedImage> outputs(inputs.size());
+  uint64_t start_time = TimingStats::now();
+  uint64_t batch_bytes = 0, batch_MCUs = 0;
+  // A batch that threw can leave images behind, pointing into outputs that are gone //
+  m_batch_pending.clear();
+  m_batch_inflight.clear();
+  m_packing = true;
+  m_next_IPU = 0;
+  m_output_format = PixelFormat::RGB24;
+
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    // Host: entropy decode the next image while the previous group is on the device. Its SOF launches
+    // the pending group first if the image doesn't fit beside it //
+    try {
+      readFromMemory(inputs[i].data, inputs[i].size);
+      callAndTime(&JPGReader::decodeHost, stage_decodeHost);
+    } catch (const std::runtime_error &e) {
+      fprintf(stderr, "%s\n", e.what());
+      m_error = UNSUPPORTED_ERROR;
+    }
+    outputs[i].error = m_error;
+    if (m_error) {
+      fprintf(stderr, "Decode of batch item %zu failed with error code %d\n", i, m_error);
+      continue;
+    }
+    batch_bytes += m_size;
+    batch_MCUs += m_num_MCUs_x * m_num_MCUs_y;
+
+    if (m_streamed) {
+      outputs[i].width = m_width;
+      outputs[i].height = m_height;
+      outputs[i].pixels.swap(m_raster_pixels);
+      continue;
     }
+
+    packCoefficients(m_num_MCUs_x * m_num_MCUs_y);
+    BatchImage image = {&outputs[i], currentLayout(), m_first_IPU, m_image_IPUs, {}, subsamplingMode(), {}, {}};
+    fillIPUParams(image.params);
+    fillIPUQuantTables(image.quant);
+    if (m_coefficient_format == coefficients_huffman) image.huffman_tables = m_huffman_tables;
+    m_batch_pending.push_back(image);
+    m_next_IPU = m_first_IPU + m_image_IPUs;
+    if (m_next_IPU == (int)m_num_IPUs) launchBatchGroup();
   }
+  if (!m_batch_pending.empty()) launchBatchGroup();
+  collectBatchRun();
+  m_packing = false;
 
-  if (m_error) {
-    fprintf(stderr, "Decode failed with error code %d\n", m_error);
-    return m_error;
+  timings.record(stage_decodeBatch, start_time, batch_bytes, batch_MCUs);
+
+  return outputs;
+}
+
+// Hand the pending batch images to the device in one run, once it has finished the previous group.
+// Each IPU gets the params of the image laid out over it, and those without one get zeros, so their
+// vertices have no MCUs to do and they transfer nothing. The run takes the images' specialised program if they share one //
+void JPGReader::launchBatchGroup() {
+  collectBatchRun();
+  std::fill(m_IPU_params_table.begin(), m_IPU_params_table.end(), 0);
+  int program = m_batch_pending.front().subsampling;
+  for (auto &image : m_batch_pending) {
+    if (image.subsampling != program) program = subsampling_generic;
+    for (int ipu = image.first_IPU; ipu < image.first_IPU + image.num_IPUs; ++ipu) {
+      std::copy_n(image.params, PARAMS_SIZE, &m_IPU_params_table[ipu * PARAMS_SIZE]);
+      std::copy_n(image.quant, 3 * 64, &m_IPU_quant_table[ipu * 3 * 64]);
+      if (!image.huffman_tables.empty()) {
+        std::copy(image.huffman_tables.begin(), image.huffman_tables.end(),
+                  &m_IPU_huffman_table[ipu * 4 * HUFFMAN_TABLE_SIZE]);
+      }
+    }
+    setTransferSizes(image.layout.first_tile, image.layout.first_tile + image.layout.num_active_tiles);
   }
+  stageChannelBuffers();
+  m_batch_inflight.swap(m_batch_pending);
+  m_batch_pending.clear();
+  m_next_IPU = 0;
+  program = postprocessProgram(program);
+  m_batch_run.launch(&JPGReader::runProgram, this, program);
+}
 
-  if (TIMINGSTATS) {
-    auto elapsed = std::chrono::high_resolution_clock::now() - start_time;
-    auto dt = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-    timings["decode"].push_back(dt);
+// Wait for the batch images on the device, if there are any, and copy their pixels out //
+void JPGReader::collectBatchRun() {
+  if (!m_batch_run.pending()) return;
+  m_batch_run.wait();
+  for (auto &image : m_batch_inflight) {
+    DecodedImage &out = *image.output;
+    if (!image.huffman_tables.empty() && huffmanFailed(image.layout)) {
+      out.error = SYNTAX_ERROR;
+      continue;
+    }
+    out.width = image.layout.width;
+    out.height = image.layout.height;
+    out.pixels.resize(out.width * out.height * 3);
+    linearisePixels(image.layout, out.pixels.data(), out.width * 3, PixelFormat::RGB24);
   }
+  m_batch_inflight.clear();
+}
 
-  return NO_ERROR;
+JPGReader::TileLayout JPGReader::currentLayout() {
+  return {m_width, m_height, m_num_MCUs_x, m_num_MCUs_y, m_MCU_size_x, m_MCU_size_y, m_MCUs_per_tile,
+          m_num_active_tiles, m_first_tile, rasterStride()};
 }
 
 void JPGReader::write(const char *filename) {
@@ -144,48 +561,132 @@ void JPGReader::write(const char *filename) {
   }
   fprintf(f, "P%d\n%d %d\n255\n", 6, m_width, m_height);
 
-  // Linearise pixels //
-  std::vector<unsigned char> outbuf(m_width * m_height * 3);
-  unsigned char *inbuf = m_pixels.data();
+  if (m_streamed) {
+    fwrite(m_raster_pixels.data(), sizeof(unsigned char), m_raster_pixels.size(), f);
+    fclose(f);
+    return;
+  }
+
+  // Rows the device put in raster order unpadded can be written as they are //
+  if (rasterStride() == m_width) {
+    fwrite(&m_pixels[(size_t)m_first_tile * MAX_PIXELS_PER_TILE * 3], sizeof(unsigned char), m_width * m_height * 3, f);
+    fclose(f);
+    return;
+  }
+
+  if (m_write_buffer.size() < (size_t)m_width * m_height * 3) m_write_buffer.resize((size_t)m_width * m_height * 3);
+  linearisePixels(currentLayout(), m_write_buffer.data(), m_width * 3, PixelFormat::RGB24);
+
+  fwrite(m_write_buffer.data(), sizeof(unsigned char), m_width * m_height * 3, f);
+  fclose(f);
+}
+
+// Reorder the tile-major output of the IPU into raster order in the given format, rows stride bytes
+// apart. If the device did the reordering already, only the format and padding at the end of its rows
+// are left to deal with //
+void JPGReader::linearisePixels(const TileLayout &layout, unsigned char *outbuf, size_t stride, PixelFormat format) {
+  const unsigned char *inbuf = m_pixels.data();
+  if (layout.raster_stride) {
+    inbuf += (size_t)layout.first_tile * MAX_PIXELS_PER_TILE * 3;
+    if (format == PixelFormat::RGB24 && layout.raster_stride * 3u == stride) {
+      memcpy(outbuf, inbuf, stride * layout.height);
+      return;
+    }
+    for (int y = 0; y < layout.height; ++y) {
+      storePixelRun(&inbuf[(size_t)y * layout.raster_stride * 3], layout.width, 0, y, outbuf, stride, format,
+                    layout.height);
+    }
+    return;
+  }
   int out_MCU_x = 0, out_MCU_y = 0;
-  for (int tile = 0; tile < m_num_active_tiles; tile++) {
-    for (int in_MCU = 0; in_MCU < m_MCUs_per_tile; ++in_MCU) {
-      if (out_MCU_y >= m_num_MCUs_y) break;
-      int in_start = (tile * MAX_PIXELS_PER_TILE) + (in_MCU * m_MCU_size_x * m_MCU_size_y);
-      int out_start = out_MCU_y * m_MCU_size_y * m_width + out_MCU_x * m_MCU_size_x;
-      int out_width = std::min(m_MCU_size_x, m_width - (out_MCU_x * m_MCU_size_x));
-      int out_height = std::min(m_MCU_size_y, m_height - (out_MCU_y * m_MCU_size_y));
+  for (int tile = 0; tile < layout.num_active_tiles; tile++) {
+    for (int in_MCU = 0; in_MCU < layout.MCUs_per_tile; ++in_MCU) {
+      if (out_MCU_y >= layout.num_MCUs_y) break;
+      int in_start = ((layout.first_tile + tile) * MAX_PIXELS_PER_TILE) + (in_MCU * layout.MCU_size_x * layout.MCU_size_y);
+      int out_x = out_MCU_x * layout.MCU_size_x;
+      int out_y = out_MCU_y * layout.MCU_size_y;
+      int out_width = std::min(layout.MCU_size_x, layout.width - out_x);
+      int out_height = std::min(layout.MCU_size_y, layout.height - out_y);
 
       for (int y = 0; y < out_height; ++y) {
-        for (int x = 0; x < out_width; ++x) {
-          int in_pixel = in_start + y * m_MCU_size_x + x;
-          int out_pixel = out_start + y * m_width + x;
-          for (int c = 0; c < 3; ++c) {
-            outbuf[out_pixel * 3 + c] = inbuf[in_pixel * 3 + c];
-          }
-        }
+        storePixelRun(&inbuf[(in_start + y * layout.MCU_size_x) * 3], out_width, out_x, out_y + y, outbuf, stride,
+                      format, layout.height);
       }
 
-      if (++out_MCU_x == m_num_MCUs_x) {
+      if (++out_MCU_x == layout.num_MCUs_x) {
         out_MCU_y += 1;
         out_MCU_x = 0;
       }
     }
   }
+}
 
-  fwrite(outbuf.data(), sizeof(unsigned char), m_width * m_height * 3, f);
-  fclose(f);
+// Write num_pixels decoded pixels to row y of the output from column x. They are RGB, or YCbCr for the
+// formats that want it, and the chroma of the planar formats is taken from even rows and columns //
+void JPGReader::storePixelRun(const unsigned char *in, int num_pixels, int x, int y, unsigned char *outbuf,
+                              size_t stride, PixelFormat format, int height) {
+  unsigned char *out = &outbuf[(size_t)y * stride];
+  switch (format) {
+    case PixelFormat::RGB24:
+      memcpy(&out[x * 3], in, num_pixels * 3);
+      return;
+    case PixelFormat::BGR24:
+      for (int i = 0; i < num_pixels; ++i, in += 3) {
+        unsigned char *pixel = &out[(x + i) * 3];
+        pixel[0] = in[2];
+        pixel[1] = in[1];
+        pixel[2] = in[0];
+      }
+      return;
+    case PixelFormat::RGBA32:
+    case PixelFormat::BGRA32: {
+      int red = (format == PixelFormat::RGBA32) ? 0 : 2;
+      for (int i = 0; i < num_pixels; ++i, in += 3) {
+        unsigned char *pixel = &out[(x + i) * 4];
+        pixel[red] = in[0];
+        pixel[1] = in[1];
+        pixel[2 - red] = in[2];
+        pixel[3] = 0xFF;
+      }
+      return;
+    }
+    case PixelFormat::GRAY8:
+    case PixelFormat::I420:
+    case PixelFormat::NV12:
+      for (int i = 0; i < num_pixels; ++i) out[x + i] = in[i * 3];
+      break;
+  }
+  if (format == PixelFormat::GRAY8 || (y & 1)) return;
+
+  // U then V planes for I420, one plane of interleaved UV pairs for NV12 //
+  unsigned char *U = &outbuf[stride * height], *V;
+  size_t chroma_stride = stride, step = 2;
+  if (format == PixelFormat::I420) {
+    chroma_stride = stride / 2;
+    step = 1;
+    V = U + chroma_stride * ((height + 1) / 2);
+  } else {
+    V = U + 1;
+  }
+  U += (y / 2) * chroma_stride;
+  V += (y / 2) * chroma_stride;
+  for (int i = (x & 1); i < num_pixels; i += 2) {
+    size_t sample = ((x + i) / 2) * step;
+    U[sample] = in[i * 3 + 1];
+    V[sample] = in[i * 3 + 2];
+  }
 }
 
 unsigned short JPGReader::read16(const unsigned char *pos) { return (pos[0] << 8) | pos[1]; }
 
 void JPGReader::skipBlock() {
   unsigned short block_len = read16(m_pos);
+  if (m_pos + block_len > m_end) THROW(SYNTAX_ERROR);
   m_pos += block_len;
 }
 
 void JPGReader::decodeSOF() {
-  unsigned char *block = m_pos;
+  const unsigned char *block = m_pos;
   unsigned int block_len = read16(block);
   if (block_len < 9 || block + block_len >= m_end) THROW(SYNTAX_ERROR);
   if (block[2] != 8) THROW(UNSUPPORTED_ERROR);
@@ -224,24 +725,59 @@ void JPGReader::decodeSOF() {
   }
 
   // Compute dimensions //
-  m_MCU_size_x = samples_x_max * 8;
-  m_MCU_size_y = samples_y_max * 8;
-  m_num_MCUs_x = (m_width + m_MCU_size_x - 1) / m_MCU_size_x;
-  m_num_MCUs_y = (m_height + m_MCU_size_y - 1) / m_MCU_size_y;
-  m_MCUs_per_tile = (m_num_MCUs_x * m_num_MCUs_y + m_num_tiles - 1) / m_num_tiles;
-  m_num_active_tiles = (m_num_MCUs_x * m_num_MCUs_y + m_MCUs_per_tile - 1) / m_MCUs_per_tile;
-
-  if (m_MCU_size_x * m_MCU_size_y * m_MCUs_per_tile > (int)MAX_PIXELS_PER_TILE) {
-    throw std::runtime_error(
-        "Image too big. Increase JPGReader::MAX_PIXELS_PER_TILE. "
-        "In the future trigger extra downsampling here instead of erroring.");
+  m_num_MCUs_x = (m_width + samples_x_max * 8 - 1) / (samples_x_max * 8);
+  m_num_MCUs_y = (m_height + samples_y_max * 8 - 1) / (samples_y_max * 8);
+  const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
+
+  // An image is laid out over all the IPUs, except in a batch, which packs each image onto as few whole
+  // IPUs as hold it at the requested scale. One that needs more than are left waits for the next run //
+  m_first_IPU = 0;
+  m_image_IPUs = m_num_IPUs;
+  if (m_packing) {
+    int min_MCU_pixels = ((samples_x_max * 8) >> m_min_scale_shift) * ((samples_y_max * 8) >> m_min_scale_shift);
+    int MCUs_per_IPU = (MAX_PIXELS_PER_TILE / min_MCU_pixels) * m_tiles_per_IPU;
+    if (MCUs_per_IPU) m_image_IPUs = std::min<int>(m_num_IPUs, (total_MCUs + MCUs_per_IPU - 1) / MCUs_per_IPU);
+    if (m_next_IPU + m_image_IPUs > (int)m_num_IPUs) launchBatchGroup();
+    m_first_IPU = m_next_IPU;
   }
+  m_first_tile = m_first_IPU * m_tiles_per_IPU;
+  const int num_tiles = m_image_IPUs * m_tiles_per_IPU;
+  m_MCUs_per_tile = (total_MCUs + num_tiles - 1) / num_tiles;
+  m_num_active_tiles = (total_MCUs + m_MCUs_per_tile - 1) / m_MCUs_per_tile;
+
+  // Start at the requested scale and halve it until the MCUs fit the tiles. Every block is then inverse
+  // transformed straight to its scaled size, so each halving quarters the pixels and coefficients.
+  // Baseline images stream instead, at the requested scale, in strips of as many MCU rows as fit.
+  // Progressive ones can't, as their last scan may refine any block //
+  m_scale_shift = m_min_scale_shift;
+  m_streamed = false;
+  m_strip_MCU_rows = m_num_MCUs_y;
+  while (true) {
+    int MCU_pixels = ((samples_x_max * 8) >> m_scale_shift) * ((samples_y_max * 8) >> m_scale_shift);
+    if (MCU_pixels * m_MCUs_per_tile <= (int)MAX_PIXELS_PER_TILE) break;
+    int strip_MCU_rows = (MAX_PIXELS_PER_TILE / MCU_pixels) * num_tiles / m_num_MCUs_x;
+    if (m_allow_streaming && !m_progressive && strip_MCU_rows) {
+      m_streamed = true;
+      m_strip_MCU_rows = strip_MCU_rows;
+      m_MCUs_per_tile = (m_num_MCUs_x * strip_MCU_rows + num_tiles - 1) / num_tiles;
+      m_num_active_tiles = (m_num_MCUs_x * strip_MCU_rows + m_MCUs_per_tile - 1) / m_MCUs_per_tile;
+      break;
+    }
+    if (m_scale_shift == 3) {
+      throw std::runtime_error("Image too big even at 1/8 scale. Increase JPGReader::MAX_PIXELS_PER_TILE.");
+    }
+    ++m_scale_shift;
+  }
+  const int block_size = 8 >> m_scale_shift;
+  m_MCU_size_x = samples_x_max * block_size;
+  m_MCU_size_y = samples_y_max * block_size;
 
   for (i = 0, chan = m_channels; i < m_num_channels; i++, chan++) {
     chan->width = (m_width * chan->samples_x + samples_x_max - 1) / samples_x_max;
     chan->height = (m_height * chan->samples_y + samples_y_max - 1) / samples_y_max;
-    chan->tile_stride = chan->samples_x * 8;
-    chan->pixels_per_MCU = chan->samples_x * 8 * chan->samples_y * 8;
+    chan->channel_idx = i;
+    chan->tile_stride = chan->samples_x * block_size;
+    chan->pixels_per_MCU = chan->samples_x * block_size * chan->samples_y * block_size;
     chan->downshift_x = __builtin_ctz(samples_x_max / chan->samples_x);
     chan->downshift_y = __builtin_ctz(samples_y_max / chan->samples_y);
 
@@ -250,32 +786,30 @@ void JPGReader::decodeSOF() {
       THROW(UNSUPPORTED_ERROR);
   }
 
-  m_pos += block_len;
-}
-
-// 'code' contains 'num_bits' bits, starting with MSB! //
-void addDhtLeaf(DhtNode* nodes, int& num_nodes, unsigned short code, int num_bits, unsigned char payload) {
-  unsigned current_node = 0;
-  for(int bit_pos = 15; bit_pos >= 16 - num_bits; --bit_pos) {
-    unsigned bit = (code >> bit_pos) & 1u;
-    unsigned next_node = nodes[current_node].children[bit];
-    if (next_node == 0) {
-      // Child node doesn't exist, create it //
-      next_node = num_nodes++;
-      assert(next_node < JPGReader::MAX_DHT_NODES);
-      nodes[next_node] = {{0, 0}, 0};
-      nodes[current_node].children[bit] = next_node;
+  // Partial blocks at the edges round up, as they do at full size //
+  m_width = (m_width + (1 << m_scale_shift) - 1) >> m_scale_shift;
+  m_height = (m_height + (1 << m_scale_shift) - 1) >> m_scale_shift;
+  if (m_streamed) m_raster_pixels.resize((size_t)m_width * m_height * 3);
+
+  // Progressive scans accumulate into the coefficient buffers, so they have to start out empty //
+  if (m_progressive) {
+    for (i = 0, chan = m_channels; i < m_num_channels; i++, chan++) {
+      if (m_scale_shift) {
+        chan->progressive_frequencies.assign(m_num_MCUs_x * m_num_MCUs_y * chan->samples_x * chan->samples_y * 64, 0);
+      } else {
+        std::fill_n(chan->frequencies.begin() + m_first_tile * MAX_PIXELS_PER_TILE,
+                    m_num_active_tiles * MAX_PIXELS_PER_TILE, 0);
+      }
     }
-    current_node = next_node;
   }
-  nodes[current_node].tuple = payload;
-}
 
+  m_pos += block_len;
+}
 
 void JPGReader::decodeDHT() {
-  unsigned char *pos = m_pos;
+  const unsigned char *pos = m_pos;
   unsigned int block_len = read16(pos);
-  unsigned char *block_end = pos + block_len;
+  const unsigned char *block_end = pos + block_len;
   if (block_end >= m_end) THROW(SYNTAX_ERROR);
   pos += 2;
 
@@ -285,54 +819,78 @@ void JPGReader::decodeDHT() {
     if (val & 0x02) THROW(UNSUPPORTED_ERROR);
     unsigned char table_id = (val | (val >> 3)) & 3;  // AC and DC
 
-    // First, decode as proper tree structure //
-    DhtNode* dht_tree = &m_dht_trees[table_id][0];
-    int num_tree_nodes = 1;
-    unsigned short huffman_code = 0;
-
-    unsigned char *current_tuple = pos + 17;
-    for (int code_len = 1; code_len <= 16; code_len++) {
-      int count = pos[code_len];
-      if (!count) continue;
-      if (current_tuple + count > block_end) THROW(SYNTAX_ERROR);
-      for (int i = 0; i < count; i++) {
-        addDhtLeaf(dht_tree, num_tree_nodes, huffman_code, code_len, *current_tuple);
-        huffman_code += 1 << (16 - code_len);
-        current_tuple++;
-      }
-    }
-    unsigned char* dht_end_pos = current_tuple;
-
-    // Then, decode short (common) symbols as fast precomputed lookup table //
     DhtTableItem *vlc = &m_dht_tables[table_id][0];
-    unsigned char *tuple = pos + 17;
-    int remain = DHT_TABLE_SIZE, spread = DHT_TABLE_SIZE;
-    for (unsigned code_len = 1; code_len <= DHT_TABLE_BITS; code_len++) {
-      spread >>= 1;
+    std::vector<DhtTableItem> &long_vlc = m_dht_long_tables[table_id];
+    memset(vlc, 0, DHT_TABLE_SIZE * sizeof(DhtTableItem));
+    long_vlc.clear();
+
+    // Assign canonical codes in order of length. Short ones fill every table entry they prefix, long
+    // ones get a second level table per distinct DHT_TABLE_BITS prefix //
+    const unsigned char *tuple = pos + 17;
+    memcpy(m_dht_code_counts[table_id], pos + 1, 16);
+    unsigned code = 0;
+    for (unsigned code_len = 1; code_len <= 16; code_len++, code <<= 1) {
       int count = pos[code_len];
-      if (!count) continue;
-      remain -= count * spread;
-      if (remain < 0) THROW(SYNTAX_ERROR);
-      for (int i = 0; i < count; i++, tuple++) {
-        for (int j = spread; j; j--, ++vlc) {
-          vlc->num_bits = (unsigned char)code_len;
-          vlc->tuple = *tuple;
+      if (tuple + count > block_end) THROW(SYNTAX_ERROR);
+      for (int i = 0; i < count; i++, tuple++, code++) {
+        if (code >= (1u << code_len)) THROW(SYNTAX_ERROR);  // More codes than fit in this length
+        unsigned code16 = code << (16 - code_len);
+
+        if (code_len <= DHT_TABLE_BITS) {
+          DhtTableItem *item = &vlc[code16 >> (16 - DHT_TABLE_BITS)];
+          for (int j = 1 << (DHT_TABLE_BITS - code_len); j; j--, ++item) *item = {*tuple, (unsigned char)code_len};
+          continue;
         }
 
+        DhtTableItem &prefix = vlc[code16 >> (16 - DHT_TABLE_BITS)];
+        if (!prefix.tuple) {
+          if (long_vlc.size() == 255 * DHT_LONG_TABLE_SIZE) THROW(UNSUPPORTED_ERROR);
+          long_vlc.resize(long_vlc.size() + DHT_LONG_TABLE_SIZE, {0, 0});
+          prefix.tuple = long_vlc.size() / DHT_LONG_TABLE_SIZE;
+        }
+        DhtTableItem *item = &long_vlc[(prefix.tuple - 1) * DHT_LONG_TABLE_SIZE + (code16 & (DHT_LONG_TABLE_SIZE - 1))];
+        for (int j = 1 << (16 - code_len); j; j--, ++item) *item = {*tuple, (unsigned char)code_len};
       }
     }
-    while (remain--) {
-      vlc->num_bits = 0;
-      vlc++;
-    }
 
-    pos = dht_end_pos;
+    // Only a corrupt table lists more than the 256 symbols there are, and the device won't take it //
+    memcpy(m_dht_symbols[table_id], pos + 17, std::min<size_t>(tuple - (pos + 17), 256));
+    buildFusedTable(table_id);
+    pos = tuple;
   }
 
   if (pos != block_end) THROW(SYNTAX_ERROR);
   m_pos = block_end;
 }
 
+// Extend each short code with the magnitude bits that follow it and, where there is room, with the next
+// whole symbol too, so decodeBlock() usually takes a single lookup for one or two coefficients //
+void JPGReader::buildFusedTable(int table_id) {
+  const bool is_AC = table_id & 2;
+  const DhtTableItem *vlc = &m_dht_tables[table_id][0];
+  for (unsigned bits = 0; bits < DHT_TABLE_SIZE; ++bits) {
+    DhtFusedItem &item = m_dht_fused_tables[table_id][bits];
+    item = {{0, 0}, {0, 0}, {0, 0}};
+
+    unsigned used_bits = 0;
+    for (int i = 0; i < (is_AC ? 2 : 1); ++i) {
+      const DhtTableItem &symbol = vlc[(bits << used_bits) & (DHT_TABLE_SIZE - 1)];
+      unsigned num_value_bits = symbol.tuple & 0x0F;
+      if (!symbol.num_bits || used_bits + symbol.num_bits + num_value_bits > DHT_TABLE_BITS) break;
+      // Malformed AC tuples are left for the slow path to report //
+      if (is_AC && !num_value_bits && symbol.tuple && symbol.tuple != 0xF0) break;
+
+      used_bits += symbol.num_bits + num_value_bits;
+      int value = (bits >> (DHT_TABLE_BITS - used_bits)) & ((1 << num_value_bits) - 1);
+      if (num_value_bits && value < (1 << (num_value_bits - 1))) value -= (1 << num_value_bits) - 1;
+      item.value[i] = value;
+      item.tuple[i] = symbol.tuple;
+      item.num_bits[i] = symbol.num_bits + num_value_bits;
+      if (!symbol.tuple) break;  // Nothing after EOB belongs to this block
+    }
+  }
+}
+
 /*
 void JPGReader::decodeDHT() {
   unsigned char *pos = m_pos;
@@ -379,7 +937,7 @@ void JPGReader::decodeDHT() {
 
 void JPGReader::decodeDRI() {
   unsigned int block_len = read16(m_pos);
-  unsigned char *block_end = m_pos + block_len;
+  const unsigned char *block_end = m_pos + block_len;
   if ((block_len < 2) || (block_end >= m_end)) THROW(SYNTAX_ERROR);
   m_restart_interval = read16(m_pos + 2);
   m_pos = block_end;
@@ -387,9 +945,9 @@ void JPGReader::decodeDRI() {
 
 void JPGReader::decodeDQT() {
   unsigned int block_len = read16(m_pos);
-  unsigned char *block_end = m_pos + block_len;
+  const unsigned char *block_end = m_pos + block_len;
   if (block_end >= m_end) THROW(SYNTAX_ERROR);
-  unsigned char *pos = m_pos + 2;
+  const unsigned char *pos = m_pos + 2;
 
   while (pos + 65 <= block_end) {
     unsigned char table_id = pos[0];
@@ -402,36 +960,45 @@ void JPGReader::decodeDQT() {
   m_pos = block_end;
 }
 
+void JPGReader::setHostThreads(unsigned num_threads) {
+  m_thread_pool.reset(new ThreadPool(std::max(1u, num_threads)));
+}
+
+void JPGReader::setDownscale(int factor) {
+  if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+    throw std::runtime_error("Downscale factor must be 1, 2, 4 or 8");
+  }
+  m_min_scale_shift = __builtin_ctz(factor);
+}
+
+int JPGReader::downscale() { return 1 << m_scale_shift; }
+
+void JPGReader::setStreaming(bool enable) { m_allow_streaming = enable; }
+
+void JPGReader::setRasterOnIPU(bool enable) { m_raster_on_IPU = enable; }
+
 bool JPGReader::isGreyScale() { return m_num_channels == 1; }
 bool JPGReader::isReadyToDecode() { return m_ready_to_decode; }
+const JPGReader::ScanIndex &JPGReader::scanIndex() const { return m_scan_index; }
 
 // ----------------- Utilities for timing (profiling) ------------------------ //
 
-void JPGReader::callAndTime(void (JPGReader::*method)(), const std::string name) {
-  if (TIMINGSTATS) {
-    auto t = std::chrono::high_resolution_clock::now();
-    (this->*method)();
-    auto elapsed = std::chrono::high_resolution_clock::now() - t;
-    long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
-    timings[name].push_back(microseconds);
-  } else {
-    (this->*method)();
-  }
+// The bytes a stage consumed are how far it moved m_pos through the JPEG //
+void JPGReader::callAndTime(void (JPGReader::*method)(), Stage stage, uint64_t MCUs) {
+  uint64_t start_time = TimingStats::now();
+  const unsigned char *start_pos = m_pos;
+  (this->*method)();
+  timings.record(stage, start_time, m_pos > start_pos ? m_pos - start_pos : 0, MCUs);
 }
 
+// Profiling readers add the spread of the postprocess vertices in cycles, as the device counted them //
 void JPGReader::printTimingStats() {
-  printf(
-      "+-------------------------------+-----------+\n"
-      "|                        Method | Time (ms) |\n"
-      "+-------------------------------+-----------+\n");
-  for (const auto &item : timings) {
-    double total_microseconds = std::accumulate(item.second.begin(), item.second.end(), 0.);
-    double avg_milliseconds = total_microseconds / (1000. * item.second.size());
-    if (avg_milliseconds > 0.005) {
-      printf("|%30s | % 9.3f |\n", item.first.c_str(), avg_milliseconds);
-    } else {
-      printf("|%30s |         - |\n", item.first.c_str());
-    }
-  }
-  printf("+-------------------------------+-----------+\n");
+  timings.print();
+  if (!timings.count(stage_ipuPostprocessSlowestTile)) return;
+  double cycles_per_millisecond = 1000. * m_IPU_cycles_per_microsecond;
+  printf("Postprocess cycles, mean of %llu runs: fastest vertex %.0f, slowest vertex %.0f, compute set %.0f\n",
+         (unsigned long long)timings.count(stage_ipuPostprocessSlowestTile),
+         timings.meanMilliseconds(stage_ipuPostprocessFastestTile) * cycles_per_millisecond,
+         timings.meanMilliseconds(stage_ipuPostprocessSlowestTile) * cycles_per_millisecond,
+         timings.meanMilliseconds(stage_ipuPostprocess) * cycles_per_millisecond);
 }
\ No newline at end of file
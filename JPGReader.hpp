@@ -1,17 +1,28 @@
 #pragma once
 
+#include <stdint.h>
+
 #include <map>
 #include <memory>
 #include <poplar/Engine.hpp>
+#include <poplar/Executable.hpp>
 #include <poplar/Graph.hpp>
 #include <string>
 #include <vector>
 
+#include "ThreadPool.hpp"
+#include "TimingStats.hpp"
+#include "bitReader.h"
+#include "iDCT.h"
 #include "codelets.hpp"
 
 #ifndef TIMINGSTATS
 #define TIMINGSTATS 1
 #endif
+// Build with OVERRIDE=IPU_PROFILE to profile the device programs of readers by default //
+#ifndef IPU_PROFILE
+#define IPU_PROFILE 0
+#endif
 
 #define NO_ERROR 0
 #define SYNTAX_ERROR 1
@@ -24,13 +35,52 @@
     return;      \
   } while (0)
 
+// A short code's symbol and length. For the prefix of longer codes num_bits is 0 and tuple is one more
+// than the index of their second level table, so an item of all zeros is not a code at all //
 typedef struct _DhtTableItem {
   unsigned char tuple, num_bits;
 } DhtTableItem;
 
-typedef struct _DhtNode {
-  unsigned char children[2], tuple;
-} DhtNode;
+// Up to two run/size symbols with their magnitude bits already read and sign extended //
+typedef struct _DhtFusedItem {
+  short value[2];
+  unsigned char tuple[2];
+  unsigned char num_bits[2];  // Code plus magnitude bits of each symbol, 0 if there is no such symbol
+} DhtFusedItem;
+
+// Bit reader position and DC predictors for one run of entropy coded data //
+typedef struct _ScanState : BitReader {
+  int dc_cumulative_val[3];
+  int eob_run;  // Blocks left in the current run of empty bands (progressive AC scans only)
+  short block[64];  // Coefficients of the block being decoded when the iDCT is done on the host, kept zeroed
+} ScanState;
+
+// Spectral selection and successive approximation of one progressive scan //
+typedef struct _ProgressiveScan {
+  int spectral_start, spectral_end;
+  int bit_high, bit_low;
+} ProgressiveScan;
+
+// An MCU boundary met while speculatively tracing the scan, keyed by its bit offset in the scan //
+typedef struct _SyncPoint {
+  uint64_t bit_offset;
+  int dc_cumulative_val[3];
+} SyncPoint;
+
+// One byte range of a scan without restart markers, traced from a guessed starting state //
+typedef struct _SpeculativeChunk {
+  std::vector<SyncPoint> sync_points;
+  ScanState end_state;
+  // Where tracing on past the end of the chunk first met a later chunk's sync point, if it did //
+  int next_chunk, next_point;
+  int MCUs_to_next;
+  int dc_at_next[3];
+} SpeculativeChunk;
+
+typedef struct _ScanSegment {
+  SyncPoint start;
+  int first_MCU, end_MCU;
+} ScanSegment;
 
 typedef struct _ColourChannel {
   int id;
@@ -39,101 +89,358 @@ typedef struct _ColourChannel {
   int samples_x, samples_y;
   int downshift_x, downshift_y;
   int tile_stride, pixels_per_MCU;
-  int dc_cumulative_val;
+  int channel_idx;
   std::vector<unsigned char> pixels;
   std::vector<short> frequencies;
+  // Whole blocks of a downscaled progressive image, 64 coefficients each in MCU order. The channel
+  // buffers only keep the corner the reduced iDCT uses, but refinement scans need every coefficient //
+  std::vector<short> progressive_frequencies;
 
   std::string tensor_name;
   poplar::Tensor data_tensor;
   std::string stream_name;
-  poplar::DataStream input_stream;
+  // One stream per IPU and transfer size, at ipu * NUM_TRANSFER_SIZES + size, feeding the start of
+  // the IPU's slice of the tensor //
+  std::vector<std::string> stream_names;
+  std::vector<poplar::DataStream> input_streams;
 } ColourChannel;
 
 class JPGReader {
  public:
+  struct Input {
+    const uint8_t* data;
+    size_t size;
+  };
+
+  // What decodeInto() writes. GRAY8 and the YUV formats are the decoded Y, Cb and Cr without the colour
+  // transform. I420 follows the Y plane with U and V planes of half the stride, NV12 with one UV plane
+  // of the full stride, each (height + 1) / 2 rows of (width + 1) / 2 samples. Chroma comes from the top
+  // left pixel of each 2x2, so is exactly what a 4:2:0 image coded //
+  enum class PixelFormat { RGB24, BGR24, RGBA32, BGRA32, GRAY8, I420, NV12 };
+
+  // What timings keeps a histogram of. Bytes are of the JPEG consumed, MCUs of the image decoded //
+  enum Stage {
+    stage_read,
+    stage_readFromMemory,
+    stage_decode,
+    stage_decodeInto,
+    stage_decodeBatch,
+    stage_decodeHost,
+    stage_decodeSOF,
+    stage_decodeDHT,
+    stage_decodeDQT,
+    stage_decodeDRI,
+    stage_decodeScanCPU,
+    stage_decodeScanProgressive,
+    stage_finishProgressive,
+    stage_skipBlock,
+    stage_indexScan,
+    stage_packScanSegments,
+    stage_packCoefficients,
+    stage_upsampleAndColourTransformIPU,
+    stage_ipuRun,  // Each run of a device program, also inside upsampleAndColourTransformIPU
+    // A profiling reader's device runs phase by phase, from the first IPU's cycle counter. Bytes are what
+    // the copies moved over every IPU //
+    stage_ipuCopyParams,  // Params, quantisers and Huffman tables
+    stage_ipuCopyPacked,
+    stage_ipuCopyY,
+    stage_ipuCopyCb,
+    stage_ipuCopyCr,
+    stage_ipuHuffman,
+    stage_ipuPostprocess,
+    stage_ipuRasterGather,
+    stage_ipuCopyPixels,
+    // The postprocess vertex that took the fewest and the most cycles in each run, over the IPUs with an
+    // image. How far apart they are, and from ipuPostprocess, is the load imbalance //
+    stage_ipuPostprocessFastestTile,
+    stage_ipuPostprocessSlowestTile,
+    stage_buildIpuGraph,
+    NUM_STAGES
+  };
+
+  static const int NUM_IPU_PHASES = stage_ipuCopyPixels - stage_ipuCopyParams + 1;
+
+  struct DecodedImage {
+    int error = NO_ERROR;
+    unsigned short width = 0, height = 0;
+    std::vector<unsigned char> pixels;  // Raster order RGB
+  };
+
+  // The most recent scan's entropy coded data with byte stuffing removed, as the Huffman decoder reads
+  // it, plus where its markers were. RSTn markers stay in the data as 0xFFFF, at restart_offsets //
+  struct ScanIndex {
+    std::vector<unsigned char> data;  // Only grows, the bytes past size are padding
+    size_t size = 0;
+    std::vector<uint64_t> restart_offsets;  // Bit offset into data of each RSTn marker
+    size_t end_offset = 0;                  // Offset in the file of the marker ending the scan, e.g. EOI
+  };
+
   static const ulong MAX_PIXELS_PER_TILE = 16 * 16;
   static const ulong THREADS_PER_TILE = 6;
 
-  static const ulong MAX_DHT_NODES = 255;
-  static_assert(MAX_DHT_NODES < (1u << (8 * sizeof(unsigned char))));
-
-  static const ulong DHT_TABLE_BITS = 10; // Tunable value in [0, 16], balancing memory and compute
+  static const ulong DHT_TABLE_BITS = 10; // Tunable value in [1, 16], balancing memory and compute
   static const ulong DHT_TABLE_SIZE = 1 << DHT_TABLE_BITS;
+  // Codes longer than DHT_TABLE_BITS are resolved by a second table indexed by their remaining bits //
+  static const ulong DHT_LONG_TABLE_SIZE = 1 << (16 - DHT_TABLE_BITS);
+
+  // Each IPU copies only the start of its slice of the tensors that holds data, rounded up to one of
+  // this many sizes, each a quarter of the next, the largest being the whole slice //
+  static const ulong NUM_TRANSFER_SIZES = 4;
+  // When the IPU does the iDCT of a full size image, each virtual tile's coefficients go over packed into
+  // at most this many bytes, a third of its dense blocks, unless some tile of the image needs more //
+  static const ulong PACKED_BYTES_PER_TILE = 512;
 
-  JPGReader(poplar::Device& ipuDevice, bool do_iDCT_on_IPU = false, bool do_decompress_on_IPU = false);
+  // Scans without restart markers are only split speculatively if every chunk gets this many bytes //
+  static const ulong MIN_SPECULATIVE_CHUNK_BYTES = 16 * 1024;
+  // Ones after the end of ScanIndex data, so the bit reader can always load whole words //
+  static const ulong SCAN_PADDING_BYTES = 16;
+
+  // Names the layout of the device graph in the executable cache's file names. Bump it with any change
+  // to how buildPostprocessPrograms() builds it, or cached executables built the old way will be loaded
+  // in its place. The constants it is sized by are in the names already //
+  static const ulong GRAPH_VERSION = 1;
+
+  // The compiled graph is cached in executable_cache_dir, relative to the working directory like
+  // codelets.gp, and loaded from there by later readers on the same kind of device. Empty disables it.
+  // Decompressing on the IPU, which it does for baseline images with restart markers, implies the iDCT
+  // there too, as the coefficients never reach the host. profile_IPU builds the device programs to time
+  // each of their phases and vertices into timings, at the cost of syncing the tiles between phases //
+  JPGReader(poplar::Device& ipuDevice, bool do_iDCT_on_IPU = false, bool do_decompress_on_IPU = false,
+            const std::string& executable_cache_dir = "executable_cache", bool profile_IPU = IPU_PROFILE);
   ~JPGReader();
 
+  // Map the file into memory and parse it in place //
   void read(const char* filename);
+  // Borrow a caller-owned buffer, which must outlive the next decode() //
+  void readFromMemory(const uint8_t* data, size_t size);
   int decode();
+  // Decode into caller memory with rows stride bytes apart, which must hold height rows plus any chroma
+  // planes. The device's pixels go straight to dst for RGB24 images it puts in raster order at that
+  // stride, from each IPU whose copy fits in the buffer. write() only works after decode() //
+  int decodeInto(uint8_t* dst, size_t stride, PixelFormat format);
+  // Decode many images, overlapping host Huffman decoding of one with the IPU run of the previous //
+  std::vector<DecodedImage> decodeBatch(const std::vector<Input>& inputs);
   void write(const char* filename);
   void flush();
 
   bool isGreyScale();
   bool isReadyToDecode();
   void printTimingStats();
+  // Host threads used to entropy decode the scan concurrently. 1 means serial //
+  void setHostThreads(unsigned num_threads);
+  // Decode at 1/factor of the full size in each dimension, for factor 1, 2, 4 or 8, e.g. for thumbnails.
+  // Images with more MCUs than fit on the device are scaled down further on their own //
+  void setDownscale(int factor);
+  // The factor the last image was actually decoded at //
+  int downscale();
+  // Baseline images with more MCUs than fit on the device are decoded in strips of MCU rows, each run
+  // on the device while the host decodes the next. Without streaming they are downscaled instead //
+  void setStreaming(bool enable);
+  // Have the device put images in raster order itself, so their pixels arrive ready to use, rows padded
+  // to a multiple of RASTER_SEGMENT_PIXELS. Images whose MCUs aren't a multiple of that wide, as when
+  // downscaled far enough, are still reordered on the host //
+  void setRasterOnIPU(bool enable);
+  const ScanIndex& scanIndex() const;
+  // Cycles per block of the scalar iDCT and of the vector kernel picked at startup, over the blocks of the
+  // last image. Needs whole blocks of coefficients, so only for a reader leaving the iDCT to the IPU that
+  // decoded the image on the host, at full size and in one piece //
+  std::map<std::string, double> iDCTCyclesPerBlock();
 
-  std::map<std::string, std::vector<long>> timings;
+  // Per stage latency percentiles and throughput, and on request a trace of each stage run. On by
+  // default when built with TIMINGSTATS, and switched with timings.setEnabled() //
+  TimingStats timings;
 
  private:
+  struct TileLayout {
+    unsigned short width, height;
+    unsigned short num_MCUs_x, num_MCUs_y;
+    int MCU_size_x, MCU_size_y;
+    unsigned short MCUs_per_tile;
+    int num_active_tiles;
+    int first_tile;
+    int raster_stride;  // Pixels per row if the device put the image in raster order, else 0
+  };
+
+  // A batch image packed into the channel buffers or on the device, with the IPUs it is laid out over //
+  struct BatchImage {
+    DecodedImage* output;
+    TileLayout layout;
+    int first_IPU, num_IPUs;
+    int params[PARAMS_SIZE];
+    int subsampling;
+    unsigned char quant[3 * 64];
+    std::vector<int> huffman_tables;  // Only if the device decodes its scan
+  };
+
   bool m_ready_to_decode;
   bool m_do_iDCT_on_IPU;
   bool m_do_decompress_on_IPU;
+  bool m_progressive;
+  bool m_allow_streaming;
+  bool m_raster_on_IPU;
+  PixelFormat m_output_format;  // Of the current image's pixels, anything but RGB24 leaves them as YCbCr
+  bool m_streamed;       // The current image goes through the device a strip at a time
+  int m_strip_MCU_rows;  // MCU rows per strip, all of them unless streamed
 
+  std::string m_executable_cache_dir;
+  bool m_profile_IPU;
+  double m_IPU_cycles_per_microsecond;
+  std::vector<unsigned> m_IPU_cycle_stamps;  // Low and high words of each, read back after a profiled run
+  std::vector<unsigned> m_postprocess_cycles;  // Per virtual tile
+  std::vector<int> m_huffman_errors;  // Per virtual tile, read back after runs that decoded scans
   poplar::Graph m_ipu_graph;
+  unsigned m_num_IPUs;
+  unsigned m_tiles_per_IPU;  // Virtual tiles, THREADS_PER_TILE to each physical one
   unsigned m_num_tiles;
+  int m_IPU_pixels;
   int m_max_pixels;
   std::unique_ptr<poplar::Engine> m_ipuEngine;
   poplar::Tensor m_out_pixels;
+  std::vector<poplar::Tensor> m_raster_out_pixels;  // m_out_pixels gathered into raster order, per transfer size
   std::vector<poplar::Tensor> m_out_pixel_patches;
-  poplar::DataStream m_output_pixels_stream;
-  int m_IPU_params_table[PARAMS_SIZE];
+  std::vector<poplar::DataStream> m_output_pixels_streams;
+  std::vector<int> m_IPU_params_table;  // PARAMS_SIZE per IPU
   poplar::Tensor m_IPU_params_tensor;
+  std::vector<unsigned char> m_IPU_quant_table;  // Per IPU, each channel's 64 quantisers in natural order
+  poplar::Tensor m_IPU_quant_tensor;
+  std::vector<int> m_IPU_huffman_table;  // Per IPU, 4 * HUFFMAN_TABLE_SIZE if decompressing on the IPU
+  poplar::Tensor m_IPU_huffman_tensor;
+  poplar::Tensor m_packed_tensor;
+  std::vector<std::string> m_packed_stream_names;  // At ipu * NUM_TRANSFER_SIZES + size
+  std::vector<std::string> m_pixel_stream_names;   // Likewise
+  std::vector<poplar::DataStream> m_packed_streams;
 
-  std::vector<unsigned char> m_buf;
-  unsigned char *m_pos, *m_end;
-  unsigned int m_size;
+  const unsigned char* m_buf;
+  void* m_mapped_buf;
+  size_t m_mapped_size;
+  const unsigned char *m_pos, *m_end;
+  size_t m_size;
   unsigned short m_width, m_height;
   unsigned short m_num_MCUs_x, m_num_MCUs_y;
   int m_MCU_size_x, m_MCU_size_y;
   unsigned short m_MCUs_per_tile;
   int m_num_active_tiles;
+  int m_first_IPU, m_image_IPUs;  // The IPUs the current image is laid out over
+  int m_first_tile;
   unsigned char m_num_channels;
   int m_error;
+  int m_min_scale_shift;
+  int m_scale_shift;  // Blocks decode to (8 >> m_scale_shift) pixels square
   ColourChannel m_channels[3];
   std::vector<unsigned char> m_pixels;
+  std::vector<unsigned char> m_raster_pixels;  // Output of a streamed image, assembled strip by strip
+  // Scratch kept between images, so decoding one the size of an earlier one allocates nothing //
+  std::vector<unsigned char> m_write_buffer;     // Rows write() linearises, grown to the largest image
+  std::vector<unsigned char> m_upsample_buffer;  // A channel upsampled on the host, swapped with its pixels
+  std::vector<unsigned char> m_inflight_pixels[3];
+  std::vector<short> m_inflight_frequencies[3];
+  int m_coefficient_format;  // How the current image's coefficients go to the device
+  std::vector<unsigned char> m_packed_bytes;  // PACKED_BYTES_PER_TILE per virtual tile
+  std::vector<unsigned char> m_inflight_packed_bytes;
   DhtTableItem m_dht_tables[4][DHT_TABLE_SIZE];
-  DhtNode m_dht_trees[4][MAX_DHT_NODES];
+  DhtFusedItem m_dht_fused_tables[4][DHT_TABLE_SIZE];
+  std::vector<DhtTableItem> m_dht_long_tables[4];
+  // Each table as the DHT gave it, the number of codes of each length and their symbols //
+  unsigned char m_dht_code_counts[4][16];
+  unsigned char m_dht_symbols[4][256];
+  std::vector<int> m_huffman_tables;  // The current image's, as the Huffman vertex reads them
   unsigned char m_dq_tables[4][64];
   int m_restart_interval;
-  unsigned int m_bufbits;
-  unsigned char m_num_bufbits;
+  ScanIndex m_scan_index;
+  std::vector<const unsigned char*> m_segment_starts;
+  std::vector<SpeculativeChunk> m_speculative_chunks;
+  std::vector<ScanSegment> m_scan_segments;
+  std::unique_ptr<ThreadPool> m_thread_pool;
+  // Batch images are packed onto the IPUs, so small ones share a run of the device. The pending ones
+  // are in the channel buffers, the in-flight ones on the device //
+  bool m_packing;
+  int m_next_IPU;  // First IPU no pending image has claimed
+  std::vector<BatchImage> m_batch_pending;
+  std::vector<BatchImage> m_batch_inflight;
+  BackgroundJob m_batch_run;
+  BackgroundJob m_strip_run;  // The previous strip of a streamed image, on the device
+  IDCTKernel m_iDCT_kernel;
   int m_block_space[64];
 
+  bool startParse(const unsigned char* data, size_t size);
+  void unmapFile();
+
   unsigned short read16(const unsigned char* pos);
 
   void skipBlock();
   void decodeSOF();
   void decodeDHT();
+  void buildFusedTable(int table_id);
   void decodeDQT();
   void decodeDRI();
 
+  void decodeHost();
+  void indexScan();
   void decodeScanCPU();
-  void decodeBlock(ColourChannel* channel, short* freq_out, unsigned char* pixel_out);
-  unsigned char decodeRLEtuple(int dht_id);
-  int getBitsAsValue(int num_bits);
-  int getBits(int num_bits);
-  int showBits(int num_bits);
+  void decodeScanStreamed();
+  bool packScanSegments();
+  bool fillHuffmanTables();
+  bool decodeScanParallel();
+  bool decodeScanSpeculative();
+  void traceChunk(int chunk, const unsigned char* scan_start, const unsigned char* scan_end);
+  void syncChunk(int chunk, const unsigned char* scan_start, const unsigned char* scan_end);
+  uint64_t bitOffset(const ScanState& state, const unsigned char* scan_start);
+  void traceMCU(ScanState& state);
+  void readRestartMarker(ScanState& state);
+
+  void decodeScanProgressive();
+  void decodeBlockProgressive(ScanState& state, ColourChannel* channel, short* freq_out, const ProgressiveScan& scan);
+  void finishProgressive();
+  int blockOffset(const ColourChannel* channel, int MCU_index, int sample_x, int sample_y);
+  short* progressiveBlock(ColourChannel* channel, int MCU_index, int sample_x, int sample_y);
+  void startScanState(ScanState& state, const unsigned char* pos, const unsigned char* end);
+  void decodeMCU(ScanState& state, int tile, int MCU);
+  void decodeBlock(ScanState& state, ColourChannel* channel, short* freq_out, unsigned char* pixel_out);
+  unsigned char decodeRLEtuple(ScanState& state, int dht_id);
+  unsigned char decodeLongRLEtuple(ScanState& state, int dht_id, const DhtTableItem& prefix);
 
   void upsampleAndColourTransform();
   void upsampleAndColourTransformIPU();
+  void stageIPUInputs();
+  void stageChannelBuffers();
+  void fillIPUParams(int* params);
+  void fillIPUQuantTables(unsigned char* quant);
+  void packCoefficients(int num_MCUs);
+  bool packTile(int tile, int num_MCUs, const unsigned char* quant);
+  int transferTiles(int size);
+  void setTransferSizes(int first_tile, int end_tile);
+  int subsamplingMode();
+  int rasterStride();
+  int postprocessProgram(int subsampling);
   void upsampleChannel(ColourChannel* channel);
   void upsampleChannelIPU(ColourChannel* channel);
+  template <int N>
   void iDCT_row(short* D);
-  void iDCT_col(const short* D, unsigned char* out, int stride);
+  template <int N>
+  void iDCT_col(const short* D, int D_stride, unsigned char* out, int stride);
+  template <int N>
+  void iDCT_scaled(const short* D, int D_stride, unsigned char* out, int stride);
+  int iDCTBlock(short* D, int D_stride, int last_nonzero, unsigned char* out, int stride);
+
+  TileLayout currentLayout();
+  void launchBatchGroup();
+  void collectBatchRun();
+  void linearisePixels(const TileLayout& layout, unsigned char* outbuf, size_t stride, PixelFormat format);
+  void storePixelRun(const unsigned char* in, int num_pixels, int x, int y, unsigned char* outbuf, size_t stride,
+                     PixelFormat format, int height);
+  int connectOutputBuffer(unsigned char* outbuf, size_t size);
+  void connectPixelStreams(unsigned ipu, unsigned char* pixels);
 
   void buildIpuGraph(poplar::Device& ipuDevice);
+  std::vector<poplar::program::Program> buildPostprocessPrograms();
+  std::string executableCachePath(const poplar::Target& target);
+  void saveExecutable(const poplar::Executable& executable, const std::string& path);
+
+  static void runProgram(void* reader, unsigned program);
+  void recordIPUProfile(unsigned program, uint64_t start_time);
+  bool huffmanFailed(const TileLayout& layout);
 
-  void callAndTime(void (JPGReader::*method)(), const std::string name);
+  void callAndTime(void (JPGReader::*method)(), Stage stage, uint64_t MCUs = 0);
 };
 
 static const int deZigZagX[64] = {0, 1, 0, 0, 1, 2, 3, 2, 1, 0, 0, 1, 2, 3, 4, 5, 4, 3, 2, 1, 0, 0,
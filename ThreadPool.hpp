@@ -0,0 +1,178 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Minimal persistent pool for host-side data parallelism. parallelFor() hands out indices from a
+// shared counter to the workers and the calling thread, and returns once every index is done. The
+// workers only see the callable through a pointer to it, so handing them one never allocates //
+class ThreadPool {
+ public:
+  explicit ThreadPool(unsigned num_threads) : m_generation(0), m_busy_workers(0), m_stop(false) {
+    for (unsigned i = 1; i < num_threads; ++i) m_workers.emplace_back(&ThreadPool::workerLoop, this);
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto &worker : m_workers) worker.join();
+  }
+
+  unsigned size() const { return m_workers.size() + 1; }
+
+  template <class F>
+  void parallelFor(int n, const F &fn) {
+    if (m_workers.empty() || n <= 1) {
+      for (int i = 0; i < n; ++i) fn(i);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_fn = &fn;
+      m_invoke = &invoke<F>;
+      m_num_items = n;
+      m_next_item.store(0);
+      m_busy_workers = m_workers.size();
+      ++m_generation;
+    }
+    m_wake.notify_all();
+    runItems(&invoke<F>, &fn, n);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_busy_workers == 0; });
+    m_fn = nullptr;
+  }
+
+ private:
+  typedef void (*InvokeFn)(const void *fn, int item);
+
+  template <class F>
+  static void invoke(const void *fn, int item) {
+    (*static_cast<const F *>(fn))(item);
+  }
+
+  void runItems(InvokeFn invoke_fn, const void *fn, int n) {
+    for (int i = m_next_item.fetch_add(1); i < n; i = m_next_item.fetch_add(1)) invoke_fn(fn, i);
+  }
+
+  void workerLoop() {
+    unsigned long seen_generation = 0;
+    while (true) {
+      const void *fn;
+      InvokeFn invoke_fn;
+      int n;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wake.wait(lock, [&] { return m_stop || m_generation != seen_generation; });
+        if (m_stop) return;
+        seen_generation = m_generation;
+        fn = m_fn;
+        invoke_fn = m_invoke;
+        n = m_num_items;
+      }
+      runItems(invoke_fn, fn, n);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_busy_workers == 0) m_done.notify_one();
+      }
+    }
+  }
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_wake, m_done;
+  const void *m_fn = nullptr;
+  InvokeFn m_invoke = nullptr;
+  int m_num_items = 0;
+  std::atomic<int> m_next_item;
+  unsigned long m_generation;
+  unsigned m_busy_workers;
+  bool m_stop;
+};
+
+// One persistent thread running a job at a time alongside the caller, in place of std::async, which
+// starts a thread and allocates a shared state on every launch. The job is a plain function with a
+// context pointer and an argument. wait() blocks until it has finished and rethrows what it threw //
+class BackgroundJob {
+ public:
+  typedef void (*JobFn)(void *context, unsigned arg);
+
+  BackgroundJob() : m_fn(nullptr), m_context(nullptr), m_arg(0), m_pending(false), m_running(false), m_stop(false) {
+    m_thread = std::thread(&BackgroundJob::workerLoop, this);
+  }
+
+  ~BackgroundJob() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_wake.notify_one();
+    m_thread.join();
+  }
+
+  // Only one job at a time, so whoever launches the next must wait() for the last first //
+  void launch(JobFn fn, void *context, unsigned arg) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_fn = fn;
+      m_context = context;
+      m_arg = arg;
+      m_pending = m_running = true;
+    }
+    m_wake.notify_one();
+  }
+
+  // Whether a job was launched that nobody has waited for yet //
+  bool pending() const { return m_pending; }
+
+  void wait() {
+    if (!m_pending) return;
+    std::exception_ptr error;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_done.wait(lock, [this] { return !m_running; });
+      m_pending = false;
+      error = m_error;
+      m_error = nullptr;
+    }
+    if (error) std::rethrow_exception(error);
+  }
+
+ private:
+  void workerLoop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+      m_wake.wait(lock, [this] { return m_stop || m_running; });
+      if (m_stop) return;
+      lock.unlock();
+      std::exception_ptr error;
+      try {
+        m_fn(m_context, m_arg);
+      } catch (...) {
+        error = std::current_exception();
+      }
+      lock.lock();
+      m_error = error;
+      m_running = false;
+      m_done.notify_one();
+    }
+  }
+
+  std::thread m_thread;
+  std::mutex m_mutex;
+  std::condition_variable m_wake, m_done;
+  JobFn m_fn;
+  void *m_context;
+  unsigned m_arg;
+  std::exception_ptr m_error;
+  bool m_pending;  // Only touched by the launching thread
+  bool m_running;
+  bool m_stop;
+};
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Latency histograms for a fixed set of stages, plus an optional trace of every stage run. A stage is
+// an index into the table the owner passes in, so recording one reads a counter and bumps a bucket,
+// without allocating or looking anything up. Times are kept in ticks of the cheapest clock there is,
+// the TSC on x86, and only converted, against the steady clock, when they are reported. The buckets
+// are log-linear, SUB_BUCKETS to each power of two, so percentiles are good to about 3%. Each stage
+// may only be recorded by one thread at a time //
+class TimingStats {
+ public:
+  struct Stage {
+    const char *name;
+    int lane;  // The row of the trace it is drawn on, 0 for the host thread, 1 for the device, -1 for none
+  };
+
+  static const int SUB_BUCKET_BITS = 4;
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static const int NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  TimingStats(const Stage *stages, int num_stages, bool enabled)
+      : m_stages(stages),
+        m_num_stages(num_stages),
+        m_enabled(enabled),
+        m_histograms(num_stages),
+        m_num_events(0),
+        m_origin_ticks(now()),
+        m_origin_time(std::chrono::steady_clock::now()) {
+    reset();
+  }
+
+  static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  bool enabled() const { return m_enabled; }
+  void setEnabled(bool enable) { m_enabled = enable; }
+
+  // A run of the stage from start, a now() reading, until now. bytes and MCUs are what it got through,
+  // where that means something for the stage //
+  void record(int stage, uint64_t start, uint64_t bytes = 0, uint64_t MCUs = 0) {
+    if (!m_enabled) return;
+    uint64_t end = now();
+    recordSpan(stage, start, end > start ? end - start : 0, bytes, MCUs);
+  }
+
+  // A run measured some other way, e.g. on the device, taking ticks from start //
+  void recordSpan(int stage, uint64_t start, uint64_t ticks, uint64_t bytes = 0, uint64_t MCUs = 0) {
+    if (!m_enabled) return;
+    Histogram &histogram = m_histograms[stage];
+    ++histogram.count;
+    histogram.total_ticks += ticks;
+    if (ticks > histogram.max_ticks) histogram.max_ticks = ticks;
+    histogram.bytes += bytes;
+    histogram.MCUs += MCUs;
+    ++histogram.buckets[bucket(ticks)];
+
+    if (m_events.empty() || m_stages[stage].lane < 0) return;
+    size_t event = m_num_events.fetch_add(1, std::memory_order_relaxed);
+    if (event < m_events.size()) m_events[event] = {stage, start, ticks, bytes, MCUs};
+  }
+
+  // Forget every sample and traced event. Nothing is freed, so recording again allocates nothing //
+  void reset() {
+    for (auto &histogram : m_histograms) {
+      histogram.count = histogram.total_ticks = histogram.max_ticks = histogram.bytes = histogram.MCUs = 0;
+      histogram.buckets.fill(0);
+    }
+    m_num_events = 0;
+  }
+
+  uint64_t count(int stage) const { return m_histograms[stage].count; }
+
+  double meanMilliseconds(int stage) const {
+    const Histogram &histogram = m_histograms[stage];
+    return histogram.count ? histogram.total_ticks / (1000. * ticksPerMicrosecond() * histogram.count) : 0.;
+  }
+
+  double maxMilliseconds(int stage) const {
+    return m_histograms[stage].max_ticks / (1000. * ticksPerMicrosecond());
+  }
+
+  // The time fraction of the stage's runs took at most, from the middle of the bucket it falls in //
+  double percentileMilliseconds(int stage, double fraction) const {
+    const Histogram &histogram = m_histograms[stage];
+    if (!histogram.count) return 0.;
+    uint64_t rank = std::max<uint64_t>(1, fraction * histogram.count + 0.5), seen = 0;
+    int i = 0;
+    while ((seen += histogram.buckets[i]) < rank) ++i;
+    double ticks = std::min<double>(histogram.max_ticks, bucketLow(i) + (bucketLow(i + 1) - bucketLow(i)) / 2.);
+    return ticks / (1000. * ticksPerMicrosecond());
+  }
+
+  void print() const {
+    double ticks_per_microsecond = ticksPerMicrosecond();
+    printf(
+        "+-------------------------------+-------+-----------+-----------+-----------+-----------+-----------+"
+        "-----------+-----------+\n"
+        "|                        Method | Calls | Mean (ms) |  p50 (ms) |  p90 (ms) |  p99 (ms) |  Max (ms) |"
+        "      MB/s |   MCUs/ms |\n"
+        "+-------------------------------+-------+-----------+-----------+-----------+-----------+-----------+"
+        "-----------+-----------+\n");
+    for (int stage = 0; stage < m_num_stages; ++stage) {
+      const Histogram &histogram = m_histograms[stage];
+      if (!histogram.count) continue;
+      double total_milliseconds = histogram.total_ticks / (1000. * ticks_per_microsecond);
+      printf("|%30s | %5llu | % 9.3f | % 9.3f | % 9.3f | % 9.3f | % 9.3f |", m_stages[stage].name,
+             (unsigned long long)histogram.count, meanMilliseconds(stage), percentileMilliseconds(stage, 0.5),
+             percentileMilliseconds(stage, 0.9), percentileMilliseconds(stage, 0.99),
+             histogram.max_ticks / (1000. * ticks_per_microsecond));
+      double megabytes_per_second = histogram.bytes / (1000. * total_milliseconds);
+      if (histogram.bytes && total_milliseconds > 0) {
+        printf(megabytes_per_second < 1e6 ? " % 9.1f |" : " % 9.2e |", megabytes_per_second);
+      } else {
+        printf("         - |");
+      }
+      if (histogram.MCUs && total_milliseconds > 0) {
+        printf(" % 9.1f |\n", histogram.MCUs / total_milliseconds);
+      } else {
+        printf("         - |\n");
+      }
+    }
+    printf(
+        "+-------------------------------+-------+-----------+-----------+-----------+-----------+-----------+"
+        "-----------+-----------+\n");
+  }
+
+  // Keep every stage run from now on, up to max_events of them, to write out with writeTrace(). This is
+  // the one allocation, so it belongs before the decodes being traced //
+  void startTrace(size_t max_events) {
+    m_events.assign(max_events, {});
+    m_num_events = 0;
+  }
+
+  // The traced runs as Chrome trace event JSON, which chrome://tracing and Perfetto open, with host
+  // stages and device runs on rows of their own. Returns false if the file couldn't be written //
+  bool writeTrace(const char *path) const {
+    FILE *f = fopen(path, "w");
+    if (!f) return false;
+    double ticks_per_microsecond = ticksPerMicrosecond();
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"host\"}},\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"device\"}}");
+    size_t num_events = std::min(m_num_events.load(), m_events.size());
+    for (size_t i = 0; i < num_events; ++i) {
+      const Event &event = m_events[i];
+      double start = (int64_t)(event.start - m_origin_ticks) / ticks_per_microsecond;
+      fprintf(f,
+              ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+              "\"args\":{\"bytes\":%llu,\"MCUs\":%llu}}",
+              m_stages[event.stage].name, m_stages[event.stage].lane, start, event.ticks / ticks_per_microsecond,
+              (unsigned long long)event.bytes, (unsigned long long)event.MCUs);
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":%zu}}\n",
+            m_num_events.load() - num_events);
+    return fclose(f) == 0;
+  }
+
+  // The TSC rate, from how far it and the steady clock have moved since construction. Waits until that
+  // is long enough to measure, which only happens when asked right after construction //
+  double ticksPerMicrosecond() const {
+#if defined(__x86_64__) || defined(__i386__)
+    auto elapsed = std::chrono::steady_clock::now() - m_origin_time;
+    if (elapsed < std::chrono::milliseconds(10)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10) - elapsed);
+    }
+    uint64_t ticks = now() - m_origin_ticks;
+    elapsed = std::chrono::steady_clock::now() - m_origin_time;
+    return ticks / (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() * 1000.;
+#else
+    return 1000.;
+#endif
+  }
+
+ private:
+  struct Histogram {
+    uint64_t count, total_ticks, max_ticks, bytes, MCUs;
+    std::array<uint32_t, NUM_BUCKETS> buckets;
+  };
+
+  struct Event {
+    int stage;
+    uint64_t start, ticks, bytes, MCUs;
+  };
+
+  // Values below SUB_BUCKETS have a bucket each, above that each power of two is split SUB_BUCKETS ways //
+  static int bucket(uint64_t ticks) {
+    if (ticks < (uint64_t)SUB_BUCKETS) return ticks;
+    int exponent = 63 - __builtin_clzll(ticks);
+    int shift = exponent - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((ticks >> shift) & (SUB_BUCKETS - 1));
+  }
+
+  static double bucketLow(int i) {
+    if (i < SUB_BUCKETS) return i;
+    int shift = i / SUB_BUCKETS - 1;
+    return double(SUB_BUCKETS + i % SUB_BUCKETS) * double(1ull << shift);
+  }
+
+  const Stage *m_stages;
+  int m_num_stages;
+  bool m_enabled;
+  std::vector<Histogram> m_histograms;
+  std::vector<Event> m_events;  // Empty unless tracing
+  std::atomic<size_t> m_num_events;
+  uint64_t m_origin_ticks;
+  std::chrono::steady_clock::time_point m_origin_time;
+};
@@ -0,0 +1,137 @@
+#ifndef BIT_READER_H
+#define BIT_READER_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Bit reader for JPEG entropy coded data, shared by JPGReader, CPUReader and the IPresentU decoder.
+// Bits are buffered MSB first. Stuffed zero bytes are dropped, RSTn markers read as 0xFFFF so the
+// caller can byte align and step over them, and reading past the end pads with ones. A reader started
+// with bitReaderStartUnstuffed() reads data that has already been through that, and checks nothing //
+
+#ifndef SYNTAX_ERROR
+#define SYNTAX_ERROR 1
+#endif
+
+#if defined(__POPC__) || defined(__IPU__)
+// IPU tiles have no 64-bit integer unit, so codelets keep a word sized buffer filled byte by byte //
+typedef unsigned int BitBuffer;
+#define BIT_READER_WORD_REFILL 0
+#else
+typedef uint64_t BitBuffer;
+#define BIT_READER_WORD_REFILL 1
+#endif
+
+typedef struct _BitReader {
+  const unsigned char *pos, *end;
+  BitBuffer bufbits;
+  int num_bufbits;
+  int error;
+  int unstuffed;
+} BitReader;
+
+static inline void bitReaderStart(BitReader *reader, const unsigned char *pos, const unsigned char *end) {
+  reader->pos = pos;
+  reader->end = end;
+  reader->bufbits = 0;
+  reader->num_bufbits = 0;
+  reader->error = 0;
+  reader->unstuffed = 0;
+}
+
+static inline void bitReaderStartUnstuffed(BitReader *reader, const unsigned char *pos, const unsigned char *end) {
+  bitReaderStart(reader, pos, end);
+  reader->unstuffed = 1;
+}
+
+// Careful path: one byte at a time, handling byte stuffing, markers and the end of the buffer //
+static inline void bitReaderRefillByte(BitReader *reader) {
+  if (reader->pos >= reader->end) {
+    reader->bufbits = (reader->bufbits << 8) | 0xFF;
+    reader->num_bufbits += 8;
+    return;
+  }
+  unsigned char newbyte = *reader->pos++;
+  reader->bufbits = (reader->bufbits << 8) | newbyte;
+  reader->num_bufbits += 8;
+  if (newbyte != 0xFF || reader->unstuffed) return;
+
+  if (reader->pos >= reader->end) {
+    reader->error = SYNTAX_ERROR;
+    return;
+  }
+  unsigned char follow_byte = *reader->pos++;
+  switch (follow_byte) {
+    case 0x00:
+    case 0xFF:
+    case 0xD9:
+      break;
+    default:
+      if ((follow_byte & 0xF8) != 0xD0) {
+        // Not ours to read: stop here and only pad from now on, the caller reports the error //
+        reader->error = SYNTAX_ERROR;
+        reader->pos = reader->end;
+      } else {
+        reader->bufbits = (reader->bufbits << 8) | newbyte;
+        reader->num_bufbits += 8;
+      }
+  }
+}
+
+#if BIT_READER_WORD_REFILL
+static inline uint64_t bitReaderLoad64(const unsigned char *pos) {
+  uint64_t word;
+  memcpy(&word, pos, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+#endif
+
+static inline void bitReaderRefill(BitReader *reader, int num_bits) {
+  while (reader->num_bufbits < num_bits) {
+#if BIT_READER_WORD_REFILL
+    // Fast path: top the buffer up with as many whole bytes as fit, provided none of them needs a look //
+    if (reader->end - reader->pos >= 8) {
+      uint64_t word = bitReaderLoad64(reader->pos);
+      int num_bytes = (63 - reader->num_bufbits) >> 3;
+      uint64_t ignored = ~0ull >> (8 * num_bytes);
+      uint64_t inverted = ~word | ignored;  // Zero bytes are 0xFF bytes in the window
+      if (reader->unstuffed || !((inverted - 0x0101010101010101ull) & ~inverted & 0x8080808080808080ull)) {
+        reader->bufbits = (reader->bufbits << (8 * num_bytes)) | (word >> (64 - 8 * num_bytes));
+        reader->num_bufbits += 8 * num_bytes;
+        reader->pos += num_bytes;
+        continue;
+      }
+    }
+#endif
+    bitReaderRefillByte(reader);
+  }
+}
+
+// This only shows the bits, but doesn't move past them //
+static inline int bitReaderShow(BitReader *reader, int num_bits) {
+  if (reader->num_bufbits < num_bits) bitReaderRefill(reader, num_bits);
+  return (int)(reader->bufbits >> (reader->num_bufbits - num_bits)) & ((1 << num_bits) - 1);
+}
+
+// Show the bits AND move past them //
+static inline int bitReaderGet(BitReader *reader, int num_bits) {
+  int res = bitReaderShow(reader, num_bits);
+  reader->num_bufbits -= num_bits;
+  return res;
+}
+
+// Read a coefficient magnitude of num_bits bits, as coded after its Huffman symbol //
+static inline int bitReaderGetValue(BitReader *reader, int num_bits) {
+  if (num_bits == 0) return 0;
+  int value = bitReaderGet(reader, num_bits);
+  if (value < (1 << (num_bits - 1))) value += (int)(0xffffffffu << num_bits) + 1;
+  return value;
+}
+
+// Drop the bits up to the next byte boundary, e.g. before an RSTn marker //
+static inline void bitReaderAlign(BitReader *reader) { reader->num_bufbits &= ~7; }
+
+#endif  // BIT_READER_H //
@@ -2,13 +2,58 @@
 #include "codelets.hpp"
 
 #include <poplar/Vertex.hpp>
+#ifdef __IPU__
+#include <ipu_builtins.h>
+#endif
 
+#include "bitReader.h"
+
+template <int N>
 void iDCT_row(short* D);
+template <int N>
 void iDCT_col(short* D, int stride);
-void iDCT(short* data, int pixels_per_tile, int stride);
+template <int N>
+void iDCT_scaled(short* D, int stride);
+template <>
+void iDCT_scaled<1>(short* D, int);
+void iDCT_block(short* D, int stride);
+void iDCT(short* data, int pixels_per_tile, int stride, int scale_shift);
+void expandCoefficients(const unsigned char* in, const unsigned char* end, const unsigned char* quant,
+                        short* const* channels, const int* strides, const int* block_rows, int num_channels, int MCUs);
 
 inline unsigned char clip(const int x) { return (x < 0) ? 0 : ((x > 0xFF) ? 0xFF : (unsigned char)x); }
 
+inline void YCbCrToRGB(int y, int cb, int cr, unsigned char* out) {
+  y <<= 8;
+  cb -= 128;
+  cr -= 128;
+  out[0] = clip((y + 359 * cr + 128) >> 8);            // R
+  out[1] = clip((y - 88 * cb - 183 * cr + 128) >> 8);  // G
+  out[2] = clip((y + 454 * cb + 128) >> 8);            // B
+}
+
+// The tile's cycle counter, for vertices timing themselves. Zero where there isn't one, as on the IPU
+// model //
+inline unsigned tileCycles() {
+#ifdef __IPU__
+  return __builtin_ipu_get_scount_l();
+#else
+  return 0;
+#endif
+}
+
+// The upsampled pixel as it is, for consumers that want YCbCr //
+template <bool colour_transform>
+inline void storePixel(int y, int cb, int cr, unsigned char* out) {
+  if (!colour_transform) {
+    out[0] = clip(y);
+    out[1] = clip(cb);
+    out[2] = clip(cr);
+    return;
+  }
+  YCbCrToRGB(y, cb, cr, out);
+}
+
 template <bool do_iDCT, typename T_coeff>
 class postProcessColour : public poplar::Vertex {
  public:
@@ -20,7 +65,14 @@ class postProcessColour : public poplar::Vertex {
 
   poplar::Output<poplar::Vector<unsigned char>> RGB;
 
+  // Coefficients in the compact format, and the quantisers to expand them with //
+  poplar::Input<poplar::Vector<unsigned char>> packed;
+  poplar::Input<poplar::Vector<unsigned char>> quant;
+
+  poplar::Output<poplar::Vector<unsigned>> cycles;  // The one element is what this vertex took
+
   bool compute() {
+    unsigned start_cycles = tileCycles();
     int CB_downshift_y = params[param_CB_downshift_y];
     int CB_downshift_x = params[param_CB_downshift_x];
     int CR_downshift_y = params[param_CR_downshift_y];
@@ -34,69 +86,430 @@ class postProcessColour : public poplar::Vertex {
     int CR_MCU_pixels = (MCU_height >> CR_downshift_y) * CR_stride;
     int MCUs_per_tile = params[param_MCUs_per_tile];
     int num_channels = params[param_num_channels];
+    int scale_shift = params[param_scale_shift];
 
     // Do iDCT //
     if (do_iDCT) {
-      iDCT((short*)&Y[0], MCUs_per_tile * Y_MCU_pixels, Y_stride);
+      if (params[param_coefficient_format] == coefficients_compact) {
+        short* channels[3] = {(short*)&Y[0], (short*)&CB[0], (short*)&CR[0]};
+        int strides[3] = {Y_stride, CB_stride, CR_stride};
+        int block_rows[3] = {MCU_height / 8, (MCU_height >> CB_downshift_y) / 8, (MCU_height >> CR_downshift_y) / 8};
+        expandCoefficients(&packed[0], &packed[0] + packed.size(), &quant[0], channels, strides, block_rows,
+                           num_channels, MCUs_per_tile);
+      }
+      iDCT((short*)&Y[0], MCUs_per_tile * Y_MCU_pixels, Y_stride, scale_shift);
       if (num_channels == 3) {
-        iDCT((short*)&CB[0], MCUs_per_tile * CB_MCU_pixels, CB_stride);
-        iDCT((short*)&CR[0], MCUs_per_tile * CR_MCU_pixels, CR_stride);
+        iDCT((short*)&CB[0], MCUs_per_tile * CB_MCU_pixels, CB_stride, scale_shift);
+        iDCT((short*)&CR[0], MCUs_per_tile * CR_MCU_pixels, CR_stride, scale_shift);
       }
     }
 
     if (num_channels == 1) {
 
-      // Just copy the brightness into all 3 output channels if image is greyscale //
+      // Just copy the brightness into all 3 output channels if image is greyscale, or into Y with neutral
+      // chroma //
+      bool YCbCr_output = params[param_YCbCr_output];
       for (int y = 0; y < MCUs_per_tile * MCU_height; y++) {
         for (int x = 0; x < Y_stride; ++x) {
           int pixel = y * Y_stride + x;
           unsigned char* out = &RGB[3 * pixel];
           unsigned char brightness = clip(Y[pixel]);
           out[0] = brightness;
-          out[1] = brightness;
-          out[2] = brightness;
+          out[1] = YCbCr_output ? 128 : brightness;
+          out[2] = YCbCr_output ? 128 : brightness;
         }
       }
 
+    } else if (params[param_YCbCr_output]) {
+      upsample<false>(MCUs_per_tile * MCU_height, Y_stride, CB_stride, CR_stride);
     } else {
+      upsample<true>(MCUs_per_tile * MCU_height, Y_stride, CB_stride, CR_stride);
+    }
+    cycles[0] = tileCycles() - start_cycles;
+    return true;
+  }
+
+  // Do fused upscale and YCbCr->RGB colour transform if there are 3 channels //
+  template <bool colour_transform>
+  void upsample(int rows, int Y_stride, int CB_stride, int CR_stride) {
+    int CB_downshift_y = params[param_CB_downshift_y];
+    int CB_downshift_x = params[param_CB_downshift_x];
+    int CR_downshift_y = params[param_CR_downshift_y];
+    int CR_downshift_x = params[param_CR_downshift_x];
+    for (int Y_y = 0; Y_y < rows; Y_y++) {
+      const T_coeff* CB_row = &CB[(Y_y >> CB_downshift_y) * CB_stride];
+      const T_coeff* CR_row = &CR[(Y_y >> CR_downshift_y) * CR_stride];
 
-      // Do fused upscale and YCbCr->RGB colour transform if there are 3 channels //
-      for (int Y_y = 0; Y_y < MCUs_per_tile * MCU_height; Y_y++) {
-        const T_coeff* CB_row = &CB[(Y_y >> CB_downshift_y) * CB_stride];
-        const T_coeff* CR_row = &CR[(Y_y >> CR_downshift_y) * CR_stride];
+      for (int Y_x = 0; Y_x < Y_stride; ++Y_x) {
+        int pixel = Y_y * Y_stride + Y_x;
+        storePixel<colour_transform>(Y[pixel], CB_row[Y_x >> CB_downshift_x], CR_row[Y_x >> CR_downshift_x],
+                                     &RGB[3 * pixel]);
+      }
+    }
+  }
+};
 
-        for (int Y_x = 0; Y_x < Y_stride; ++Y_x) {
-          int pixel = Y_y * Y_stride + Y_x;
-          unsigned char* out = &RGB[3 * pixel];
+template class postProcessColour<true, short>;
+template class postProcessColour<false, unsigned char>;
+
+// postProcessColour for one of the common subsampling modes at full scale. The MCU layout is fixed at
+// compile time, so of the params only MCUs_per_tile is read, and the loops over a row have constant
+// trip counts and shifts, letting the compiler unroll them. Chroma rows are 8 pixels in every mode //
+template <bool do_iDCT, typename T_coeff, int mode>
+class postProcessSubsampled : public poplar::Vertex {
+ public:
+  poplar::Input<poplar::Vector<int>> params;
+
+  poplar::InOut<poplar::Vector<T_coeff>> Y;
+  poplar::InOut<poplar::Vector<T_coeff>> CB;
+  poplar::InOut<poplar::Vector<T_coeff>> CR;
+
+  poplar::Output<poplar::Vector<unsigned char>> RGB;
+
+  // Coefficients in the compact format, and the quantisers to expand them with //
+  poplar::Input<poplar::Vector<unsigned char>> packed;
+  poplar::Input<poplar::Vector<unsigned char>> quant;
+
+  poplar::Output<poplar::Vector<unsigned>> cycles;  // The one element is what this vertex took
+
+  static const int num_channels = (mode == subsampling_grey) ? 1 : 3;
+  static const int downshift_x = (mode == subsampling_422 || mode == subsampling_420) ? 1 : 0;
+  static const int downshift_y = (mode == subsampling_420) ? 1 : 0;
+  static const int MCU_width = 8 << downshift_x;
+  static const int MCU_height = 8 << downshift_y;
+
+  bool compute() {
+    unsigned start_cycles = tileCycles();
+    int MCUs_per_tile = params[param_MCUs_per_tile];
+    int rows = MCUs_per_tile * MCU_height;
+
+    if (do_iDCT) {
+      if (params[param_coefficient_format] == coefficients_compact) {
+        short* channels[3] = {(short*)&Y[0], (short*)&CB[0], (short*)&CR[0]};
+        const int strides[3] = {MCU_width, 8, 8};
+        const int block_rows[3] = {MCU_height / 8, 1, 1};
+        expandCoefficients(&packed[0], &packed[0] + packed.size(), &quant[0], channels, strides, block_rows,
+                           num_channels, MCUs_per_tile);
+      }
+      iDCT((short*)&Y[0], rows * MCU_width, MCU_width, 0);
+      if (num_channels == 3) {
+        iDCT((short*)&CB[0], MCUs_per_tile * 64, 8, 0);
+        iDCT((short*)&CR[0], MCUs_per_tile * 64, 8, 0);
+      }
+    }
+
+    if (params[param_YCbCr_output]) {
+      upsample<false>(rows);
+    } else {
+      upsample<true>(rows);
+    }
+    cycles[0] = tileCycles() - start_cycles;
+    return true;
+  }
+
+  template <bool colour_transform>
+  void upsample(int rows) {
+    for (int Y_y = 0; Y_y < rows; Y_y++) {
+      const T_coeff* Y_row = &Y[Y_y * MCU_width];
+      unsigned char* out = &RGB[3 * Y_y * MCU_width];
+
+      if (num_channels == 1) {
+        for (int Y_x = 0; Y_x < MCU_width; ++Y_x) {
+          unsigned char brightness = clip(Y_row[Y_x]);
+          out[3 * Y_x + 0] = brightness;
+          out[3 * Y_x + 1] = colour_transform ? brightness : 128;
+          out[3 * Y_x + 2] = colour_transform ? brightness : 128;
+        }
+        continue;
+      }
+
+      const T_coeff* CB_row = &CB[(Y_y >> downshift_y) * 8];
+      const T_coeff* CR_row = &CR[(Y_y >> downshift_y) * 8];
+      for (int Y_x = 0; Y_x < MCU_width; ++Y_x) {
+        storePixel<colour_transform>(Y_row[Y_x], CB_row[Y_x >> downshift_x], CR_row[Y_x >> downshift_x], &out[3 * Y_x]);
+      }
+    }
+  }
+};
+
+template class postProcessSubsampled<true, short, subsampling_grey>;
+template class postProcessSubsampled<true, short, subsampling_444>;
+template class postProcessSubsampled<true, short, subsampling_422>;
+template class postProcessSubsampled<true, short, subsampling_420>;
+template class postProcessSubsampled<false, unsigned char, subsampling_grey>;
+template class postProcessSubsampled<false, unsigned char, subsampling_444>;
+template class postProcessSubsampled<false, unsigned char, subsampling_422>;
+template class postProcessSubsampled<false, unsigned char, subsampling_420>;
+
+// Natural order position of each coefficient in zigzag order //
+static const unsigned char zigzag_to_natural[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,  12, 19, 26, 33, 40, 48,
+    41, 34, 27, 20, 13, 6,  7,  14, 21, 28, 35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23,
+    30, 37, 44, 51, 58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
+
+// The symbol of the next Huffman code, or -1 if no code of the table starts the bits //
+inline int decodeSymbol(BitReader* reader, const int* table) {
+  int item = table[huffman_lookup + bitReaderShow(reader, 8)];
+  if (item) {
+    reader->num_bufbits -= item >> 8;
+    return item & 0xFF;
+  }
+  int bits = bitReaderShow(reader, 16);
+  for (int code_len = 9; code_len <= 16; ++code_len) {
+    int code = bits >> (16 - code_len);
+    if (code <= table[huffman_maxcode + code_len]) {
+      reader->num_bufbits -= code_len;
+      return table[huffman_values + ((code + table[huffman_valoffset + code_len]) & 0xFF)];
+    }
+  }
+  return -1;
+}
+
+// One block's coefficients, dequantised and in natural order, as JPGReader::decodeBlock leaves them on the
+// host. The block must be zero to start with. Returns false if the data isn't a valid block //
+inline bool decodeHuffmanBlock(BitReader* reader, const int* dc_table, const int* ac_table,
+                               const unsigned char* quant, int* dc, short* D, int stride) {
+  int dc_tuple = decodeSymbol(reader, dc_table);
+  if (dc_tuple < 0) return false;
+  *dc += bitReaderGetValue(reader, dc_tuple & 0x0F);
+  D[0] = *dc * quant[0];
 
-          int y = Y[pixel] << 8;
-          int cb = CB_row[Y_x >> CB_downshift_x] - 128;
-          int cr = CR_row[Y_x >> CR_downshift_x] - 128;
+  int pos = 0;
+  do {
+    int tuple = decodeSymbol(reader, ac_table);
+    if (tuple < 0) return false;
+    if (!tuple) break;  // EOB marker
+    int num_value_bits = tuple & 0x0F;
+    int num_zeros = tuple >> 4;
+    // If there are no value bits, this must be a run of 16 (i.e. 15+1) zeros
+    if (num_value_bits == 0 && num_zeros != 15) return false;
+    pos += num_zeros + 1;
+    if (pos >= 64) return false;
+    int natural = zigzag_to_natural[pos];
+    D[(natural >> 3) * stride + (natural & 7)] = bitReaderGetValue(reader, num_value_bits) * quant[natural];
+  } while (pos < 63);
+  return true;
+}
 
-          *(out++) = clip((y + 359 * cr + 128) >> 8);            // R
-          *(out++) = clip((y - 88 * cb - 183 * cr + 128) >> 8);  // G
-          *(out) = clip((y + 454 * cb + 128) >> 8);              // B
+// Entropy decode the restart intervals JPGReader::packScanSegments left in the tile's packed bytes into
+// its channel tensors, for the postprocess vertex's iDCT. Each interval is decoded from its start,
+// skipping its MCUs before the tile's. Blocks the data doesn't cover are zero, as are those after bad
+// data, which also sets error for the host to report //
+class decodeHuffman : public poplar::Vertex {
+ public:
+  poplar::Input<poplar::Vector<int>> params;
+  poplar::Input<poplar::Vector<unsigned char>> packed;
+  poplar::Input<poplar::Vector<unsigned char>> quant;
+  poplar::Input<poplar::Vector<int>> tables;
+
+  poplar::InOut<poplar::Vector<short>> Y;
+  poplar::InOut<poplar::Vector<short>> CB;
+  poplar::InOut<poplar::Vector<short>> CR;
+
+  poplar::Output<poplar::Vector<int>> error;  // The one element is 1 if the tile's data was bad, else 0
+
+  bool compute() {
+    error[0] = 0;
+    if (params[param_coefficient_format] != coefficients_huffman) return true;
+    int MCU_width = params[param_MCU_width];
+    int MCU_height = params[param_MCU_height];
+    int MCUs_per_tile = params[param_MCUs_per_tile];
+    int num_channels = params[param_num_channels];
+    short* channels[3] = {&Y[0], &CB[0], &CR[0]};
+    int strides[3] = {MCU_width, MCU_width >> params[param_CB_downshift_x], MCU_width >> params[param_CR_downshift_x]};
+    int block_rows[3] = {MCU_height / 8, (MCU_height >> params[param_CB_downshift_y]) / 8,
+                         (MCU_height >> params[param_CR_downshift_y]) / 8};
+    const int *dc_tables[3], *ac_tables[3];
+    for (int c = 0; c < num_channels; ++c) {
+      int table_ids = params[param_Y_tables + c];
+      dc_tables[c] = &tables[(table_ids & 3) * HUFFMAN_TABLE_SIZE];
+      ac_tables[c] = &tables[(table_ids >> 2) * HUFFMAN_TABLE_SIZE];
+      for (int i = 0; i < MCUs_per_tile * block_rows[c] * 8 * strides[c]; ++i) channels[c][i] = 0;
+    }
+
+    // Tiles past the end of the image have stale bytes, so reads stop at the end of the tile's //
+    const unsigned char* in = &packed[0];
+    const unsigned char* end = in + packed.size();
+    int num_runs = *in++;
+    int MCU = 0;
+    short skipped[64];
+    for (int run = 0; run < num_runs && end - in >= 5; ++run) {
+      int skip = in[0] | (in[1] << 8);
+      int count = in[2];
+      int length = in[3] | (in[4] << 8);
+      in += 5;
+      if (length > end - in) break;
+      BitReader reader;
+      bitReaderStartUnstuffed(&reader, in, in + length);
+      in += length;
+
+      int dc[3] = {0, 0, 0};
+      for (int i = 0; i < skip + count && MCU < MCUs_per_tile; ++i) {
+        for (int c = 0; c < num_channels; ++c) {
+          short* MCU_start = &channels[c][MCU * block_rows[c] * 8 * strides[c]];
+          for (int block_y = 0; block_y < block_rows[c]; ++block_y) {
+            for (int block_x = 0; block_x < strides[c]; block_x += 8) {
+              short* D = skipped;
+              int stride = 8;
+              if (i >= skip) {
+                D = &MCU_start[block_y * 8 * strides[c] + block_x];
+                stride = strides[c];
+              }
+              if (!decodeHuffmanBlock(&reader, dc_tables[c], ac_tables[c], &quant[c * 64], &dc[c], D, stride)) {
+                error[0] = 1;
+                return true;
+              }
+            }
+          }
         }
+        if (i >= skip) ++MCU;
       }
     }
     return true;
   }
 };
 
-template class postProcessColour<true, short>;
-template class postProcessColour<false, unsigned char>;
+// For each of the tile's runs of RASTER_SEGMENT_PIXELS pixels of raster output, where in the tile-major
+// pixels the run comes from, for the raster program to gather them by. Both are indexed over just the runs
+// gathered, param_raster_IPU_segments from the start of each IPU's. IPUs whose image stays tile-major
+// gather every run from where it already is //
+class rasterOffsets : public poplar::Vertex {
+ public:
+  poplar::Input<poplar::Vector<int>> params;
+  poplar::Output<poplar::Vector<unsigned>> offsets;
+  unsigned first_segment;  // The tile's first run, of num_segments in the device's pixels
+  unsigned num_segments;
+  unsigned segments_per_IPU;
+  unsigned tile_pixels;
+
+  // Where a run of the device's pixels is among those gathered //
+  unsigned gathered(unsigned segment, unsigned IPU_segments) {
+    return segment / segments_per_IPU * IPU_segments + segment % segments_per_IPU;
+  }
+
+  bool compute() {
+    int stride = params[param_raster_stride];
+    int first_pixel = params[param_first_pixel];
+    int MCU_width = params[param_MCU_width];
+    int MCU_height = params[param_MCU_height];
+    int MCUs_per_tile = params[param_MCUs_per_tile];
+    int num_MCUs_x = params[param_num_MCUs_x];
+    unsigned IPU_segments = params[param_raster_IPU_segments];
+    for (unsigned i = 0; i < offsets.size(); ++i) {
+      unsigned segment = first_segment + i;
+      offsets[i] = gathered(segment, IPU_segments);
+      if (!stride) continue;
+      int raster = segment * RASTER_SEGMENT_PIXELS - first_pixel;
+      int y = raster / stride, x = raster % stride;
+      int MCU = (y / MCU_height) * num_MCUs_x + x / MCU_width;
+      unsigned pixel = first_pixel + (MCU / MCUs_per_tile) * tile_pixels +
+                       (MCU % MCUs_per_tile) * MCU_width * MCU_height + (y % MCU_height) * MCU_width + x % MCU_width;
+      // Rows past the image's last MCU row have nothing to gather //
+      unsigned source = pixel / RASTER_SEGMENT_PIXELS;
+      if (source < num_segments && source % segments_per_IPU < IPU_segments) {
+        offsets[i] = gathered(source, IPU_segments);
+      }
+    }
+    return true;
+  }
+};
+
+// Refill a block of coefficients from its compact format, as JPGReader::packTile describes it, returning
+// where the next block starts. Tiles past the end of the image have stale bytes, so reads stop at end //
+inline const unsigned char* expandBlock(const unsigned char* in, const unsigned char* end, const unsigned char* quant,
+                                        short* D, int stride) {
+  for (int y = 0; y < 8; ++y) {
+    for (int x = 0; x < 8; ++x) D[y * stride + x] = 0;
+  }
+  if (end - in < 3) return end;
+  int count = in[0];
+  D[0] = (short)(in[1] | (in[2] << 8));
+  in += 3;
+  for (int i = 0; i < count && end - in >= 2; ++i) {
+    int entry = *in++;
+    int pos = entry & 0x3F;
+    int value;
+    if (entry & 0x80) {
+      if (end - in < 2) return end;
+      value = (short)(in[0] | (in[1] << 8));
+      in += 2;
+    } else {
+      value = (signed char)*in++;
+    }
+    if (!(entry & 0x40)) value *= quant[pos];
+    D[(pos >> 3) * stride + (pos & 7)] = value;
+  }
+  return in;
+}
 
-void iDCT(short* data, int pixels_per_tile, int stride) {
-  for (int pos = 0; pos < pixels_per_tile; pos += 8) {
-    iDCT_row(&data[pos]);
+// The host packs a tile MCU by MCU and within one channel by channel. Each channel's MCU is block_rows
+// rows of stride / 8 blocks, and its 64 quantisers are at quant[channel * 64] //
+void expandCoefficients(const unsigned char* in, const unsigned char* end, const unsigned char* quant,
+                        short* const* channels, const int* strides, const int* block_rows, int num_channels, int MCUs) {
+  for (int MCU = 0; MCU < MCUs; ++MCU) {
+    for (int c = 0; c < num_channels; ++c) {
+      short* MCU_start = &channels[c][MCU * block_rows[c] * 8 * strides[c]];
+      for (int block_y = 0; block_y < block_rows[c]; ++block_y) {
+        for (int block_x = 0; block_x < strides[c]; block_x += 8) {
+          in = expandBlock(in, end, &quant[c * 64], &MCU_start[block_y * 8 * strides[c] + block_x], strides[c]);
+        }
+      }
+    }
   }
-  for (int pos = 0; pos < pixels_per_tile; pos += 8 * stride) {
-    for (int col = 0; col < stride; ++col) {
-      iDCT_col(&data[pos + col], stride);
+}
+
+// Downscaled images come with just the top left corner of each block's coefficients, the size of the
+// scaled block, and get a reduced iDCT of that size //
+void iDCT(short* data, int pixels_per_tile, int stride, int scale_shift) {
+  const int block_size = 8 >> scale_shift;
+  for (int pos = 0; pos < pixels_per_tile; pos += block_size * stride) {
+    for (int block_x = 0; block_x < stride; block_x += block_size) {
+      short* D = &data[pos + block_x];
+      if (scale_shift == 0) {
+        iDCT_block(D, stride);
+      } else if (scale_shift == 1) {
+        iDCT_scaled<4>(D, stride);
+      } else if (scale_shift == 2) {
+        iDCT_scaled<2>(D, stride);
+      } else {
+        iDCT_scaled<1>(D, stride);
+      }
     }
   }
 }
 
+// The host sends no sparsity information, so find the smallest top left square holding every nonzero
+// coefficient and run the kernel for it. Most blocks of a typical image have only a few low frequencies //
+void iDCT_block(short* D, int stride) {
+  int extent = 0;
+  for (int y = 0; y < 8; ++y) {
+    const short* row = &D[y * stride];
+    int row_extent = (row[4] | row[5] | row[6] | row[7]) ? 8 : (row[2] | row[3]) ? 4 : row[1] ? 2 : row[0] ? 1 : 0;
+    if (!row_extent) continue;
+    int y_extent = (y >= 4) ? 8 : (y >= 2) ? 4 : y + 1;
+    if (row_extent > extent) extent = row_extent;
+    if (y_extent > extent) extent = y_extent;
+  }
+
+  if (extent <= 1) {
+    // Only DC: the block is solid colour //
+    short dc = D[0] << 3;
+    short colour = clip(((dc + 32) >> 6) + 128);
+    for (int y = 0; y < 8; ++y) {
+      for (int x = 0; x < 8; ++x) D[y * stride + x] = colour;
+    }
+  } else if (extent == 2) {
+    for (int y = 0; y < 2; ++y) iDCT_row<2>(&D[y * stride]);
+    for (int x = 0; x < 8; ++x) iDCT_col<2>(&D[x], stride);
+  } else if (extent == 4) {
+    for (int y = 0; y < 4; ++y) iDCT_row<4>(&D[y * stride]);
+    for (int x = 0; x < 8; ++x) iDCT_col<4>(&D[x], stride);
+  } else {
+    for (int y = 0; y < 8; ++y) iDCT_row<8>(&D[y * stride]);
+    for (int x = 0; x < 8; ++x) iDCT_col<8>(&D[x], stride);
+  }
+}
+
 // Precomputed DCT constants //
 #define W1 2841
 #define W2 2676
@@ -105,12 +518,21 @@ void iDCT(short* data, int pixels_per_tile, int stride) {
 #define W6 1108
 #define W7 565
 
+// Only the first N coefficients (rows for the column pass) may be nonzero, so the terms of the rest
+// fold away at compile time without changing the result //
+template <int N>
 void iDCT_row(short* D) {
-  int x0, x1, x2, x3, x4, x5, x6, x7, x8;
+  int x0, x8;
+  int x1 = (N > 4) ? D[4] << 11 : 0;
+  int x2 = (N > 6) ? D[6] : 0;
+  int x3 = (N > 2) ? D[2] : 0;
+  int x4 = (N > 1) ? D[1] : 0;
+  int x5 = (N > 7) ? D[7] : 0;
+  int x6 = (N > 5) ? D[5] : 0;
+  int x7 = (N > 3) ? D[3] : 0;
 
   // Block is solid colour //
-  if (!((x1 = D[4] << 11) | (x2 = D[6]) | (x3 = D[2]) | (x4 = D[1]) | (x5 = D[7]) | (x6 = D[5]) |
-        (x7 = D[3]))) {
+  if (!(x1 | x2 | x3 | x4 | x5 | x6 | x7)) {
     D[0] = D[1] = D[2] = D[3] = D[4] = D[5] = D[6] = D[7] = D[0] << 3;
     return;
   }
@@ -147,14 +569,15 @@ void iDCT_row(short* D) {
   D[7] = (x7 - x1) >> 8;
 }
 
+template <int N>
 void iDCT_col(short* D, int stride) {
-  int x1 = ((int)D[stride * 4]) << 8;
-  int x2 = D[stride * 6];
-  int x3 = D[stride * 2];
-  int x4 = D[stride * 1];
-  int x5 = D[stride * 7];
-  int x6 = D[stride * 5];
-  int x7 = D[stride * 3];
+  int x1 = (N > 4) ? ((int)D[stride * 4]) << 8 : 0;
+  int x2 = (N > 6) ? D[stride * 6] : 0;
+  int x3 = (N > 2) ? D[stride * 2] : 0;
+  int x4 = (N > 1) ? D[stride * 1] : 0;
+  int x5 = (N > 7) ? D[stride * 7] : 0;
+  int x6 = (N > 5) ? D[stride * 5] : 0;
+  int x7 = (N > 3) ? D[stride * 3] : 0;
 
   // Block is solid colour //
   if (!(x1 | x2 | x3 | x4 | x5 | x6 | x7)) {
@@ -196,4 +619,67 @@ void iDCT_col(short* D, int stride) {
   D[stride * 5] = clip(((x0 - x4) >> 14) + 128);
   D[stride * 6] = clip(((x3 - x2) >> 14) + 128);
   D[stride * 7] = clip(((x7 - x1) >> 14) + 128);
-}
\ No newline at end of file
+}
+// Cosines of pi/8, pi/4 and 3pi/8 for the reduced iDCTs //
+#define C1 1892
+#define C2 1448
+#define C3 784
+
+// An N point iDCT of N values for N = 2 or 4, times 2^11 and without the 1/2 normalisation //
+template <int N>
+inline void iDCT_points(const int* in, int* out) {
+  if (N == 2) {
+    out[0] = C2 * (in[0] + in[1]);
+    out[1] = C2 * (in[0] - in[1]);
+    return;
+  }
+  int even0 = C2 * (in[0] + in[2]);
+  int even1 = C2 * (in[0] - in[2]);
+  int odd0 = C1 * in[1] + C3 * in[3];
+  int odd1 = C3 * in[1] - C1 * in[3];
+  out[0] = even0 + odd0;
+  out[1] = even1 + odd1;
+  out[2] = even1 - odd1;
+  out[3] = even0 - odd0;
+}
+
+// What the reduced kernels make of a block with only a DC coefficient //
+inline unsigned char iDCT_scaled_DC(int dc) { return clip(((C2 * ((C2 * dc + 128) >> 8) + 32768) >> 16) + 128); }
+
+// The NxN block of pixels from the N point iDCT of the top left NxN coefficients, in place. Matches
+// JPGReader::iDCT_scaled on the host //
+template <int N>
+void iDCT_scaled(short* D, int stride) {
+  int ac = 0;
+  for (int y = 0; y < N; ++y) {
+    for (int x = 0; x < N; ++x) ac |= (x | y) ? D[y * stride + x] : 0;
+  }
+
+  // Block is solid colour //
+  if (!ac) {
+    unsigned char colour = iDCT_scaled_DC(D[0]);
+    for (int y = 0; y < N; ++y) {
+      for (int x = 0; x < N; ++x) D[y * stride + x] = colour;
+    }
+    return;
+  }
+
+  int in[N], points[N], rows[N * N];
+  for (int y = 0; y < N; ++y) {
+    for (int x = 0; x < N; ++x) in[x] = D[y * stride + x];
+    iDCT_points<N>(in, points);
+    for (int x = 0; x < N; ++x) rows[y * N + x] = (points[x] + 128) >> 8;
+  }
+  for (int x = 0; x < N; ++x) {
+    for (int y = 0; y < N; ++y) in[y] = rows[y * N + x];
+    iDCT_points<N>(in, points);
+    for (int y = 0; y < N; ++y) D[y * stride + x] = clip(((points[y] + 32768) >> 16) + 128);
+  }
+}
+
+// At 1/8 size each block is a single pixel, the DC //
+template <>
+void iDCT_scaled<1>(short* D, int) {
+  short dc = D[0] << 3;
+  D[0] = clip(((dc + 32) >> 6) + 128);
+}
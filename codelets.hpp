@@ -10,6 +10,56 @@ enum param: int {
     param_CR_downshift_x,
     param_CR_downshift_y,
     param_num_channels,
+    param_scale_shift,
+    param_transfer_size,       // Which of the IPU's copies moves its data, 0 for none. Not read by the vertices
+    param_coefficient_format,  // What each tile's bytes hold, a coefficient_format
+    param_Y_tables,            // Huffman table ids of each channel, DC | AC << 2
+    param_CB_tables,
+    param_CR_tables,
+    param_raster_stride,       // Pixels per row of the raster output, 0 to leave it tile-major
+    param_first_pixel,         // Where the image starts in the device's pixels, the rest is relative to it
+    param_num_MCUs_x,
+    param_YCbCr_output,        // Leave the pixels as upsampled Y, Cb and Cr instead of converting to RGB
+    // The raster program gathers only the runs in the start of each IPU's slice that the largest of the
+    // IPUs' transfers moves. These are the same on every IPU, set by JPGReader::runProgram() //
+    param_raster_gather_size,  // 1 + that transfer size, 0 if no IPU transfers anything
+    param_raster_IPU_segments, // Runs of RASTER_SEGMENT_PIXELS it gathers from and to each IPU's slice
 
     PARAMS_SIZE  // enum measures its own size
-};
\ No newline at end of file
+};
+
+// Images of these modes at full scale get a postprocess vertex, and program, specialised for their MCU
+// layout. Everything else, downscaled images included, goes through the generic one //
+enum subsampling: int {
+    subsampling_generic,
+    subsampling_grey,
+    subsampling_444,
+    subsampling_422,
+    subsampling_420,
+
+    NUM_SUBSAMPLINGS
+};
+
+// How the coefficients come to the device when it does the iDCT. Dense ones are in the channel tensors,
+// the others in each tile's bytes: coefficients packed by JPGReader::packTile, or the restart intervals
+// covering the tile's MCUs, entropy coded, for the Huffman vertex to decode //
+enum coefficient_format: int {
+    coefficients_dense,
+    coefficients_compact,
+    coefficients_huffman
+};
+
+// Layout of one of the four Huffman tables the Huffman vertex decodes with, as ints //
+enum huffman_table: int {
+    huffman_lookup = 0,              // For each 8 bit prefix, length << 8 | symbol of its code, 0 if longer
+    huffman_maxcode = 256,           // The largest code of each length from 0 to 16, -1 if there are none
+    huffman_valoffset = 256 + 17,    // Added to a code of each length to give the index of its symbol
+    huffman_values = 256 + 17 + 17,  // The symbols in code order
+    HUFFMAN_TABLE_SIZE = 256 + 17 + 17 + 256
+};
+
+// The raster program reorders the device's pixels in runs of this many, so an image can be put in raster
+// order when its MCUs are a multiple of it wide. Rows are padded to a multiple of it too //
+enum raster: int {
+    RASTER_SEGMENT_PIXELS = 8
+};
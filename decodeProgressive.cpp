@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "JPGReader.hpp"
+
+// Progressive (SOF2) images arrive as a series of scans, each refining some band of coefficients for
+// one or more channels. Every scan adds its still-quantised coefficients into the channel frequency
+// buffers, and finishProgressive() dequantises them (and does the iDCT if the IPU won't) at EOI //
+void JPGReader::decodeScanProgressive() {
+  const unsigned char *pos = m_pos;
+  unsigned int header_len = read16(pos);
+  if (pos + header_len >= m_end) THROW(SYNTAX_ERROR);
+  pos += 2;
+
+  int num_scan_channels = *(pos++);
+  if (!num_scan_channels || num_scan_channels > m_num_channels) THROW(SYNTAX_ERROR);
+  if (header_len < (4u + 2u * num_scan_channels)) THROW(SYNTAX_ERROR);
+  ColourChannel *scan_channels[3];
+  for (int i = 0; i < num_scan_channels; ++i, pos += 2) {
+    ColourChannel *channel = m_channels;
+    while (channel < m_channels + m_num_channels && channel->id != pos[0]) ++channel;
+    if (channel == m_channels + m_num_channels) THROW(SYNTAX_ERROR);
+    if (pos[1] & 0xEE) THROW(SYNTAX_ERROR);
+    channel->dc_id = pos[1] >> 4;
+    channel->ac_id = (pos[1] & 1) | 2;
+    scan_channels[i] = channel;
+  }
+
+  ProgressiveScan scan;
+  scan.spectral_start = pos[0];
+  scan.spectral_end = pos[1];
+  scan.bit_high = pos[2] >> 4;
+  scan.bit_low = pos[2] & 0x0F;
+  if (scan.spectral_start == 0) {
+    if (scan.spectral_end != 0) THROW(SYNTAX_ERROR);
+  } else {
+    // AC bands only ever cover a single channel //
+    if (scan.spectral_end < scan.spectral_start || scan.spectral_end > 63) THROW(SYNTAX_ERROR);
+    if (num_scan_channels != 1) THROW(SYNTAX_ERROR);
+  }
+  if (scan.bit_low > 13 || (scan.bit_high && scan.bit_high != scan.bit_low + 1)) THROW(SYNTAX_ERROR);
+  m_pos += header_len;
+
+  // Unlike a baseline scan, this one is followed by more tables and scans rather than EOI. The index
+  // stops at the next marker, so Huffman lookahead at the end of the scan pads instead of failing //
+  callAndTime(&JPGReader::indexScan, stage_indexScan);
+  ScanState state;
+  startScanState(state, m_scan_index.data.data(), m_scan_index.data.data() + m_scan_index.size);
+  int restart_count = m_restart_interval;
+
+  if (num_scan_channels == 1) {
+    // Non-interleaved: blocks come in raster order over the channel, skipping MCU padding //
+    ColourChannel *channel = scan_channels[0];
+    int blocks_x = (channel->width + 7) / 8;
+    int blocks_y = (channel->height + 7) / 8;
+    for (int block_y = 0; block_y < blocks_y; ++block_y) {
+      for (int block_x = 0; block_x < blocks_x; ++block_x) {
+        int MCU_index = (block_y / channel->samples_y) * m_num_MCUs_x + (block_x / channel->samples_x);
+        short *freq_out = progressiveBlock(channel, MCU_index, block_x % channel->samples_x, block_y % channel->samples_y);
+        decodeBlockProgressive(state, channel, freq_out, scan);
+        if (state.error) THROW(state.error);
+
+        if (m_restart_interval && !(--restart_count)) {
+          readRestartMarker(state);
+          if (state.error) THROW(state.error);
+          restart_count = m_restart_interval;
+        }
+      }
+    }
+  } else {
+    // Interleaved: whole MCUs, like a baseline scan but with just the channels in this scan //
+    const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
+    for (int MCU_index = 0; MCU_index < total_MCUs; ++MCU_index) {
+      for (int i = 0; i < num_scan_channels; ++i) {
+        ColourChannel *channel = scan_channels[i];
+        for (int sample_y = 0; sample_y < channel->samples_y; ++sample_y) {
+          for (int sample_x = 0; sample_x < channel->samples_x; ++sample_x) {
+            decodeBlockProgressive(state, channel, progressiveBlock(channel, MCU_index, sample_x, sample_y), scan);
+            if (state.error) THROW(state.error);
+          }
+        }
+      }
+
+      if (m_restart_interval && !(--restart_count)) {
+        readRestartMarker(state);
+        if (state.error) THROW(state.error);
+        restart_count = m_restart_interval;
+      }
+    }
+  }
+  m_pos = m_buf + m_scan_index.end_offset;
+}
+
+void JPGReader::decodeBlockProgressive(ScanState &state, ColourChannel *channel, short *freq_out,
+                                       const ProgressiveScan &scan) {
+  const int stride = m_scale_shift ? 8 : channel->tile_stride;
+  const int high_bit = 1 << scan.bit_low;
+
+  // DC band: a predicted first approximation, then one extra bit per refinement scan //
+  if (scan.spectral_start == 0) {
+    if (scan.bit_high == 0) {
+      int &dc_cumulative_val = state.dc_cumulative_val[channel->channel_idx];
+      unsigned char num_value_bits = decodeRLEtuple(state, channel->dc_id) & 0x0F;
+      dc_cumulative_val += bitReaderGetValue(&state, num_value_bits);
+      freq_out[0] = dc_cumulative_val * high_bit;
+    } else if (bitReaderGet(&state, 1)) {
+      freq_out[0] |= high_bit;
+    }
+    return;
+  }
+
+  // AC first approximation: RLE tuples as in a baseline block, but EOB can cover a run of blocks //
+  int pos = scan.spectral_start;
+  if (scan.bit_high == 0) {
+    if (state.eob_run > 0) {
+      --state.eob_run;
+      return;
+    }
+    for (; pos <= scan.spectral_end; ++pos) {
+      unsigned char tuple = decodeRLEtuple(state, channel->ac_id);
+      unsigned char num_value_bits = tuple & 0x0F;
+      unsigned char num_zeros = tuple >> 4;
+      if (num_value_bits == 0) {
+        if (num_zeros < 15) {
+          state.eob_run = (1 << num_zeros) - 1 + bitReaderGet(&state, num_zeros);
+          break;
+        }
+        pos += 15;  // Run of 16 zeros
+        continue;
+      }
+      pos += num_zeros;
+      if (pos > scan.spectral_end) {
+        state.error = SYNTAX_ERROR;
+        return;
+      }
+      freq_out[deZigZagY[pos] * stride + deZigZagX[pos]] = bitReaderGetValue(&state, num_value_bits) * high_bit;
+    }
+    return;
+  }
+
+  // AC refinement: a correction bit for every coefficient that is already nonzero, interleaved with
+  // newly nonzero coefficients that are coded as runs of the zero coefficients they skip //
+  if (state.eob_run == 0) {
+    for (; pos <= scan.spectral_end; ++pos) {
+      unsigned char tuple = decodeRLEtuple(state, channel->ac_id);
+      int num_value_bits = tuple & 0x0F;
+      int num_zeros = tuple >> 4;
+      int new_value = 0;
+      if (num_value_bits) {
+        if (num_value_bits != 1) {
+          state.error = SYNTAX_ERROR;
+          return;
+        }
+        new_value = bitReaderGet(&state, 1) ? high_bit : -high_bit;
+      } else if (num_zeros != 15) {
+        state.eob_run = (1 << num_zeros) + bitReaderGet(&state, num_zeros);
+        break;
+      }
+
+      for (; pos <= scan.spectral_end; ++pos) {
+        short &coef = freq_out[deZigZagY[pos] * stride + deZigZagX[pos]];
+        if (coef != 0) {
+          if (bitReaderGet(&state, 1) && !(coef & high_bit)) coef += (coef >= 0) ? high_bit : -high_bit;
+        } else if (--num_zeros < 0) {
+          break;
+        }
+      }
+      if (new_value) {
+        if (pos > scan.spectral_end) {
+          state.error = SYNTAX_ERROR;
+          return;
+        }
+        freq_out[deZigZagY[pos] * stride + deZigZagX[pos]] = new_value;
+      }
+    }
+  }
+
+  // Inside an EOB run only the correction bits are left //
+  if (state.eob_run > 0) {
+    for (; pos <= scan.spectral_end; ++pos) {
+      short &coef = freq_out[deZigZagY[pos] * stride + deZigZagX[pos]];
+      if (coef != 0 && bitReaderGet(&state, 1) && !(coef & high_bit)) coef += (coef >= 0) ? high_bit : -high_bit;
+    }
+    --state.eob_run;
+  }
+}
+
+// Where a progressive scan accumulates a block's coefficients. At full size that's the block's place in
+// the channel buffers, otherwise whole blocks are kept aside until finishProgressive() //
+short *JPGReader::progressiveBlock(ColourChannel *channel, int MCU_index, int sample_x, int sample_y) {
+  if (!m_scale_shift) return &channel->frequencies[blockOffset(channel, MCU_index, sample_x, sample_y)];
+  int block = (MCU_index * channel->samples_y + sample_y) * channel->samples_x + sample_x;
+  return &channel->progressive_frequencies[block * 64];
+}
+
+// Dequantise the accumulated coefficients, and inverse the DCT here unless the IPU will //
+void JPGReader::finishProgressive() {
+  const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
+  const int block_size = 8 >> m_scale_shift;
+  int i;
+  ColourChannel *channel;
+  for (i = 0, channel = m_channels; i < m_num_channels; ++i, ++channel) {
+    const unsigned char *dq_table = m_dq_tables[channel->dq_id];
+    const int out_stride = channel->tile_stride;
+    const int stride = m_scale_shift ? 8 : out_stride;
+    for (int MCU_index = 0; MCU_index < total_MCUs; ++MCU_index) {
+      for (int sample_y = 0; sample_y < channel->samples_y; ++sample_y) {
+        for (int sample_x = 0; sample_x < channel->samples_x; ++sample_x) {
+          int out_pos = blockOffset(channel, MCU_index, sample_x, sample_y);
+          short *coeffs = progressiveBlock(channel, MCU_index, sample_x, sample_y);
+          int last_nonzero = 0;
+          for (int pos = 0; pos < 64; ++pos) {
+            short &coef = coeffs[deZigZagY[pos] * stride + deZigZagX[pos]];
+            coef *= dq_table[pos];
+            if (coef) last_nonzero = pos;
+          }
+
+          if (!m_do_iDCT_on_IPU) {
+            iDCTBlock(coeffs, stride, last_nonzero, &channel->pixels[out_pos], out_stride);
+          } else if (m_scale_shift) {
+            for (int y = 0; y < block_size; ++y) {
+              memcpy(&channel->frequencies[out_pos + y * out_stride], &coeffs[y * 8], block_size * sizeof(short));
+            }
+          }
+        }
+      }
+    }
+  }
+}
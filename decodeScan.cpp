@@ -1,12 +1,78 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
 #include <stdexcept>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "JPGReader.hpp"
 
+// Copy the entropy coded data at m_pos into m_scan_index with the byte stuffing removed, noting where
+// each RSTn marker is and which marker ends the scan. This is the only place the scan's bytes are
+// checked for 0xFF, so runs without one are copied a vector at a time //
+void JPGReader::indexScan() {
+  ScanIndex &index = m_scan_index;
+  size_t max_size = (m_end - m_pos) + SCAN_PADDING_BYTES;
+  if (index.data.size() < max_size) index.data.resize(max_size);
+  index.restart_offsets.clear();
+
+  const unsigned char *in = m_pos;
+  unsigned char *const out_start = index.data.data();
+  unsigned char *out = out_start;
+  while (in < m_end) {
+#ifdef __SSE2__
+    // The store may run past the 0xFF, into space that the output can't have reached yet //
+    const __m128i all_ones = _mm_set1_epi8(-1);
+    while (m_end - in >= 16) {
+      __m128i bytes = _mm_loadu_si128((const __m128i *)in);
+      _mm_storeu_si128((__m128i *)out, bytes);
+      int ff_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, all_ones));
+      if (ff_mask) {
+        int run = __builtin_ctz(ff_mask);
+        in += run;
+        out += run;
+        break;
+      }
+      in += 16;
+      out += 16;
+    }
+#else
+    const unsigned char *ff = (const unsigned char *)memchr(in, 0xFF, m_end - in);
+    size_t run = (ff ? ff : m_end) - in;
+    memcpy(out, in, run);
+    in += run;
+    out += run;
+#endif
+    if (in >= m_end) break;
+    if (in[0] != 0xFF) {
+      *out++ = *in++;  // The last few bytes, too short for a vector
+      continue;
+    }
+    if (in + 1 >= m_end) break;
+
+    if (in[1] == 0x00 || in[1] == 0xFF) {
+      *out++ = 0xFF;  // Stuffed byte, or a fill byte
+    } else if ((in[1] & 0xF8) == 0xD0) {
+      index.restart_offsets.push_back((out - out_start) * 8ull);
+      *out++ = 0xFF;
+      *out++ = 0xFF;
+    } else {
+      break;  // Any other marker ends the scan
+    }
+    in += 2;
+  }
+
+  index.size = out - out_start;
+  index.end_offset = in - m_buf;
+  memset(out, 0xFF, SCAN_PADDING_BYTES);
+}
+
 void JPGReader::decodeScanCPU() {
-  unsigned char *pos = m_pos;
+  const unsigned char *pos = m_pos;
   unsigned int header_len = read16(pos);
   if (pos + header_len >= m_end) THROW(SYNTAX_ERROR);
   pos += 2;
@@ -23,159 +89,537 @@ void JPGReader::decodeScanCPU() {
   }
   if (pos[0] || (pos[1] != 63) || pos[2]) THROW(UNSUPPORTED_ERROR);
   m_pos += header_len;
+  callAndTime(&JPGReader::indexScan, stage_indexScan);
+
+  const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
+
+  if (m_streamed) {
+    decodeScanStreamed();
+    return;
+  }
+
+  // With restart markers the device can do the entropy decoding itself, the host just handing each tile
+  // its intervals' bytes //
+  if (m_do_decompress_on_IPU && m_restart_interval && !m_scale_shift && packScanSegments()) {
+    m_pos = m_buf + m_scan_index.end_offset;
+    return;
+  }
+
+  // Restart intervals are independent, so with enough of them they can be decoded concurrently //
+  if (m_restart_interval && m_thread_pool->size() > 1 && total_MCUs > m_restart_interval) {
+    if (decodeScanParallel()) return;
+  }
+  // Without them, the scan is cut into byte ranges that are decoded speculatively and stitched //
+  if (!m_restart_interval && m_thread_pool->size() > 1) {
+    if (decodeScanSpeculative()) return;
+  }
 
   // Iterate over blocks and decode them! //
+  ScanState state;
+  startScanState(state, m_scan_index.data.data(), m_scan_index.data.data() + m_scan_index.size);
   int restart_count = m_restart_interval;
-  const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
   int completed_MCUs = 0;
 
   for (int tile = 0; tile < m_num_active_tiles; ++tile) {
     for (int MCU = 0; MCU < m_MCUs_per_tile && completed_MCUs < total_MCUs; ++MCU, ++completed_MCUs) {
-      for (i = 0, channel = m_channels; i < m_num_channels; ++i, ++channel) {
-        int MCU_start = (tile * MAX_PIXELS_PER_TILE) + (MCU * channel->pixels_per_MCU);
-
-        for (int sample_y = 0; sample_y < channel->samples_y; ++sample_y) {
-          for (int sample_x = 0; sample_x < channel->samples_x; ++sample_x) {
-            int out_pos = MCU_start + (sample_y * channel->tile_stride * 8) + (sample_x * 8);
-            decodeBlock(channel, &channel->frequencies[out_pos], &channel->pixels[out_pos]);
-            if (m_error) return;
-          }
-        }
-      }
+      decodeMCU(state, tile, MCU);
+      if (state.error) THROW(state.error);
 
       if (m_restart_interval && !(--restart_count)) {
-        // Byte align the read head //
-        m_num_bufbits &= 0xF8;
-        int marker_bits = getBits(16);
-        if ((marker_bits & 0xFF00) != 0xFF00) {
-          THROW(SYNTAX_ERROR);
-        }
+        readRestartMarker(state);
+        if (state.error) THROW(state.error);
         restart_count = m_restart_interval;
-        for (ColourChannel &channel : m_channels) {
-          channel.dc_cumulative_val = 0;
+      }
+    }
+  }
+  m_pos = m_buf + m_scan_index.end_offset;
+}
+
+// Decode an image too big for the device a strip of MCU rows at a time, each laid out over the tiles as
+// a whole image would be. Each strip goes to the device as soon as it is decoded, and the host decodes
+// the next into the other set of buffers meanwhile. Finished strips are copied out in raster order, so
+// the device and the channel buffers only ever hold two strips //
+void JPGReader::decodeScanStreamed() {
+  const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
+  const int strip_MCUs = m_num_MCUs_x * m_strip_MCU_rows;
+  ScanState state;
+  startScanState(state, m_scan_index.data.data(), m_scan_index.data.data() + m_scan_index.size);
+  int restart_count = m_restart_interval;
+
+  TileLayout strip_layout = currentLayout();
+  int strip_first_row = 0;
+  auto collect_strip = [&]() {
+    m_strip_run.wait();
+    linearisePixels(strip_layout, &m_raster_pixels[(size_t)strip_first_row * m_width * 3], m_width * 3,
+                    PixelFormat::RGB24);
+  };
+
+  for (int first_MCU = 0; first_MCU < total_MCUs; first_MCU += strip_MCUs) {
+    int end_MCU = std::min(total_MCUs, first_MCU + strip_MCUs);
+    for (int MCU = first_MCU; MCU < end_MCU; ++MCU) {
+      decodeMCU(state, (MCU - first_MCU) / m_MCUs_per_tile, (MCU - first_MCU) % m_MCUs_per_tile);
+      if (!state.error && m_restart_interval && !(--restart_count)) {
+        readRestartMarker(state);
+        restart_count = m_restart_interval;
+      }
+      if (state.error) break;
+    }
+
+    // The device, and the previous batch image or strip on it, has to be finished before it takes this one //
+    collectBatchRun();
+    if (m_strip_run.pending()) collect_strip();
+    if (state.error) THROW(state.error);
+
+    packCoefficients(end_MCU - first_MCU);
+    stageIPUInputs();
+    int first_MCU_row = first_MCU / m_num_MCUs_x;
+    strip_layout.num_MCUs_y = (end_MCU - first_MCU) / m_num_MCUs_x;
+    strip_first_row = first_MCU_row * m_MCU_size_y;
+    strip_layout.height = std::min<int>(strip_layout.num_MCUs_y * m_MCU_size_y, m_height - strip_first_row);
+    int program = postprocessProgram(subsamplingMode());
+    m_strip_run.launch(&JPGReader::runProgram, this, program);
+  }
+  if (m_strip_run.pending()) collect_strip();
+  m_pos = m_buf + m_scan_index.end_offset;
+}
+
+// Decode each restart interval on the thread pool straight into its slice of the tile-major channel
+// buffers, starting from the RSTn markers indexScan() found. Returns false if the markers don't match
+// the expected interval count, in which case the caller falls back to the serial decoder //
+bool JPGReader::decodeScanParallel() {
+  const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
+  const int num_segments = (total_MCUs + m_restart_interval - 1) / m_restart_interval;
+  const ScanIndex &index = m_scan_index;
+  if ((int)index.restart_offsets.size() < num_segments - 1) return false;
+
+  std::atomic<int> error(NO_ERROR);
+  m_thread_pool->parallelFor(num_segments, [&](int segment) {
+    // Each interval runs from just after one marker up to the next //
+    const unsigned char *start = index.data.data(), *end = start + index.size;
+    if (segment) start += index.restart_offsets[segment - 1] / 8 + 2;
+    if (segment < num_segments - 1) end = index.data.data() + index.restart_offsets[segment] / 8;
+    ScanState state;
+    startScanState(state, start, end);
+    int first_MCU = segment * m_restart_interval;
+    int end_MCU = std::min(total_MCUs, first_MCU + m_restart_interval);
+    for (int MCU = first_MCU; MCU < end_MCU && !state.error; ++MCU) {
+      decodeMCU(state, MCU / m_MCUs_per_tile, MCU % m_MCUs_per_tile);
+    }
+    if (state.error) error.store(state.error);
+  });
+
+  m_error = error.load();
+  m_pos = m_buf + index.end_offset;
+  return true;
+}
+
+// Lay the scan's restart intervals out in the tiles' packed bytes for the Huffman vertex to decode. The
+// host can't tell where in an interval an MCU starts without decoding it, so each tile gets the whole of
+// every interval its MCUs are in: a byte counting them, then for each the number of its MCUs to skip and
+// to decode, its length in bytes and the bytes. Returns false, leaving the scan to the host, if the
+// markers don't split the scan as the interval says, or a table or some tile's intervals don't fit //
+bool JPGReader::packScanSegments() {
+  const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
+  const int num_segments = (total_MCUs + m_restart_interval - 1) / m_restart_interval;
+  const ScanIndex &index = m_scan_index;
+  if ((int)index.restart_offsets.size() < num_segments - 1 || !fillHuffmanTables()) return false;
+  uint64_t start_time = TimingStats::now();
+
+  const int tiles_per_task = 64;
+  std::atomic<bool> fits(true);
+  m_thread_pool->parallelFor((m_num_active_tiles + tiles_per_task - 1) / tiles_per_task, [&](int task) {
+    int end_tile = std::min(m_num_active_tiles, (task + 1) * tiles_per_task);
+    for (int tile = task * tiles_per_task; tile < end_tile && fits; ++tile) {
+      unsigned char *out = &m_packed_bytes[(size_t)(m_first_tile + tile) * PACKED_BYTES_PER_TILE];
+      unsigned char *out_end = out + PACKED_BYTES_PER_TILE;
+      unsigned char *num_runs = out++;
+      *num_runs = 0;
+      int end_MCU = std::min(total_MCUs, (tile + 1) * m_MCUs_per_tile);
+      for (int MCU = tile * m_MCUs_per_tile; MCU < end_MCU;) {
+        int segment = MCU / m_restart_interval;
+        int segment_MCU = segment * m_restart_interval;
+        int run_end = std::min(end_MCU, segment_MCU + m_restart_interval);
+        const unsigned char *start = index.data.data(), *end = start + index.size;
+        if (segment) start += index.restart_offsets[segment - 1] / 8 + 2;
+        if (segment < num_segments - 1) end = index.data.data() + index.restart_offsets[segment] / 8;
+        if (out_end - out < 5 + (end - start)) {
+          fits = false;
+          break;
         }
+        int skip = MCU - segment_MCU;
+        out[0] = skip & 0xFF;
+        out[1] = skip >> 8;
+        out[2] = run_end - MCU;
+        out[3] = (end - start) & 0xFF;
+        out[4] = (end - start) >> 8;
+        memcpy(out + 5, start, end - start);
+        out += 5 + (end - start);
+        ++*num_runs;
+        MCU = run_end;
+      }
+    }
+  });
+  if (fits) m_coefficient_format = coefficients_huffman;
+
+  timings.record(stage_packScanSegments, start_time, index.size, total_MCUs);
+  return fits;
+}
+
+// Build the four Huffman tables in the layout the Huffman vertex reads: a lookup of the codes of up to 8
+// bits, and for longer ones, canonical decoding by the largest code of each length. Returns false if a
+// table has more symbols than there are, or more codes of some length than fit //
+bool JPGReader::fillHuffmanTables() {
+  std::fill(m_huffman_tables.begin(), m_huffman_tables.end(), 0);
+  for (int table_id = 0; table_id < 4; ++table_id) {
+    int *table = &m_huffman_tables[table_id * HUFFMAN_TABLE_SIZE];
+    table[huffman_maxcode] = -1;
+    int code = 0, symbol = 0;
+    for (int code_len = 1; code_len <= 16; ++code_len, code <<= 1) {
+      int count = m_dht_code_counts[table_id][code_len - 1];
+      if (symbol + count > 256 || code + count > (1 << code_len)) return false;
+      table[huffman_maxcode + code_len] = count ? code + count - 1 : -1;
+      table[huffman_valoffset + code_len] = symbol - code;
+      for (int i = 0; i < count; ++i, ++code, ++symbol) {
+        unsigned char tuple = m_dht_symbols[table_id][symbol];
+        table[huffman_values + symbol] = tuple;
+        if (code_len > 8) continue;
+        int *item = &table[huffman_lookup + (code << (8 - code_len))];
+        for (int j = 1 << (8 - code_len); j; j--, ++item) *item = (code_len << 8) | tuple;
       }
     }
   }
+  return true;
 }
 
-int JPGReader::getBitsAsValue(int num_bits) {
-  if (num_bits == 0) return 0;
-  int value = getBits(num_bits);
-  if (value < (1 << (num_bits - 1))) value += ((0xffffffff) << num_bits) + 1;
-  return value;
+// JPEG Huffman codes self-synchronise: a decoder started at an arbitrary bit soon lands on the same
+// MCU boundaries as one that started at the beginning. Each thread first traces its own byte range
+// without writing anything, recording the bit offset and DC predictors at every MCU boundary. It then
+// traces on past the end of its range until it meets a boundary recorded by a later chunk. Walking
+// these meeting points from the start of the scan pins down the true MCU index and DC predictors at
+// the start of each chunk, and the chunks are then decoded for real from those states. A chunk that
+// never synchronises is simply absorbed into the serial run of the chunk before it. Returns false if
+// the scan is too short to be worth splitting or has stray RSTn markers, which the tracer can't count //
+bool JPGReader::decodeScanSpeculative() {
+  const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
+  if (!m_scan_index.restart_offsets.empty()) return false;
+  const unsigned char *scan_start = m_scan_index.data.data();
+  const unsigned char *scan_end = scan_start + m_scan_index.size;
+
+  const int num_chunks = std::min<long>(m_thread_pool->size(), (scan_end - scan_start) / MIN_SPECULATIVE_CHUNK_BYTES);
+  if (num_chunks < 2) return false;
+
+  m_speculative_chunks.resize(num_chunks);
+  m_segment_starts.clear();
+  for (int chunk = 0; chunk < num_chunks; ++chunk) {
+    m_segment_starts.push_back(scan_start + (scan_end - scan_start) * chunk / num_chunks);
+  }
+  m_segment_starts.push_back(scan_end);
+
+  m_thread_pool->parallelFor(num_chunks, [&](int chunk) { traceChunk(chunk, scan_start, scan_end); });
+  m_thread_pool->parallelFor(num_chunks - 1, [&](int chunk) { syncChunk(chunk, scan_start, scan_end); });
+
+  // Follow the meeting points from the start of the scan, where the state is known to be correct //
+  m_scan_segments.clear();
+  int chunk = 0, point = 0;
+  ScanSegment segment = {m_speculative_chunks[0].sync_points[0], 0, 0};
+  while (true) {
+    const SpeculativeChunk &current = m_speculative_chunks[chunk];
+    const SyncPoint &anchor = current.sync_points[point];
+    if (current.next_chunk == num_chunks) break;
+
+    int next_MCU = segment.first_MCU + current.MCUs_to_next - point;
+    if (next_MCU >= total_MCUs) break;
+    segment.end_MCU = next_MCU;
+    m_scan_segments.push_back(segment);
+
+    segment.start = m_speculative_chunks[current.next_chunk].sync_points[current.next_point];
+    segment.first_MCU = next_MCU;
+    for (int c = 0; c < 3; ++c) {
+      segment.start.dc_cumulative_val[c] =
+          m_scan_segments.back().start.dc_cumulative_val[c] + current.dc_at_next[c] - anchor.dc_cumulative_val[c];
+    }
+    chunk = current.next_chunk;
+    point = current.next_point;
+  }
+  segment.end_MCU = total_MCUs;
+  m_scan_segments.push_back(segment);
+
+  std::atomic<int> error(NO_ERROR);
+  m_thread_pool->parallelFor(m_scan_segments.size(), [&](int i) {
+    const ScanSegment &segment = m_scan_segments[i];
+    ScanState state;
+    startScanState(state, scan_start + segment.start.bit_offset / 8, scan_end);
+    bitReaderGet(&state, segment.start.bit_offset % 8);
+    std::copy_n(segment.start.dc_cumulative_val, 3, state.dc_cumulative_val);
+    for (int MCU = segment.first_MCU; MCU < segment.end_MCU && !state.error; ++MCU) {
+      decodeMCU(state, MCU / m_MCUs_per_tile, MCU % m_MCUs_per_tile);
+    }
+    if (state.error) error.store(state.error);
+  });
+
+  m_error = error.load();
+  m_pos = m_buf + m_scan_index.end_offset;
+  return true;
 }
 
-void JPGReader::decodeBlock(ColourChannel *channel, short *freq_out, unsigned char *pixel_out) {
+// Trace a chunk from its first byte, assuming that byte starts an MCU, up to the end of the chunk //
+void JPGReader::traceChunk(int chunk, const unsigned char *scan_start, const unsigned char *scan_end) {
+  const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
+  const uint64_t chunk_end = (m_segment_starts[chunk + 1] - scan_start) * 8ull;
+  SpeculativeChunk &spec = m_speculative_chunks[chunk];
+  spec.sync_points.clear();
+  spec.next_chunk = m_speculative_chunks.size();
+
+  ScanState &state = spec.end_state;
+  startScanState(state, m_segment_starts[chunk], scan_end);
+  while (!state.error && state.pos < scan_end && (int)spec.sync_points.size() < total_MCUs) {
+    SyncPoint point = {bitOffset(state, scan_start), {0, 0, 0}};
+    if (point.bit_offset >= chunk_end) break;
+    std::copy_n(state.dc_cumulative_val, 3, point.dc_cumulative_val);
+    spec.sync_points.push_back(point);
+    traceMCU(state);
+  }
+}
+
+// Carry on tracing past the end of a chunk until an MCU boundary lines up with a later chunk's //
+void JPGReader::syncChunk(int chunk, const unsigned char *scan_start, const unsigned char *scan_end) {
+  const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
+  const int num_chunks = m_speculative_chunks.size();
+  SpeculativeChunk &spec = m_speculative_chunks[chunk];
+
+  ScanState state = spec.end_state;
+  int next_chunk = chunk + 1;
+  size_t next_point = 0;
+  for (int MCUs = spec.sync_points.size(); MCUs <= total_MCUs; ++MCUs) {
+    if (state.error || state.pos >= scan_end) return;
+    uint64_t bit_offset = bitOffset(state, scan_start);
+
+    while (next_chunk < num_chunks) {
+      const std::vector<SyncPoint> &points = m_speculative_chunks[next_chunk].sync_points;
+      while (next_point < points.size() && points[next_point].bit_offset < bit_offset) ++next_point;
+      if (next_point < points.size()) break;
+      ++next_chunk;
+      next_point = 0;
+    }
+    if (next_chunk == num_chunks) return;
+
+    if (m_speculative_chunks[next_chunk].sync_points[next_point].bit_offset == bit_offset) {
+      spec.next_chunk = next_chunk;
+      spec.next_point = next_point;
+      spec.MCUs_to_next = MCUs;
+      std::copy_n(state.dc_cumulative_val, 3, spec.dc_at_next);
+      return;
+    }
+    traceMCU(state);
+  }
+}
+
+// Offset of the next unread bit from the start of the (unstuffed) scan //
+uint64_t JPGReader::bitOffset(const ScanState &state, const unsigned char *scan_start) {
+  return (state.pos - scan_start) * 8ull - state.num_bufbits;
+}
+
+// Step over one MCU, tracking the DC predictors but not dequantising or storing anything. A trace that
+// hasn't synchronised yet reads garbage, so malformed blocks are cut short rather than treated as errors.
+// Real errors still surface when the chunk is decoded properly //
+void JPGReader::traceMCU(ScanState &state) {
+  int i;
+  ColourChannel *channel;
+  for (i = 0, channel = m_channels; i < m_num_channels; ++i, ++channel) {
+    for (int block = 0; block < channel->samples_x * channel->samples_y; ++block) {
+      const DhtFusedItem &dc_item = m_dht_fused_tables[channel->dc_id][bitReaderShow(&state, DHT_TABLE_BITS)];
+      if (dc_item.num_bits[0]) {
+        state.num_bufbits -= dc_item.num_bits[0];
+        state.dc_cumulative_val[i] += dc_item.value[0];
+      } else {
+        unsigned char num_value_bits = decodeRLEtuple(state, channel->dc_id) & 0x0F;
+        state.dc_cumulative_val[i] += bitReaderGetValue(&state, num_value_bits);
+      }
+
+      const DhtFusedItem *ac_table = m_dht_fused_tables[channel->ac_id];
+      int pos = 0;
+      do {
+        const DhtFusedItem &item = ac_table[bitReaderShow(&state, DHT_TABLE_BITS)];
+        if (item.num_bits[0]) {
+          state.num_bufbits -= item.num_bits[0];
+          if (!item.tuple[0]) break;
+          pos += (item.tuple[0] >> 4) + 1;
+          if (pos >= 64 || !item.num_bits[1] || pos == 63) continue;
+          state.num_bufbits -= item.num_bits[1];
+          if (!item.tuple[1]) break;
+          pos += (item.tuple[1] >> 4) + 1;
+          continue;
+        }
+        unsigned char tuple = decodeRLEtuple(state, channel->ac_id);
+        if (!tuple) break;
+        unsigned char num_value_bits = tuple & 0x0F;
+        unsigned char num_zeros = tuple >> 4;
+        pos += num_zeros + 1;
+        if ((num_value_bits == 0 && (num_zeros != 15)) || pos >= 64) break;
+        bitReaderGet(&state, num_value_bits);
+      } while (pos < 63);
+      if (state.error) return;
+    }
+  }
+}
+
+// Step over the RSTn marker that ends a restart interval, and reset the predictors //
+void JPGReader::readRestartMarker(ScanState &state) {
+  // Byte align the read head //
+  bitReaderAlign(&state);
+  int marker_bits = bitReaderGet(&state, 16);
+  if ((marker_bits & 0xFF00) != 0xFF00) state.error = SYNTAX_ERROR;
+  for (int &dc : state.dc_cumulative_val) dc = 0;
+  state.eob_run = 0;
+  memset(state.block, 0, sizeof(state.block));
+}
+
+void JPGReader::startScanState(ScanState &state, const unsigned char *pos, const unsigned char *end) {
+  bitReaderStartUnstuffed(&state, pos, end);
+  for (int &dc : state.dc_cumulative_val) dc = 0;
+  state.eob_run = 0;
+  memset(state.block, 0, sizeof(state.block));
+}
+
+void JPGReader::decodeMCU(ScanState &state, int tile, int MCU) {
+  const int block_size = 8 >> m_scale_shift;
+  int i;
+  ColourChannel *channel;
+  for (i = 0, channel = m_channels; i < m_num_channels; ++i, ++channel) {
+    int MCU_start = ((m_first_tile + tile) * MAX_PIXELS_PER_TILE) + (MCU * channel->pixels_per_MCU);
+
+    for (int sample_y = 0; sample_y < channel->samples_y; ++sample_y) {
+      for (int sample_x = 0; sample_x < channel->samples_x; ++sample_x) {
+        int out_pos = MCU_start + (sample_y * channel->tile_stride * block_size) + (sample_x * block_size);
+        decodeBlock(state, channel, &channel->frequencies[out_pos], &channel->pixels[out_pos]);
+        if (state.error) return;
+      }
+    }
+  }
+}
+
+// Position of one of a channel's blocks in the tile-major channel buffers //
+int JPGReader::blockOffset(const ColourChannel *channel, int MCU_index, int sample_x, int sample_y) {
+  const int block_size = 8 >> m_scale_shift;
+  int tile = MCU_index / m_MCUs_per_tile;
+  int MCU = MCU_index % m_MCUs_per_tile;
+  return ((m_first_tile + tile) * MAX_PIXELS_PER_TILE) + (MCU * channel->pixels_per_MCU) +
+         (sample_y * channel->tile_stride * block_size) + (sample_x * block_size);
+}
+
+void JPGReader::decodeBlock(ScanState &state, ColourChannel *channel, short *freq_out, unsigned char *pixel_out) {
   int MCU_stride = channel->tile_stride;
-  for (int i = 0; i < 8; ++i) {
-    memset(&freq_out[i * MCU_stride], 0, 8 * sizeof(short));
+  // Coefficients left for the IPU at full size are the output, so the whole block is cleared. Otherwise
+  // they go to the state's scratch block, and only the part the iDCT used is cleared again afterwards //
+  short *coeffs = state.block;
+  int coeff_stride = 8;
+  if (m_do_iDCT_on_IPU && !m_scale_shift) {
+    coeffs = freq_out;
+    coeff_stride = MCU_stride;
+    for (int i = 0; i < 8; ++i) {
+      memset(&freq_out[i * MCU_stride], 0, 8 * sizeof(short));
+    }
   }
+  const unsigned char *dq_table = m_dq_tables[channel->dq_id];
 
   // Read DC value //
-  unsigned char num_value_bits = decodeRLEtuple(channel->dc_id) & 0x0F;
-  channel->dc_cumulative_val += getBitsAsValue(num_value_bits);
-  freq_out[0] = (channel->dc_cumulative_val) * m_dq_tables[channel->dq_id][0];
+  int &dc_cumulative_val = state.dc_cumulative_val[channel->channel_idx];
+  const DhtFusedItem &dc_item = m_dht_fused_tables[channel->dc_id][bitReaderShow(&state, DHT_TABLE_BITS)];
+  if (dc_item.num_bits[0]) {
+    state.num_bufbits -= dc_item.num_bits[0];
+    dc_cumulative_val += dc_item.value[0];
+  } else {
+    unsigned char num_value_bits = decodeRLEtuple(state, channel->dc_id) & 0x0F;
+    dc_cumulative_val += bitReaderGetValue(&state, num_value_bits);
+  }
+  coeffs[0] = dc_cumulative_val * dq_table[0];
 
   // Read AC values //
+  const DhtFusedItem *ac_table = m_dht_fused_tables[channel->ac_id];
   int pos = 0;
   do {
-    // First: read a Huffman encoded RLE tuple //
-    unsigned char tuple = decodeRLEtuple(channel->ac_id);
+    // Common case: one lookup yields the run, size and value of one or two coefficients //
+    const DhtFusedItem &item = ac_table[bitReaderShow(&state, DHT_TABLE_BITS)];
+    if (item.num_bits[0]) {
+      state.num_bufbits -= item.num_bits[0];
+      if (!item.tuple[0]) break;  // EOB marker
+      pos += (item.tuple[0] >> 4) + 1;
+      if (pos >= 64) {
+        state.error = SYNTAX_ERROR;
+        return;
+      }
+      coeffs[deZigZagY[pos] * coeff_stride + deZigZagX[pos]] = item.value[0] * dq_table[pos];
+
+      // The second symbol only belongs to this block if the block isn't already full //
+      if (!item.num_bits[1] || pos == 63) continue;
+      state.num_bufbits -= item.num_bits[1];
+      if (!item.tuple[1]) break;
+      pos += (item.tuple[1] >> 4) + 1;
+      if (pos >= 64) {
+        state.error = SYNTAX_ERROR;
+        return;
+      }
+      coeffs[deZigZagY[pos] * coeff_stride + deZigZagX[pos]] = item.value[1] * dq_table[pos];
+      continue;
+    }
+
+    // Otherwise: read a Huffman encoded RLE tuple //
+    unsigned char tuple = decodeRLEtuple(state, channel->ac_id);
     if (!tuple) break;  // EOB marker
     unsigned char num_value_bits = tuple & 0x0F;
     unsigned char num_zeros = tuple >> 4;
     // If there are no value bits, this must be a run of 16 (i.e. 15+1) zeros
-    if (num_value_bits == 0 && (num_zeros != 15)) THROW(SYNTAX_ERROR);
+    if (num_value_bits == 0 && (num_zeros != 15)) {
+      state.error = SYNTAX_ERROR;
+      return;
+    }
     pos += num_zeros + 1;
-    if (pos >= 64) THROW(SYNTAX_ERROR);
+    if (pos >= 64) {
+      state.error = SYNTAX_ERROR;
+      return;
+    }
 
-    // Second: consume as many bits as specified by the tuple to recover the DCT coefficient value //
-    int value = getBitsAsValue(num_value_bits);
+    // Then consume as many bits as specified by the tuple to recover the DCT coefficient value //
+    int value = bitReaderGetValue(&state, num_value_bits);
 
-    // Third: de-quantise and de-zigzag, placing value in output block //
-    freq_out[deZigZagY[pos] * MCU_stride + deZigZagX[pos]] = value * m_dq_tables[channel->dq_id][pos];
+    // Finally de-quantise and de-zigzag, placing value in output block //
+    coeffs[deZigZagY[pos] * coeff_stride + deZigZagX[pos]] = value * dq_table[pos];
   } while (pos < 63);
 
   // Once the block of coefficients is recovered we can inverse the DCT (or leave it to later) //
+  // pos is now at the last coefficient written, which bounds the nonzero ones //
   if (!m_do_iDCT_on_IPU) {
-    for (int i = 0; i < 8; ++i) iDCT_row(&freq_out[i * MCU_stride]);
-    for (int i = 0; i < 8; ++i) iDCT_col(&freq_out[i], &pixel_out[i], MCU_stride);
+    int used_rows = iDCTBlock(coeffs, coeff_stride, pos, pixel_out, MCU_stride);
+    memset(coeffs, 0, used_rows * 8 * sizeof(short));
+  } else if (m_scale_shift) {
+    // The IPU's reduced iDCT only reads the low frequency corner the size of the scaled block //
+    const int block_size = 8 >> m_scale_shift;
+    for (int i = 0; i < block_size; ++i) memcpy(&freq_out[i * MCU_stride], &coeffs[i * 8], block_size * sizeof(short));
+    memset(coeffs, 0, sizeof(state.block));
   }
 }
 
-unsigned char JPGReader::decodeRLEtuple(int dht_id) {
+unsigned char JPGReader::decodeRLEtuple(ScanState &state, int dht_id) {
   // See if the symbol is short enough to be in the table of precomputed values //
-  if (DHT_TABLE_BITS > 0) {
-    int symbol = showBits(DHT_TABLE_BITS);
-    DhtTableItem vlc = m_dht_tables[dht_id][symbol];
-    if (vlc.num_bits > 0) {
-      m_num_bufbits -= vlc.num_bits;
-      return vlc.tuple;
-    }
+  const DhtTableItem &vlc = m_dht_tables[dht_id][bitReaderShow(&state, DHT_TABLE_BITS)];
+  if (vlc.num_bits > 0) {
+    state.num_bufbits -= vlc.num_bits;
+    return vlc.tuple;
   }
-
-  // Otherwise do a proper huffman tree lookup //
-  int bits = showBits(16);
-  DhtNode *tree = &m_dht_trees[dht_id][0];
-  unsigned current_node = 0;
-  int bits_used = 0;
-  while (bits_used < 16) {
-    int bit = (bits >> (15 - bits_used)) & 1u;
-    current_node = tree[current_node].children[bit];
-    bits_used += 1;
-
-    if (tree[current_node].children[0] == 0) break;
-  }
-  m_num_bufbits -= bits_used;
-  return tree[current_node].tuple;
+  return decodeLongRLEtuple(state, dht_id, vlc);
 }
 
-
-// This only shows the bits, but doesn't move past them //
-int JPGReader::showBits(int num_bits) {
-  unsigned char newbyte;
-  if (!num_bits) return 0;
-
-  while (m_num_bufbits < num_bits) {
-    if (m_pos >= m_end) {
-      m_bufbits = (m_bufbits << 8) | 0xFF;
-      m_num_bufbits += 8;
-      continue;
-    }
-    newbyte = *m_pos++;
-    m_bufbits = (m_bufbits << 8) | newbyte;
-    m_num_bufbits += 8;
-    if (newbyte != 0xFF) continue;
-
-    if (m_pos >= m_end) goto FAILURE;
-
-    // Handle byte stuffing //
-    unsigned char follow_byte = *m_pos++;
-    switch (follow_byte) {
-      case 0x00:
-      case 0xFF:
-      case 0xD9:
-        break;
-      default:
-        if ((follow_byte & 0xF8) != 0xD0) {
-          goto FAILURE;
-        } else {
-          m_bufbits = (m_bufbits << 8) | newbyte;
-          m_num_bufbits += 8;
-        }
+// Codes longer than DHT_TABLE_BITS. Bits that aren't a code at all are skipped and read as EOB //
+unsigned char JPGReader::decodeLongRLEtuple(ScanState &state, int dht_id, const DhtTableItem &prefix) {
+  int bits = bitReaderShow(&state, 16);
+  if (prefix.tuple) {
+    const DhtTableItem &vlc =
+        m_dht_long_tables[dht_id][(prefix.tuple - 1) * DHT_LONG_TABLE_SIZE + (bits & (DHT_LONG_TABLE_SIZE - 1))];
+    if (vlc.num_bits > 0) {
+      state.num_bufbits -= vlc.num_bits;
+      return vlc.tuple;
     }
   }
-  return (m_bufbits >> (m_num_bufbits - num_bits)) & ((1 << num_bits) - 1);
-
-FAILURE:
-  m_error = SYNTAX_ERROR;
+  state.num_bufbits -= 16;
   return 0;
 }
-
-// Show the bits AND move past them //
-int JPGReader::getBits(int num_bits) {
-  int res = showBits(num_bits);
-  m_num_bufbits -= num_bits;
-  return res;
-}
@@ -0,0 +1,222 @@
+#ifndef IDCT_H
+#define IDCT_H
+
+#include <string.h>
+
+// Whole-block inverse DCTs on the host's vector units, for JPGReader, CPUReader and the IPresentU CPU
+// build. They are bit-exact with each reader's scalar iDCT_row/iDCT_col, which stay the reference and
+// the fallback: the same integer butterflies run on four or eight rows (then columns) side by side,
+// with the block transposed in between. iDCTSelectKernel() picks the widest one from CPUID //
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && !defined(__POPC__) && !defined(__IPU__) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 12))
+#define IDCT_SIMD 1
+#include <immintrin.h>
+#else
+#define IDCT_SIMD 0
+#endif
+
+// Short coefficients (JPGReader) are at any stride, and the row pass results are truncated to 16 bits
+// the way its in-place scalar passes store them. Int coefficients (CPUReader, IPresentU) are 8 wide //
+typedef void (*IDCTBlockShortFn)(const short *D, int D_stride, unsigned char *out, int stride);
+typedef void (*IDCTBlockIntFn)(const int *D, unsigned char *out, int stride);
+
+typedef struct _IDCTKernel {
+  const char *name;
+  IDCTBlockShortFn block_short;  // Null for the scalar reference
+  IDCTBlockIntFn block_int;
+} IDCTKernel;
+
+#if IDCT_SIMD
+typedef int IDCTVec4 __attribute__((vector_size(16)));
+typedef int IDCTVec8 __attribute__((vector_size(32)));
+typedef short IDCTVecShort4 __attribute__((vector_size(8)));
+typedef short IDCTVecShort8 __attribute__((vector_size(16)));
+
+#define IDCT_W1 2841
+#define IDCT_W2 2676
+#define IDCT_W3 2408
+#define IDCT_W5 1609
+#define IDCT_W6 1108
+#define IDCT_W7 565
+
+// One pass over several rows or columns side by side, v[i] holding coefficient i of each. The row and
+// column passes only differ in scaling and rounding, and in what an input with no AC terms becomes.
+// That shortcut is kept as a select rather than left to the butterflies so overflow behaves the same //
+#define IDCT_DEFINE_PASS(T)                                                                                 \
+  static inline __attribute__((always_inline)) void iDCTPass_##T(T *v, int in_shift, int x0_bias, int round, \
+                                                                 int product_shift, int out_shift,           \
+                                                                 int flat_shift_left, int flat_bias,         \
+                                                                 int flat_shift_right) {                     \
+    T x0, x1 = v[4] << in_shift, x2 = v[6], x3 = v[2], x4 = v[1], x5 = v[7], x6 = v[5], x7 = v[3], x8;      \
+    T flat = (x1 | x2 | x3 | x4 | x5 | x6 | x7) == 0;                                                        \
+    T flat_value = ((v[0] << flat_shift_left) + flat_bias) >> flat_shift_right;                              \
+    x0 = (v[0] << in_shift) + x0_bias;                                                                       \
+    x8 = IDCT_W7 * (x4 + x5) + round;                                                                        \
+    x4 = (x8 + (IDCT_W1 - IDCT_W7) * x4) >> product_shift;                                                   \
+    x5 = (x8 - (IDCT_W1 + IDCT_W7) * x5) >> product_shift;                                                   \
+    x8 = IDCT_W3 * (x6 + x7) + round;                                                                        \
+    x6 = (x8 - (IDCT_W3 - IDCT_W5) * x6) >> product_shift;                                                   \
+    x7 = (x8 - (IDCT_W3 + IDCT_W5) * x7) >> product_shift;                                                   \
+    x8 = x0 + x1;                                                                                            \
+    x0 -= x1;                                                                                                \
+    x1 = IDCT_W6 * (x3 + x2) + round;                                                                        \
+    x2 = (x1 - (IDCT_W2 + IDCT_W6) * x2) >> product_shift;                                                   \
+    x3 = (x1 + (IDCT_W2 - IDCT_W6) * x3) >> product_shift;                                                   \
+    x1 = x4 + x6;                                                                                            \
+    x4 -= x6;                                                                                                \
+    x6 = x5 + x7;                                                                                            \
+    x5 -= x7;                                                                                                \
+    x7 = x8 + x3;                                                                                            \
+    x8 -= x3;                                                                                                \
+    x3 = x0 + x2;                                                                                            \
+    x0 -= x2;                                                                                                \
+    x2 = (181 * (x4 + x5) + 128) >> 8;                                                                       \
+    x4 = (181 * (x4 - x5) + 128) >> 8;                                                                       \
+    v[0] = (flat & flat_value) | (~flat & ((x7 + x1) >> out_shift));                                         \
+    v[1] = (flat & flat_value) | (~flat & ((x3 + x2) >> out_shift));                                         \
+    v[2] = (flat & flat_value) | (~flat & ((x0 + x4) >> out_shift));                                         \
+    v[3] = (flat & flat_value) | (~flat & ((x8 + x6) >> out_shift));                                         \
+    v[4] = (flat & flat_value) | (~flat & ((x8 - x6) >> out_shift));                                         \
+    v[5] = (flat & flat_value) | (~flat & ((x0 - x4) >> out_shift));                                         \
+    v[6] = (flat & flat_value) | (~flat & ((x3 - x2) >> out_shift));                                         \
+    v[7] = (flat & flat_value) | (~flat & ((x7 - x1) >> out_shift));                                         \
+  }
+
+IDCT_DEFINE_PASS(IDCTVec4)
+IDCT_DEFINE_PASS(IDCTVec8)
+
+#define IDCT_ROW_PASS(T, v) iDCTPass_##T(v, 11, 128, 0, 0, 8, 3, 0, 0)
+#define IDCT_COL_PASS(T, v) iDCTPass_##T(v, 8, 8192, 4, 3, 14, 0, 32, 6)
+
+static inline __attribute__((always_inline)) void iDCTTranspose4(IDCTVec4 *v) {
+  IDCTVec4 a0 = __builtin_shufflevector(v[0], v[1], 0, 4, 1, 5);
+  IDCTVec4 a1 = __builtin_shufflevector(v[0], v[1], 2, 6, 3, 7);
+  IDCTVec4 a2 = __builtin_shufflevector(v[2], v[3], 0, 4, 1, 5);
+  IDCTVec4 a3 = __builtin_shufflevector(v[2], v[3], 2, 6, 3, 7);
+  v[0] = __builtin_shufflevector(a0, a2, 0, 1, 4, 5);
+  v[1] = __builtin_shufflevector(a0, a2, 2, 3, 6, 7);
+  v[2] = __builtin_shufflevector(a1, a3, 0, 1, 4, 5);
+  v[3] = __builtin_shufflevector(a1, a3, 2, 3, 6, 7);
+}
+
+static inline __attribute__((always_inline)) void iDCTTranspose8(IDCTVec8 *v) {
+  IDCTVec8 a[8], b[8];
+  for (int i = 0; i < 8; i += 2) {
+    a[i] = __builtin_shufflevector(v[i], v[i + 1], 0, 8, 1, 9, 4, 12, 5, 13);
+    a[i + 1] = __builtin_shufflevector(v[i], v[i + 1], 2, 10, 3, 11, 6, 14, 7, 15);
+  }
+  for (int i = 0; i < 8; i += 4) {
+    for (int j = 0; j < 2; ++j) {
+      b[i + 2 * j] = __builtin_shufflevector(a[i + j], a[i + j + 2], 0, 1, 8, 9, 4, 5, 12, 13);
+      b[i + 2 * j + 1] = __builtin_shufflevector(a[i + j], a[i + j + 2], 2, 3, 10, 11, 6, 7, 14, 15);
+    }
+  }
+  for (int i = 0; i < 4; ++i) {
+    v[i] = __builtin_shufflevector(b[i], b[i + 4], 0, 1, 2, 3, 8, 9, 10, 11);
+    v[i + 4] = __builtin_shufflevector(b[i], b[i + 4], 4, 5, 6, 7, 12, 13, 14, 15);
+  }
+}
+
+// SSE2: rows[i][h] holds columns 4h to 4h+3 of row i. Each pass runs on four rows or columns at a
+// time, so the block is worked on as 4x4 quarters //
+static inline __attribute__((always_inline)) void iDCTBlock4(IDCTVec4 rows[8][2], int truncate_rows,
+                                                             unsigned char *out, int stride) {
+  IDCTVec4 v[8], t[2][8];
+  for (int g = 0; g < 2; ++g) {
+    for (int h = 0; h < 2; ++h) {
+      for (int i = 0; i < 4; ++i) v[4 * h + i] = rows[4 * g + i][h];
+      iDCTTranspose4(&v[4 * h]);
+    }
+    IDCT_ROW_PASS(IDCTVec4, v);
+    for (int i = 0; truncate_rows && i < 8; ++i) v[i] = (v[i] << 16) >> 16;
+    for (int i = 0; i < 8; ++i) t[g][i] = v[i];
+  }
+  for (int q = 0; q < 2; ++q) {
+    for (int g = 0; g < 2; ++g) {
+      for (int i = 0; i < 4; ++i) v[4 * g + i] = t[g][4 * q + i];
+      iDCTTranspose4(&v[4 * g]);
+    }
+    IDCT_COL_PASS(IDCTVec4, v);
+    for (int i = 0; i < 8; ++i) rows[i][q] = v[i] + 128;
+  }
+  for (int i = 0; i < 8; ++i) {
+    __m128i pixels = _mm_packs_epi32((__m128i)rows[i][0], (__m128i)rows[i][1]);
+    _mm_storel_epi64((__m128i *)&out[i * stride], _mm_packus_epi16(pixels, pixels));
+  }
+}
+
+static void iDCTBlockShort_sse2(const short *D, int D_stride, unsigned char *out, int stride) {
+  IDCTVec4 rows[8][2];
+  for (int i = 0; i < 8; ++i) {
+    for (int h = 0; h < 2; ++h) {
+      IDCTVecShort4 coeffs;
+      memcpy(&coeffs, &D[i * D_stride + 4 * h], sizeof(coeffs));
+      rows[i][h] = __builtin_convertvector(coeffs, IDCTVec4);
+    }
+  }
+  iDCTBlock4(rows, 1, out, stride);
+}
+
+static void iDCTBlockInt_sse2(const int *D, unsigned char *out, int stride) {
+  IDCTVec4 rows[8][2];
+  memcpy(rows, D, sizeof(rows));
+  iDCTBlock4(rows, 0, out, stride);
+}
+
+// AVX2: a whole row per register, so each pass is a single run of the butterflies //
+static inline __attribute__((always_inline, target("avx2"))) void iDCTBlock8(IDCTVec8 *v, int truncate_rows,
+                                                                              unsigned char *out, int stride) {
+  iDCTTranspose8(v);
+  IDCT_ROW_PASS(IDCTVec8, v);
+  for (int i = 0; truncate_rows && i < 8; ++i) v[i] = (v[i] << 16) >> 16;
+  iDCTTranspose8(v);
+  IDCT_COL_PASS(IDCTVec8, v);
+  const __m256i row_order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  for (int i = 0; i < 8; i += 4) {
+    __m256i rows01 = _mm256_packs_epi32((__m256i)(v[i] + 128), (__m256i)(v[i + 1] + 128));
+    __m256i rows23 = _mm256_packs_epi32((__m256i)(v[i + 2] + 128), (__m256i)(v[i + 3] + 128));
+    __m256i pixels = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(rows01, rows23), row_order);
+    __m128i pixels01 = _mm256_castsi256_si128(pixels), pixels23 = _mm256_extracti128_si256(pixels, 1);
+    _mm_storel_epi64((__m128i *)&out[i * stride], pixels01);
+    _mm_storel_epi64((__m128i *)&out[(i + 1) * stride], _mm_unpackhi_epi64(pixels01, pixels01));
+    _mm_storel_epi64((__m128i *)&out[(i + 2) * stride], pixels23);
+    _mm_storel_epi64((__m128i *)&out[(i + 3) * stride], _mm_unpackhi_epi64(pixels23, pixels23));
+  }
+}
+
+static __attribute__((target("avx2"))) void iDCTBlockShort_avx2(const short *D, int D_stride, unsigned char *out,
+                                                                int stride) {
+  IDCTVec8 v[8];
+  for (int i = 0; i < 8; ++i) {
+    IDCTVecShort8 coeffs;
+    memcpy(&coeffs, &D[i * D_stride], sizeof(coeffs));
+    v[i] = __builtin_convertvector(coeffs, IDCTVec8);
+  }
+  iDCTBlock8(v, 1, out, stride);
+}
+
+static __attribute__((target("avx2"))) void iDCTBlockInt_avx2(const int *D, unsigned char *out, int stride) {
+  IDCTVec8 v[8];
+  memcpy(v, D, sizeof(v));
+  iDCTBlock8(v, 0, out, stride);
+}
+#endif
+
+// The widest kernel this CPU runs, or the scalar reference (null functions) off x86 //
+static inline IDCTKernel iDCTSelectKernel(void) {
+  IDCTKernel kernel = {"scalar", 0, 0};
+#if IDCT_SIMD
+  kernel.name = "sse2";
+  kernel.block_short = iDCTBlockShort_sse2;
+  kernel.block_int = iDCTBlockInt_sse2;
+  if (__builtin_cpu_supports("avx2")) {
+    kernel.name = "avx2";
+    kernel.block_short = iDCTBlockShort_avx2;
+    kernel.block_int = iDCTBlockInt_avx2;
+  }
+#endif
+  return kernel;
+}
+
+#endif  // IDCT_H //
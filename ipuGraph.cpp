@@ -1,78 +1,418 @@
 
 
 #include "JPGReader.hpp"
+#include <poplar/CycleCount.hpp>
+#include <popops/DynamicSlice.hpp>
+#include <popops/codelets.hpp>
 #include <poputil/VertexTemplates.hpp>
 
-void JPGReader::buildIpuGraph(poplar::Device &ipuDevice) {
-  m_ipu_graph.addCodelets("codelets.gp");
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-  m_IPU_params_tensor = m_ipu_graph.addVariable(poplar::INT, {(ulong)PARAMS_SIZE}, "params_table");
-  m_ipu_graph.setTileMapping(m_IPU_params_tensor, 0);
-  auto IPU_params_stream = m_ipu_graph.addHostToDeviceFIFO("params-stream", poplar::INT, PARAMS_SIZE);
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+// Compiling the graph dominates start-up, so the compiled executable is kept on disk and later readers
+// load it instead. Nothing but the streams' names is needed on the host side once it's loaded //
+void JPGReader::buildIpuGraph(poplar::Device &ipuDevice) {
+  uint64_t start_time = TimingStats::now();
 
-  // Setup Intermediate and output pixel tensors + streams
-  m_out_pixels = m_ipu_graph.addVariable(poplar::UNSIGNED_CHAR, {(ulong)m_max_pixels * 3}, "pixels");
-  m_output_pixels_stream =
-      m_ipu_graph.addDeviceToHostFIFO("pixels-stream", poplar::UNSIGNED_CHAR, m_max_pixels * 3);
   for (int i = 0; i < 3; ++i) {
     m_channels[i].tensor_name = "channel_0_pixels";
     m_channels[i].stream_name = "channel_0_stream";
     m_channels[i].tensor_name[8] += i;
     m_channels[i].stream_name[8] += i;
+    for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+      for (unsigned size = 0; size < NUM_TRANSFER_SIZES; ++size) {
+        m_channels[i].stream_names.push_back(m_channels[i].stream_name + "-" + std::to_string(ipu) + "-" +
+                                             std::to_string(size));
+      }
+    }
+  }
+  for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+    for (unsigned size = 0; size < NUM_TRANSFER_SIZES; ++size) {
+      m_packed_stream_names.push_back("packed-stream-" + std::to_string(ipu) + "-" + std::to_string(size));
+      m_pixel_stream_names.push_back("pixels-stream-" + std::to_string(ipu) + "-" + std::to_string(size));
+    }
+  }
+
+  std::string cache_path = executableCachePath(ipuDevice.getTarget());
+  std::ifstream cached(cache_path, std::ios::binary);
+  if (cached) {
+    // Written by another SDK version, or truncated. Compile it afresh and replace it //
+    try {
+      m_ipuEngine = std::make_unique<poplar::Engine>(poplar::Executable::deserialize(cached));
+    } catch (const std::exception &e) {
+      fprintf(stderr, "Ignoring cached executable %s: %s\n", cache_path.c_str(), e.what());
+    }
+  }
+  if (!m_ipuEngine) {
+    poplar::Executable executable = poplar::compileGraph(m_ipu_graph, buildPostprocessPrograms());
+    if (!cache_path.empty()) saveExecutable(executable, cache_path);
+    m_ipuEngine = std::make_unique<poplar::Engine>(std::move(executable));
+  }
+
+  for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+    m_ipuEngine->connectStream("params-stream-" + std::to_string(ipu), &m_IPU_params_table[ipu * PARAMS_SIZE]);
+    m_ipuEngine->connectStream("quant-stream-" + std::to_string(ipu), &m_IPU_quant_table[ipu * 3 * 64]);
+    if (m_do_decompress_on_IPU) {
+      m_ipuEngine->connectStream("huffman-stream-" + std::to_string(ipu),
+                                 &m_IPU_huffman_table[ipu * 4 * HUFFMAN_TABLE_SIZE]);
+    }
+    connectPixelStreams(ipu, &m_pixels[ipu * m_IPU_pixels * 3]);
+  }
+  // Channel and packed streams are (re)connected by stageIPUInputs() before each run //
+
+  m_ipuEngine->load(ipuDevice);
+
+  timings.record(stage_buildIpuGraph, start_time);
+}
+
+// One program per subsampling mode, indexed by it, then the same again putting the pixels in raster
+// order before they go back. They share the tensors and streams, and differ only in the compute set
+// their vertices are in and which pixels they send //
+std::vector<poplar::program::Program> JPGReader::buildPostprocessPrograms() {
+  m_ipu_graph.addCodelets("codelets.gp");
+  popops::addCodelets(m_ipu_graph);
+
+  // Each IPU gets its own row of params, on its first tile, so a batch can put a different image on
+  // each. Every stream is per IPU too, and only carries that IPU's slice of its tensor, so the IPUs all
+  // transfer over their own host links at once //
+  m_IPU_params_tensor = m_ipu_graph.addVariable(poplar::INT, {(ulong)m_num_IPUs, (ulong)PARAMS_SIZE}, "params_table");
+  m_IPU_quant_tensor = m_ipu_graph.addVariable(poplar::UNSIGNED_CHAR, {(ulong)m_num_IPUs, 3 * 64}, "quant_table");
+  std::vector<poplar::DataStream> IPU_params_streams, IPU_quant_streams;
+  for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+    m_ipu_graph.setTileMapping(m_IPU_params_tensor[ipu], ipu * (m_tiles_per_IPU / THREADS_PER_TILE));
+    m_ipu_graph.setTileMapping(m_IPU_quant_tensor[ipu], ipu * (m_tiles_per_IPU / THREADS_PER_TILE));
+    IPU_params_streams.push_back(m_ipu_graph.addHostToDeviceFIFO(
+        "params-stream-" + std::to_string(ipu), poplar::INT, PARAMS_SIZE));
+    IPU_quant_streams.push_back(m_ipu_graph.addHostToDeviceFIFO(
+        "quant-stream-" + std::to_string(ipu), poplar::UNSIGNED_CHAR, 3 * 64));
+  }
+  // Only a reader decompressing on the IPU has Huffman tables //
+  std::vector<poplar::DataStream> IPU_huffman_streams;
+  if (m_do_decompress_on_IPU) {
+    m_IPU_huffman_tensor =
+        m_ipu_graph.addVariable(poplar::INT, {(ulong)m_num_IPUs, 4 * (ulong)HUFFMAN_TABLE_SIZE}, "huffman_table");
+    for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+      m_ipu_graph.setTileMapping(m_IPU_huffman_tensor[ipu], ipu * (m_tiles_per_IPU / THREADS_PER_TILE));
+      IPU_huffman_streams.push_back(m_ipu_graph.addHostToDeviceFIFO(
+          "huffman-stream-" + std::to_string(ipu), poplar::INT, 4 * HUFFMAN_TABLE_SIZE));
+    }
+  }
+
+  // Setup Intermediate and output pixel tensors + streams, one of each size per IPU
+  m_out_pixels = m_ipu_graph.addVariable(poplar::UNSIGNED_CHAR, {(ulong)m_max_pixels * 3}, "pixels");
+  for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+    for (unsigned size = 0; size < NUM_TRANSFER_SIZES; ++size) {
+      m_output_pixels_streams.push_back(
+          m_ipu_graph.addDeviceToHostFIFO(m_pixel_stream_names[ipu * NUM_TRANSFER_SIZES + size], poplar::UNSIGNED_CHAR,
+                                          transferTiles(size) * MAX_PIXELS_PER_TILE * 3));
+    }
+  }
+  for (int i = 0; i < 3; ++i) {
     poplar::Type input_type = m_do_iDCT_on_IPU ? poplar::SHORT : poplar::UNSIGNED_CHAR;
     m_channels[i].data_tensor =
         m_ipu_graph.addVariable(input_type, {(ulong)m_max_pixels}, m_channels[i].tensor_name);
-    m_channels[i].input_stream =
-        m_ipu_graph.addHostToDeviceFIFO(m_channels[i].stream_name, input_type, m_max_pixels);
+    for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+      for (unsigned size = 0; size < NUM_TRANSFER_SIZES; ++size) {
+        m_channels[i].input_streams.push_back(m_ipu_graph.addHostToDeviceFIFO(
+            m_channels[i].stream_names[ipu * NUM_TRANSFER_SIZES + size], input_type,
+            transferTiles(size) * MAX_PIXELS_PER_TILE));
+      }
+    }
+  }
+  m_packed_tensor =
+      m_ipu_graph.addVariable(poplar::UNSIGNED_CHAR, {(ulong)m_num_tiles * PACKED_BYTES_PER_TILE}, "packed");
+  for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+    for (unsigned size = 0; size < NUM_TRANSFER_SIZES; ++size) {
+      m_packed_streams.push_back(
+          m_ipu_graph.addHostToDeviceFIFO(m_packed_stream_names[ipu * NUM_TRANSFER_SIZES + size],
+                                          poplar::UNSIGNED_CHAR, transferTiles(size) * PACKED_BYTES_PER_TILE));
+    }
   }
 
-  // Connect inputs to outputs via compute vertex, and map all over tiles
-  poplar::ComputeSet postprocess_op = m_ipu_graph.addComputeSet("postprocess");
-  const auto vertexClass = poputil::templateVertex(
-    "postProcessColour", 
-    m_do_iDCT_on_IPU ? "true" : "false", 
-    m_do_iDCT_on_IPU ? "short" : "unsigned char"
-  );
+  // Connect inputs to outputs via compute vertex, and map all over tiles. Every mode gets a compute set
+  // with a vertex on each tile //
+  const char *do_iDCT = m_do_iDCT_on_IPU ? "true" : "false";
+  const char *coeff_type = m_do_iDCT_on_IPU ? "short" : "unsigned char";
+  poplar::ComputeSet huffman_op = m_ipu_graph.addComputeSet("huffman");
+  poplar::ComputeSet raster_offsets_op = m_ipu_graph.addComputeSet("raster_offsets");
+  const ulong num_segments = m_max_pixels / RASTER_SEGMENT_PIXELS;
+  const ulong segments_per_tile = MAX_PIXELS_PER_TILE / RASTER_SEGMENT_PIXELS;
+  const ulong segments_per_IPU = m_tiles_per_IPU * segments_per_tile;
+  poplar::Tensor raster_offsets = m_ipu_graph.addVariable(poplar::UNSIGNED_INT, {num_segments, 1}, "raster_offsets");
+  // Each Huffman vertex flags bad data, for the host to read back after runs it decoded scans in //
+  poplar::Tensor huffman_errors = m_ipu_graph.addVariable(poplar::INT, {(ulong)m_num_tiles}, "huffman_errors");
+  if (m_do_decompress_on_IPU) m_ipu_graph.createHostRead("huffman_errors", huffman_errors);
+  // Each postprocess vertex counts the cycles it took, for the host to read back when profiling //
+  poplar::Tensor postprocess_cycles =
+      m_ipu_graph.addVariable(poplar::UNSIGNED_INT, {(ulong)m_num_tiles}, "postprocess_cycles");
+  std::vector<poplar::ComputeSet> postprocess_ops;
+  std::vector<std::string> vertex_classes;
+  for (int mode = 0; mode < NUM_SUBSAMPLINGS; ++mode) {
+    postprocess_ops.push_back(m_ipu_graph.addComputeSet("postprocess_" + std::to_string(mode)));
+    vertex_classes.push_back(mode == subsampling_generic
+                                 ? poputil::templateVertex("postProcessColour", do_iDCT, coeff_type)
+                                 : poputil::templateVertex("postProcessSubsampled", do_iDCT, coeff_type, mode));
+  }
   for (unsigned int virtual_tile = 0; virtual_tile < m_num_tiles; ++virtual_tile) {
     int physical_tile = virtual_tile / THREADS_PER_TILE;
-    poplar::VertexRef vtx = m_ipu_graph.addVertex(postprocess_op, vertexClass);
+    int ipu = virtual_tile / m_tiles_per_IPU;
     int start = virtual_tile * MAX_PIXELS_PER_TILE;
     int end = (virtual_tile + 1) * MAX_PIXELS_PER_TILE;
     auto Y = m_channels[0].data_tensor.slice(start, end);
     auto CB = m_channels[1].data_tensor.slice(start, end);
     auto CR = m_channels[2].data_tensor.slice(start, end);
     auto RGB = m_out_pixels.slice(start * 3, end * 3);
-    m_ipu_graph.connect(vtx["params"], m_IPU_params_tensor);
-    m_ipu_graph.connect(vtx["Y"], Y);
-    m_ipu_graph.connect(vtx["CB"], CB);
-    m_ipu_graph.connect(vtx["CR"], CR);
-    m_ipu_graph.connect(vtx["RGB"], RGB);
-    m_ipu_graph.setTileMapping(vtx, physical_tile);
+    auto packed =
+        m_packed_tensor.slice(virtual_tile * PACKED_BYTES_PER_TILE, (virtual_tile + 1) * PACKED_BYTES_PER_TILE);
     m_ipu_graph.setTileMapping(Y, physical_tile);
     m_ipu_graph.setTileMapping(CB, physical_tile);
     m_ipu_graph.setTileMapping(CR, physical_tile);
     m_ipu_graph.setTileMapping(RGB, physical_tile);
+    m_ipu_graph.setTileMapping(packed, physical_tile);
+    m_ipu_graph.setTileMapping(postprocess_cycles[virtual_tile], physical_tile);
+    m_ipu_graph.setTileMapping(huffman_errors[virtual_tile], physical_tile);
+
+    auto offsets = raster_offsets.slice(virtual_tile * segments_per_tile, (virtual_tile + 1) * segments_per_tile);
+    m_ipu_graph.setTileMapping(offsets, physical_tile);
+    poplar::VertexRef offsets_vtx = m_ipu_graph.addVertex(raster_offsets_op, "rasterOffsets");
+    m_ipu_graph.connect(offsets_vtx["params"], m_IPU_params_tensor[ipu]);
+    m_ipu_graph.connect(offsets_vtx["offsets"], offsets.flatten());
+    m_ipu_graph.setInitialValue(offsets_vtx["first_segment"], unsigned(virtual_tile * segments_per_tile));
+    m_ipu_graph.setInitialValue(offsets_vtx["num_segments"], unsigned(num_segments));
+    m_ipu_graph.setInitialValue(offsets_vtx["segments_per_IPU"], unsigned(segments_per_IPU));
+    m_ipu_graph.setInitialValue(offsets_vtx["tile_pixels"], unsigned(MAX_PIXELS_PER_TILE));
+    m_ipu_graph.setTileMapping(offsets_vtx, physical_tile);
+    m_ipu_graph.setPerfEstimate(offsets_vtx, segments_per_tile * 50);
+
+    if (m_do_decompress_on_IPU) {
+      poplar::VertexRef vtx = m_ipu_graph.addVertex(huffman_op, "decodeHuffman");
+      m_ipu_graph.connect(vtx["params"], m_IPU_params_tensor[ipu]);
+      m_ipu_graph.connect(vtx["packed"], packed);
+      m_ipu_graph.connect(vtx["quant"], m_IPU_quant_tensor[ipu]);
+      m_ipu_graph.connect(vtx["tables"], m_IPU_huffman_tensor[ipu]);
+      m_ipu_graph.connect(vtx["Y"], Y);
+      m_ipu_graph.connect(vtx["CB"], CB);
+      m_ipu_graph.connect(vtx["CR"], CR);
+      m_ipu_graph.connect(vtx["error"], huffman_errors.slice(virtual_tile, virtual_tile + 1));
+      m_ipu_graph.setTileMapping(vtx, physical_tile);
+      m_ipu_graph.setPerfEstimate(vtx, MAX_PIXELS_PER_TILE * 1000);
+    }
 
-    m_ipu_graph.setPerfEstimate(vtx, MAX_PIXELS_PER_TILE * 1000);
+    for (int mode = 0; mode < NUM_SUBSAMPLINGS; ++mode) {
+      poplar::VertexRef vtx = m_ipu_graph.addVertex(postprocess_ops[mode], vertex_classes[mode]);
+      m_ipu_graph.connect(vtx["params"], m_IPU_params_tensor[ipu]);
+      m_ipu_graph.connect(vtx["Y"], Y);
+      m_ipu_graph.connect(vtx["CB"], CB);
+      m_ipu_graph.connect(vtx["CR"], CR);
+      m_ipu_graph.connect(vtx["RGB"], RGB);
+      m_ipu_graph.connect(vtx["packed"], packed);
+      m_ipu_graph.connect(vtx["quant"], m_IPU_quant_tensor[ipu]);
+      m_ipu_graph.connect(vtx["cycles"], postprocess_cycles.slice(virtual_tile, virtual_tile + 1));
+      m_ipu_graph.setTileMapping(vtx, physical_tile);
+
+      m_ipu_graph.setPerfEstimate(vtx, MAX_PIXELS_PER_TILE * 1000);
+    }
   }
 
-  // Create colour conversion program
-  poplar::program::Sequence ipu_postprocess_program;
-  ipu_postprocess_program.add(poplar::program::Copy(IPU_params_stream, m_IPU_params_tensor));
-  for (auto &channel : m_channels) {
-    ipu_postprocess_program.add(poplar::program::Copy(channel.input_stream, channel.data_tensor));
+  // Where each image lands in raster order depends on its width, so the reordering can't be laid out in
+  // the graph. Instead runs of RASTER_SEGMENT_PIXELS pixels are gathered from the offsets the raster
+  // offsets vertices worked out for them. There's a gather for each transfer size, over just the start
+  // of each IPU's slice that size moves, and the run switches to the one for its largest transfer. Each
+  // has its tensors laid out by a popops plan, so the lookups and their offsets are spread over the tiles //
+  const ulong segment_bytes = RASTER_SEGMENT_PIXELS * 3;
+  std::vector<std::pair<std::int32_t, poplar::program::Program>> gather_cases;
+  m_raster_out_pixels.clear();
+  for (unsigned size = 0; size < NUM_TRANSFER_SIZES; ++size) {
+    const ulong IPU_lookups = transferTiles(size) * segments_per_tile;
+    const ulong num_lookups = m_num_IPUs * IPU_lookups;
+    std::string name = "raster_gather_" + std::to_string(size);
+    popops::SlicePlan plan = popops::embedding::plan(m_ipu_graph, poplar::UNSIGNED_CHAR, num_lookups, segment_bytes,
+                                                     {num_lookups}, poplar::OptionFlags());
+    poplar::Tensor sources = popops::createSliceableTensor(m_ipu_graph, poplar::UNSIGNED_CHAR,
+                                                           {num_lookups, segment_bytes}, {0}, {1}, plan,
+                                                           poplar::OptionFlags(), name + "_sources");
+    poplar::Tensor indices =
+        popops::createIndicesTensor(m_ipu_graph, {0}, num_lookups, plan, poplar::OptionFlags(), name + "_indices");
+    std::vector<poplar::Tensor> IPU_sources, IPU_indices;
+    for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+      ulong start = ipu * m_IPU_pixels * 3;
+      IPU_sources.push_back(m_out_pixels.slice(start, start + IPU_lookups * segment_bytes));
+      IPU_indices.push_back(raster_offsets.slice(ipu * segments_per_IPU, ipu * segments_per_IPU + IPU_lookups));
+    }
+    poplar::program::Sequence gather;
+    gather.add(poplar::program::Copy(poplar::concat(IPU_sources), sources.flatten()));
+    gather.add(poplar::program::Copy(poplar::concat(IPU_indices), indices));
+    m_raster_out_pixels.push_back(popops::multiSlice(m_ipu_graph, sources, indices, {0}, {1}, gather, plan,
+                                                     poplar::OptionFlags(), name)
+                                      .flatten());
+    gather_cases.push_back({size + 1, gather});
   }
-  ipu_postprocess_program.add(poplar::program::Execute(postprocess_op));
-  ipu_postprocess_program.add(poplar::program::Copy(m_out_pixels, m_output_pixels_stream));
+  poplar::Tensor gather_size = m_IPU_params_tensor[0][param_raster_gather_size];
+  poplar::program::Sequence raster_gather;
+  raster_gather.add(poplar::program::Execute(raster_offsets_op));
+  raster_gather.add(poplar::program::Switch(gather_size, gather_cases));
 
-  // Create poplar engine ("session"?) to execute colour program
-  m_ipuEngine = std::make_unique<poplar::Engine>(m_ipu_graph, ipu_postprocess_program);
-  m_ipuEngine->connectStream("params-stream", m_IPU_params_table);
-  m_ipuEngine->connectStream("pixels-stream", m_pixels.data());
-  for (auto &channel : m_channels) {
-    void *src = m_do_iDCT_on_IPU ? (void *)channel.frequencies.data() : (void *)channel.pixels.data();
-    m_ipuEngine->connectStream(channel.stream_name, src);
+  // Profiling stamps the first IPU's cycle counter, once its tiles have synced, at the start and after
+  // each phase. The stamps all land in one tensor, which the host reads after the run. Without
+  // profiling these sequences are empty //
+  std::vector<poplar::program::Sequence> stamps(NUM_IPU_PHASES + 1);
+  if (m_profile_IPU) {
+    poplar::Tensor stamps_tensor =
+        m_ipu_graph.addVariable(poplar::UNSIGNED_INT, {(ulong)NUM_IPU_PHASES + 1, 2}, "cycle_stamps");
+    m_ipu_graph.setTileMapping(stamps_tensor, 0);
+    for (int i = 0; i <= NUM_IPU_PHASES; ++i) {
+      poplar::Tensor stamp = poplar::cycleStamp(m_ipu_graph, stamps[i], 0, poplar::SyncType::INTERNAL);
+      stamps[i].add(poplar::program::Copy(stamp, stamps_tensor[i]));
+    }
+    m_ipu_graph.createHostRead("cycle_stamps", stamps_tensor);
+    m_ipu_graph.createHostRead("postprocess_cycles", postprocess_cycles);
   }
+  auto stamp_after = [&](Stage phase) -> const poplar::program::Sequence & {
+    return stamps[phase - stage_ipuCopyParams + 1];
+  };
 
-  m_ipuEngine->load(ipuDevice);
-}
\ No newline at end of file
+  // Create colour conversion programs. Once its params are on the device, each IPU switches on its
+  // transfer size to pick the copies moving just the start of its slices that hold data, of either the
+  // channel tensors or, numbered after them, the packed tensor. To time each kind of copy on its own,
+  // profiling instead has every IPU's copies of one tensor together, under a Switch of their own //
+  poplar::program::Sequence copy_inputs, copy_params, copy_packed, copy_channels[3], copy_outputs;
+  for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+    poplar::program::Sequence &params_sequence = m_profile_IPU ? copy_params : copy_inputs;
+    params_sequence.add(poplar::program::Copy(IPU_params_streams[ipu], m_IPU_params_tensor[ipu]));
+    params_sequence.add(poplar::program::Copy(IPU_quant_streams[ipu], m_IPU_quant_tensor[ipu]));
+    if (m_do_decompress_on_IPU) {
+      params_sequence.add(poplar::program::Copy(IPU_huffman_streams[ipu], m_IPU_huffman_tensor[ipu]));
+    }
+    std::vector<std::pair<std::int32_t, poplar::program::Program>> input_cases, packed_cases, channel_cases[3],
+        output_cases;
+    for (unsigned size = 0; size < NUM_TRANSFER_SIZES; ++size) {
+      int start = ipu * m_IPU_pixels;
+      int end = start + transferTiles(size) * MAX_PIXELS_PER_TILE;
+      int stream = ipu * NUM_TRANSFER_SIZES + size;
+      poplar::program::Sequence copy_in;
+      for (int c = 0; c < 3; ++c) {
+        poplar::program::Copy copy_channel(m_channels[c].input_streams[stream],
+                                           m_channels[c].data_tensor.slice(start, end));
+        copy_in.add(copy_channel);
+        channel_cases[c].push_back({size + 1, copy_channel});
+      }
+      int packed_start = ipu * m_tiles_per_IPU * PACKED_BYTES_PER_TILE;
+      int packed_end = packed_start + transferTiles(size) * PACKED_BYTES_PER_TILE;
+      poplar::program::Copy copy_packed(m_packed_streams[stream], m_packed_tensor.slice(packed_start, packed_end));
+      poplar::program::Copy copy_out(m_out_pixels.slice(start * 3, end * 3), m_output_pixels_streams[stream]);
+      input_cases.push_back({size + 1, copy_in});
+      input_cases.push_back({NUM_TRANSFER_SIZES + size + 1, copy_packed});
+      packed_cases.push_back({NUM_TRANSFER_SIZES + size + 1, copy_packed});
+      output_cases.push_back({size + 1, copy_out});
+      output_cases.push_back({NUM_TRANSFER_SIZES + size + 1, copy_out});
+    }
+    poplar::Tensor transfer_size = m_IPU_params_tensor[ipu][param_transfer_size];
+    if (m_profile_IPU) {
+      copy_packed.add(poplar::program::Switch(transfer_size, packed_cases));
+      for (int c = 0; c < 3; ++c) copy_channels[c].add(poplar::program::Switch(transfer_size, channel_cases[c]));
+    } else {
+      copy_inputs.add(poplar::program::Switch(transfer_size, input_cases));
+    }
+    copy_outputs.add(poplar::program::Switch(transfer_size, output_cases));
+  }
+  // The gathered pixels hold each IPU's runs one after another, as many as the gather took from each //
+  std::vector<std::pair<std::int32_t, poplar::program::Program>> raster_output_cases;
+  for (unsigned gathered = 0; gathered < NUM_TRANSFER_SIZES; ++gathered) {
+    const ulong IPU_bytes = transferTiles(gathered) * MAX_PIXELS_PER_TILE * 3;
+    poplar::program::Sequence copy_gathered;
+    for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+      std::vector<std::pair<std::int32_t, poplar::program::Program>> raster_cases;
+      for (unsigned size = 0; size <= gathered; ++size) {
+        ulong start = ipu * IPU_bytes;
+        ulong end = start + transferTiles(size) * MAX_PIXELS_PER_TILE * 3;
+        poplar::program::Copy copy_raster(m_raster_out_pixels[gathered].slice(start, end),
+                                          m_output_pixels_streams[ipu * NUM_TRANSFER_SIZES + size]);
+        raster_cases.push_back({size + 1, copy_raster});
+        raster_cases.push_back({NUM_TRANSFER_SIZES + size + 1, copy_raster});
+      }
+      copy_gathered.add(poplar::program::Switch(m_IPU_params_tensor[ipu][param_transfer_size], raster_cases));
+    }
+    raster_output_cases.push_back({gathered + 1, copy_gathered});
+  }
+  poplar::program::Sequence copy_raster_outputs;
+  copy_raster_outputs.add(poplar::program::Switch(gather_size, raster_output_cases));
+  if (m_profile_IPU) {
+    copy_inputs.add(stamps[0]);
+    copy_inputs.add(copy_params);
+    copy_inputs.add(stamp_after(stage_ipuCopyParams));
+    copy_inputs.add(copy_packed);
+    copy_inputs.add(stamp_after(stage_ipuCopyPacked));
+    for (int c = 0; c < 3; ++c) {
+      copy_inputs.add(copy_channels[c]);
+      copy_inputs.add(stamp_after(Stage(stage_ipuCopyY + c)));
+    }
+  }
+  std::vector<poplar::program::Program> programs;
+  for (int raster = 0; raster < 2; ++raster) {
+    for (int mode = 0; mode < NUM_SUBSAMPLINGS; ++mode) {
+      poplar::program::Sequence ipu_postprocess_program;
+      ipu_postprocess_program.add(copy_inputs);
+      if (m_do_decompress_on_IPU) ipu_postprocess_program.add(poplar::program::Execute(huffman_op));
+      ipu_postprocess_program.add(stamp_after(stage_ipuHuffman));
+      ipu_postprocess_program.add(poplar::program::Execute(postprocess_ops[mode]));
+      ipu_postprocess_program.add(stamp_after(stage_ipuPostprocess));
+      if (raster) ipu_postprocess_program.add(raster_gather);
+      ipu_postprocess_program.add(stamp_after(stage_ipuRasterGather));
+      ipu_postprocess_program.add(raster ? copy_raster_outputs : copy_outputs);
+      ipu_postprocess_program.add(stamp_after(stage_ipuCopyPixels));
+      programs.push_back(ipu_postprocess_program);
+    }
+  }
+  return programs;
+}
+
+// 64-bit FNV-1a, which unlike std::hash gives the same value from every build of the library //
+static uint64_t fnv1a(const std::string &bytes) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (unsigned char byte : bytes) hash = (hash ^ byte) * 0x100000001b3ull;
+  return hash;
+}
+
+// The cache file for everything the compiled program depends on: the target, the options it was built
+// for, the version of the graph, the constants it is sized by and the codelets. Empty if caching is off //
+std::string JPGReader::executableCachePath(const poplar::Target &target) {
+  if (m_executable_cache_dir.empty()) return "";
+  std::ifstream codelets("codelets.gp", std::ios::binary);
+  std::string codelets_bytes((std::istreambuf_iterator<char>(codelets)), std::istreambuf_iterator<char>());
+
+  std::ostringstream path;
+  path << m_executable_cache_dir << "/postprocess_v" << GRAPH_VERSION << "_" << target.getTargetArchString()
+       << "_type" << (int)target.getTargetType() << "_" << m_num_IPUs << "x" << target.getTilesPerIPU() << "_iDCT"
+       << m_do_iDCT_on_IPU << "_huffman" << m_do_decompress_on_IPU << "_profile" << m_profile_IPU << "_"
+       << MAX_PIXELS_PER_TILE << "_" << THREADS_PER_TILE << "_" << PARAMS_SIZE << "_" << NUM_SUBSAMPLINGS << "_"
+       << NUM_TRANSFER_SIZES << "_" << PACKED_BYTES_PER_TILE << "_" << HUFFMAN_TABLE_SIZE << "_"
+       << RASTER_SEGMENT_PIXELS << "_" << std::hex << fnv1a(codelets_bytes) << ".poplar_exec";
+  return path.str();
+}
+
+// Write to a temporary file first, so a concurrent reader never loads half an executable //
+void JPGReader::saveExecutable(const poplar::Executable &executable, const std::string &path) {
+  mkdir(m_executable_cache_dir.c_str(), 0755);
+  std::string temp_path = path + ".tmp" + std::to_string(getpid());
+  {
+    std::ofstream file(temp_path, std::ios::binary);
+    if (!file) return;
+    try {
+      executable.serialize(file);
+    } catch (const std::exception &e) {
+      fprintf(stderr, "Not caching executable: %s\n", e.what());
+      file.setstate(std::ios::failbit);
+    }
+    if (!file) {
+      unlink(temp_path.c_str());
+      return;
+    }
+  }
+  if (rename(temp_path.c_str(), path.c_str()) != 0) unlink(temp_path.c_str());
+}
@@ -1,18 +1,37 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <new>
 #include <stdlib.h>
 
 #include <poplar/DeviceManager.hpp>
 #include <poplar/Engine.hpp>
 #include <poplar/IPUModel.hpp>
 
+#include "AsyncDecoder.hpp"
 #include "JPGReader.hpp"
 
 poplar::Device getIPU(bool use_hardware = true, int num_ipus = 1);
 
+// Counts every heap allocation in the process, for the benchmark to check decoding an image no bigger
+// than one the reader has seen makes none //
+static std::atomic<long> g_allocations(0);
+
+void *operator new(size_t size) {
+  ++g_allocations;
+  if (void *ptr = malloc(size ? size : 1)) return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
 
 int main(int argc, char** argv) {
-  if (argc != 2) {
-    printf("USAGE: %s <jpgfile>\n", argv[0]);
+  if (argc != 2 && argc != 3) {
+    printf("USAGE: %s <jpgfile> [downscale 1|2|4|8]\n", argv[0]);
     return EXIT_FAILURE;
   }
 
@@ -20,22 +39,109 @@ int main(int argc, char** argv) {
 
   const char* filename = argv[1];
   auto reader = std::make_unique<JPGReader>(ipuDevice, true);
+  if (argc == 3) reader->setDownscale(atoi(argv[2]));
   reader->read(filename);
   reader->decode();
   reader->write("outfile.ppm");
 
   if (TIMINGSTATS) {
-    // Warmup
+    // Warmup, which also grows the reader's buffers to fit the image //
     for (auto i = 0; i < 20; ++i) {
       reader->read(filename);
       reader->decode();
     }
-    reader->timings.clear();
+    reader->timings.reset();
+    long allocations_before = g_allocations;
     for (auto i = 0; i < 100; ++i) {
       reader->read(filename);
       reader->decode();
     }
+    printf("Heap allocations per decode after warmup: %.2f\n", (g_allocations - allocations_before) / 100.);
+
+    // Same again, but decoding from a buffer the caller already holds in memory //
+    std::ifstream file(filename, std::ios::binary);
+    std::vector<uint8_t> file_bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    for (auto i = 0; i < 100; ++i) {
+      reader->readFromMemory(file_bytes.data(), file_bytes.size());
+      reader->decode();
+    }
     reader->printTimingStats();
+
+    // Host entropy decoding on one thread versus split across the whole pool. Throughput is in MB of
+    // unstuffed entropy coded data, and the unstuffing pre-scan is included in decodeScanCPU //
+    double scan_milliseconds[2], index_milliseconds = 0;
+    unsigned pool_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int parallel = 0; parallel < 2; ++parallel) {
+      reader->setHostThreads(parallel ? pool_threads : 1);
+      reader->timings.reset();
+      for (auto i = 0; i < 100; ++i) {
+        reader->readFromMemory(file_bytes.data(), file_bytes.size());
+        reader->decode();
+      }
+      scan_milliseconds[parallel] = reader->timings.meanMilliseconds(JPGReader::stage_decodeScanCPU);
+      if (!parallel) index_milliseconds = reader->timings.meanMilliseconds(JPGReader::stage_indexScan);
+    }
+    double scan_kilobytes = reader->scanIndex().size / 1e3;
+    printf("decodeScanCPU: %.3f ms serial (%.1f MB/s), %.3f ms on %u threads (%.1f MB/s, %.2fx)\n",
+           scan_milliseconds[0], scan_kilobytes / scan_milliseconds[0], scan_milliseconds[1], pool_threads,
+           scan_kilobytes / scan_milliseconds[1], scan_milliseconds[0] / scan_milliseconds[1]);
+    printf("indexScan: %.3f ms (%.1f MB/s)\n", index_milliseconds, scan_kilobytes / index_milliseconds);
+    for (auto &kernel : reader->iDCTCyclesPerBlock()) {
+      printf("iDCT %s: %.1f cycles/block\n", kernel.first.c_str(), kernel.second);
+    }
+
+    // Batched decoding, overlapping host and IPU work. The trace shows how well they overlap, with the
+    // host stages on one row and the device runs on another //
+    std::vector<JPGReader::Input> batch(100, {file_bytes.data(), file_bytes.size()});
+    reader->timings.reset();
+    reader->timings.startTrace(1 << 16);
+    auto decoded = reader->decodeBatch(batch);
+    double seconds = reader->timings.meanMilliseconds(JPGReader::stage_decodeBatch) / 1e3;
+    double megapixels = decoded[0].width * decoded[0].height * batch.size() / 1e6;
+    printf("decodeBatch: %.1f images/s, %.1f MP/s\n", batch.size() / seconds, megapixels / seconds);
+    if (reader->timings.writeTrace("decodeBatch_trace.json")) {
+      printf("decodeBatch trace written to decodeBatch_trace.json, for chrome://tracing or Perfetto\n");
+    }
+
+    // The same batch sharded over more IPUs, each image packed onto as few as hold it //
+    double one_IPU_seconds = 0;
+    for (int num_ipus : {1, 2, 4}) {
+      auto sharded_device = getIPU(false, num_ipus);
+      auto sharded_reader = std::make_unique<JPGReader>(sharded_device, true);
+      sharded_reader->decodeBatch(batch);  // Warmup
+      sharded_reader->timings.reset();
+      sharded_reader->decodeBatch(batch);
+      double sharded_seconds = sharded_reader->timings.meanMilliseconds(JPGReader::stage_decodeBatch) / 1e3;
+      if (num_ipus == 1) one_IPU_seconds = sharded_seconds;
+      printf("decodeBatch on %d IPUs: %.1f images/s, %.2fx one IPU\n", num_ipus, batch.size() / sharded_seconds,
+             one_IPU_seconds / sharded_seconds);
+    }
+
+    // Start-up compiling the graph, as with a cold executable cache, and loading it from the warm one
+    // the first reader left behind //
+    reader.reset();
+    double startup_milliseconds[2];
+    for (int warm = 0; warm < 2; ++warm) {
+      auto start_time = std::chrono::high_resolution_clock::now();
+      JPGReader startup_reader(ipuDevice, true, false, warm ? "executable_cache" : "");
+      auto elapsed = std::chrono::high_resolution_clock::now() - start_time;
+      startup_milliseconds[warm] = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1e3;
+    }
+    printf("JPGReader start-up: %.1f ms compiling, %.1f ms from the executable cache (%.1fx)\n",
+           startup_milliseconds[0], startup_milliseconds[1], startup_milliseconds[0] / startup_milliseconds[1]);
+
+    // Several request threads sharing the device through the async front end //
+    AsyncDecoder async_decoder(ipuDevice);
+    std::vector<std::thread> request_threads;
+    for (int t = 0; t < 4; ++t) {
+      request_threads.emplace_back([&]() {
+        for (auto i = 0; i < 25; ++i) {
+          async_decoder.submit(file_bytes.data(), file_bytes.size()).get();
+        }
+      });
+    }
+    for (auto &thread : request_threads) thread.join();
+    async_decoder.printStats();
   }
 
   return EXIT_SUCCESS;
@@ -58,6 +164,7 @@ auto manager = poplar::DeviceManager::createDeviceManager();
     
   } else {
     poplar::IPUModel ipuModel;
+    ipuModel.numIPUs = num_ipus;
     return ipuModel.createDevice(); 
   }
 }
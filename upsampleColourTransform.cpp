@@ -1,8 +1,15 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+
 #include "JPGReader.hpp"
 
+#if IDCT_SIMD
+#include <x86intrin.h>
+#endif
+
 inline unsigned char clip(const int x) { return (x < 0) ? 0 : ((x > 0xFF) ? 0xFF : (unsigned char)x); }
 
 // Precomputed DCT constants //
@@ -13,12 +20,21 @@ inline unsigned char clip(const int x) { return (x < 0) ? 0 : ((x > 0xFF) ? 0xFF
 #define W6 1108
 #define W7 565
 
+// The row and column passes take the number N of leading coefficients that may be nonzero. The rest
+// are known to be zero, so the compiler drops their terms and the result is the same as a full pass //
+template <int N>
 void JPGReader::iDCT_row(short *D) {
-  int x0, x1, x2, x3, x4, x5, x6, x7, x8;
+  int x0, x8;
+  int x1 = (N > 4) ? D[4] << 11 : 0;
+  int x2 = (N > 6) ? D[6] : 0;
+  int x3 = (N > 2) ? D[2] : 0;
+  int x4 = (N > 1) ? D[1] : 0;
+  int x5 = (N > 7) ? D[7] : 0;
+  int x6 = (N > 5) ? D[5] : 0;
+  int x7 = (N > 3) ? D[3] : 0;
 
   // Block is solid colour //
-  if (!((x1 = D[4] << 11) | (x2 = D[6]) | (x3 = D[2]) | (x4 = D[1]) | (x5 = D[7]) | (x6 = D[5]) |
-        (x7 = D[3]))) {
+  if (!(x1 | x2 | x3 | x4 | x5 | x6 | x7)) {
     D[0] = D[1] = D[2] = D[3] = D[4] = D[5] = D[6] = D[7] = D[0] << 3;
     return;
   }
@@ -55,14 +71,15 @@ void JPGReader::iDCT_row(short *D) {
   D[7] = (x7 - x1) >> 8;
 }
 
-void JPGReader::iDCT_col(const short *D, unsigned char *out, int stride) {
-  int x1 = ((int) D[stride * 4]) << 8;
-  int x2 = D[stride * 6];
-  int x3 = D[stride * 2];
-  int x4 = D[stride * 1];
-  int x5 = D[stride * 7];
-  int x6 = D[stride * 5];
-  int x7 = D[stride * 3];
+template <int N>
+void JPGReader::iDCT_col(const short *D, int D_stride, unsigned char *out, int stride) {
+  int x1 = (N > 4) ? ((int) D[D_stride * 4]) << 8 : 0;
+  int x2 = (N > 6) ? D[D_stride * 6] : 0;
+  int x3 = (N > 2) ? D[D_stride * 2] : 0;
+  int x4 = (N > 1) ? D[D_stride * 1] : 0;
+  int x5 = (N > 7) ? D[D_stride * 7] : 0;
+  int x6 = (N > 5) ? D[D_stride * 5] : 0;
+  int x7 = (N > 3) ? D[D_stride * 3] : 0;
 
   // Block is solid colour //
   if (!(x1 | x2 | x3 | x4 | x5 | x6 | x7)) {
@@ -113,20 +130,137 @@ void JPGReader::iDCT_col(const short *D, unsigned char *out, int stride) {
   *out = clip(((x7 - x1) >> 14) + 128);
 }
 
-void JPGReader::upsampleChannel(ColourChannel *channel) {
-  int xshift = 0, yshift = 0;
-  while (channel->width < m_width) {
-    channel->width <<= 1;
-    ++xshift;
+// Cosines of pi/8, pi/4 and 3pi/8 for the reduced iDCTs //
+#define C1 1892
+#define C2 1448
+#define C3 784
+
+// An N point iDCT of N values for N = 2 or 4, times 2^11 and without the 1/2 normalisation //
+template <int N>
+inline void iDCT_points(const int *in, int *out) {
+  if (N == 2) {
+    out[0] = C2 * (in[0] + in[1]);
+    out[1] = C2 * (in[0] - in[1]);
+    return;
+  }
+  int even0 = C2 * (in[0] + in[2]);
+  int even1 = C2 * (in[0] - in[2]);
+  int odd0 = C1 * in[1] + C3 * in[3];
+  int odd1 = C3 * in[1] - C1 * in[3];
+  out[0] = even0 + odd0;
+  out[1] = even1 + odd1;
+  out[2] = even1 - odd1;
+  out[3] = even0 - odd0;
+}
+
+// What the reduced kernels make of a block with only a DC coefficient //
+inline unsigned char iDCT_scaled_DC(int dc) { return clip(((C2 * ((C2 * dc + 128) >> 8) + 32768) >> 16) + 128); }
+
+// Reduced size inverse DCT for downscaled decoding. The N point iDCT of a block's top left NxN
+// coefficients is the block at N/8 size, each pixel about the mean of the ones it stands for. Rows keep
+// 3 extra bits like the full size row pass, and the coefficients are left untouched //
+template <int N>
+void JPGReader::iDCT_scaled(const short *D, int D_stride, unsigned char *out, int stride) {
+  int in[N], points[N], rows[N * N];
+  for (int y = 0; y < N; ++y) {
+    for (int x = 0; x < N; ++x) in[x] = D[y * D_stride + x];
+    iDCT_points<N>(in, points);
+    for (int x = 0; x < N; ++x) rows[y * N + x] = (points[x] + 128) >> 8;
   }
-  while (channel->height < m_height) {
-    channel->height <<= 1;
-    ++yshift;
+  for (int x = 0; x < N; ++x) {
+    for (int y = 0; y < N; ++y) in[y] = rows[y * N + x];
+    iDCT_points<N>(in, points);
+    for (int y = 0; y < N; ++y) out[y * stride + x] = clip(((points[y] + 32768) >> 16) + 128);
   }
+}
+
+// Inverse DCT of one block with the cheapest kernel that covers every nonzero coefficient, given the
+// zig-zag index of the last one. Zig-zag indices up to 2 lie in the top left 2x2 and up to 9 in the top
+// left 4x4. A vector kernel, when the host has one, beats even the smallest scalar kernel, so then only
+// DC-only blocks are special. The scalar kernels work in place over the coefficients. Downscaled blocks
+// take the reduced kernels instead, down to just the DC at 1/8 size. Returns how many rows of
+// coefficients may have been touched or be nonzero, for clearing scratch blocks //
+int JPGReader::iDCTBlock(short *D, int D_stride, int last_nonzero, unsigned char *out, int stride) {
+  int used_rows = (last_nonzero == 0) ? 1 : (last_nonzero <= 2) ? 2 : (last_nonzero <= 9) ? 4 : 8;
+  if (last_nonzero == 0 || m_scale_shift == 3) {
+    // Only DC: the block is solid colour, rounded as the kernel for its size would //
+    const int block_size = 8 >> m_scale_shift;
+    short dc = D[0] << 3;
+    unsigned char colour = (block_size == 4 || block_size == 2) ? iDCT_scaled_DC(D[0]) : clip(((dc + 32) >> 6) + 128);
+    for (int i = 0; i < block_size; ++i) memset(&out[i * stride], colour, block_size);
+    return used_rows;
+  }
+  if (m_scale_shift == 1) {
+    iDCT_scaled<4>(D, D_stride, out, stride);
+  } else if (m_scale_shift == 2) {
+    iDCT_scaled<2>(D, D_stride, out, stride);
+  } else if (m_iDCT_kernel.block_short) {
+    m_iDCT_kernel.block_short(D, D_stride, out, stride);
+  } else if (used_rows == 2) {
+    for (int i = 0; i < 2; ++i) iDCT_row<2>(&D[i * D_stride]);
+    for (int i = 0; i < 8; ++i) iDCT_col<2>(&D[i], D_stride, &out[i], stride);
+  } else if (used_rows == 4) {
+    for (int i = 0; i < 4; ++i) iDCT_row<4>(&D[i * D_stride]);
+    for (int i = 0; i < 8; ++i) iDCT_col<4>(&D[i], D_stride, &out[i], stride);
+  } else {
+    for (int i = 0; i < 8; ++i) iDCT_row<8>(&D[i * D_stride]);
+    for (int i = 0; i < 8; ++i) iDCT_col<8>(&D[i], D_stride, &out[i], stride);
+  }
+  return used_rows;
+}
+
+std::map<std::string, double> JPGReader::iDCTCyclesPerBlock() {
+  std::map<std::string, double> cycles;
+#if IDCT_SIMD
+  if (!m_do_iDCT_on_IPU || m_scale_shift || m_streamed || m_coefficient_format == coefficients_huffman) {
+    return cycles;
+  }
+
+  // decode() hands the coefficient buffers over to the device streams, so the last image's are in flight //
+  std::vector<short> blocks;
+  const int total_MCUs = m_num_MCUs_x * m_num_MCUs_y;
+  for (int c = 0; c < m_num_channels; ++c) {
+    const ColourChannel *channel = &m_channels[c];
+    for (int MCU_index = 0; MCU_index < total_MCUs; ++MCU_index) {
+      for (int sample_y = 0; sample_y < channel->samples_y; ++sample_y) {
+        for (int sample_x = 0; sample_x < channel->samples_x; ++sample_x) {
+          const short *D = &m_inflight_frequencies[c][blockOffset(channel, MCU_index, sample_x, sample_y)];
+          for (int i = 0; i < 8; ++i, D += channel->tile_stride) blocks.insert(blocks.end(), D, D + 8);
+        }
+      }
+    }
+  }
+  size_t num_blocks = blocks.size() / 64;
+  if (!num_blocks) return cycles;
+
+  std::vector<unsigned char> pixels(num_blocks * 64);
+  short scratch[64];
+  for (int use_kernel = 0; use_kernel < (m_iDCT_kernel.block_short ? 2 : 1); ++use_kernel) {
+    unsigned long long best = ~0ull;
+    for (int repeat = 0; repeat < 5; ++repeat) {
+      unsigned long long start = __rdtsc();
+      for (size_t block = 0; block < num_blocks; ++block) {
+        if (use_kernel) {
+          m_iDCT_kernel.block_short(&blocks[block * 64], 8, &pixels[block * 64], 8);
+          continue;
+        }
+        memcpy(scratch, &blocks[block * 64], sizeof(scratch));
+        for (int i = 0; i < 8; ++i) iDCT_row<8>(&scratch[i * 8]);
+        for (int i = 0; i < 8; ++i) iDCT_col<8>(&scratch[i], 8, &pixels[block * 64 + i], 8);
+      }
+      best = std::min(best, __rdtsc() - start);
+    }
+    cycles[use_kernel ? m_iDCT_kernel.name : "scalar"] = double(best) / num_blocks;
+  }
+#endif
+  return cycles;
+}
+
+void JPGReader::upsampleChannel(ColourChannel *channel) {
+  int xshift = channel->downshift_x, yshift = channel->downshift_y;
 
-  std::vector<unsigned char> upsampled(MAX_PIXELS_PER_TILE * m_num_active_tiles);
   for (int tile = 0; tile < m_num_active_tiles; tile++) {
-    unsigned char *out = &upsampled[tile * MAX_PIXELS_PER_TILE];
+    unsigned char *out = &m_upsample_buffer[tile * MAX_PIXELS_PER_TILE];
     for (int in_MCU = 0; in_MCU < m_MCUs_per_tile; ++in_MCU) {
       int in_start = (tile * MAX_PIXELS_PER_TILE) + (in_MCU * channel->pixels_per_MCU);
       for (int y = 0; y < m_MCU_size_y; ++y) {
@@ -137,17 +271,16 @@ void JPGReader::upsampleChannel(ColourChannel *channel) {
       }
     }
   }
-  channel->pixels = upsampled;
+  channel->pixels.swap(m_upsample_buffer);
 }
 
 void JPGReader::upsampleAndColourTransform() {
   int i;
   ColourChannel *channel;
+  // Channel sizes are those of the coded image, which a downscaled output doesn't match, so go by the
+  // sampling factors //
   for (i = 0, channel = &m_channels[0]; i < m_num_channels; ++i, ++channel) {
-    if ((channel->width < m_width) || (channel->height < m_height)) upsampleChannel(channel);
-    if ((channel->width < m_width) || (channel->height < m_height)) {
-      THROW(SYNTAX_ERROR);
-    }
+    if (channel->downshift_x || channel->downshift_y) upsampleChannel(channel);
   }
 
   if (m_num_channels == 3) {
@@ -164,17 +297,213 @@ void JPGReader::upsampleAndColourTransform() {
 }
 
 void JPGReader::upsampleAndColourTransformIPU() {
-  // if (m_num_channels == 3) {
-
-    m_IPU_params_table[param_MCUs_per_tile] = m_MCUs_per_tile;
-    m_IPU_params_table[param_MCU_height] = m_MCU_size_y;
-    m_IPU_params_table[param_MCU_width] = m_MCU_size_x;
-    m_IPU_params_table[param_CB_downshift_x] = m_channels[1].downshift_x;
-    m_IPU_params_table[param_CB_downshift_y] = m_channels[1].downshift_y;
-    m_IPU_params_table[param_CR_downshift_x] = m_channels[2].downshift_x;
-    m_IPU_params_table[param_CR_downshift_y] = m_channels[2].downshift_y;
-    m_IPU_params_table[param_num_channels] = m_num_channels;
-
-    m_ipuEngine->run(0);
-  // }
+  packCoefficients(m_num_MCUs_x * m_num_MCUs_y);
+  stageIPUInputs();
+  runProgram(this, postprocessProgram(subsamplingMode()));
+  if (m_coefficient_format == coefficients_huffman && huffmanFailed(currentLayout())) THROW(SYNTAX_ERROR);
+}
+
+// Stage the current image, laid out over every IPU, for the next run of the device //
+void JPGReader::stageIPUInputs() {
+  for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+    fillIPUParams(&m_IPU_params_table[ipu * PARAMS_SIZE]);
+    fillIPUQuantTables(&m_IPU_quant_table[ipu * 3 * 64]);
+    if (m_coefficient_format == coefficients_huffman) {
+      std::copy(m_huffman_tables.begin(), m_huffman_tables.end(), &m_IPU_huffman_table[ipu * 4 * HUFFMAN_TABLE_SIZE]);
+    }
+  }
+  setTransferSizes(m_first_tile, m_first_tile + m_num_active_tiles);
+  stageChannelBuffers();
+}
+
+// Move the freshly decoded channel buffers into the in-flight set read by the device streams, leaving
+// the channel buffers free for the host to decode the next image into while the device runs. Each IPU
+// has its own stream per channel, reading its slice of the buffer, and likewise for the packed bytes //
+void JPGReader::stageChannelBuffers() {
+  std::swap(m_packed_bytes, m_inflight_packed_bytes);
+  for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+    for (unsigned size = 0; size < NUM_TRANSFER_SIZES; ++size) {
+      m_ipuEngine->connectStream(m_packed_stream_names[ipu * NUM_TRANSFER_SIZES + size],
+                                 &m_inflight_packed_bytes[ipu * m_tiles_per_IPU * PACKED_BYTES_PER_TILE]);
+    }
+  }
+  for (int c = 0; c < 3; ++c) {
+    ColourChannel &channel = m_channels[c];
+    std::swap(channel.pixels, m_inflight_pixels[c]);
+    std::swap(channel.frequencies, m_inflight_frequencies[c]);
+    for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+      size_t offset = ipu * m_IPU_pixels;
+      void *src = m_do_iDCT_on_IPU ? (void *)&m_inflight_frequencies[c][offset] : (void *)&m_inflight_pixels[c][offset];
+      for (unsigned size = 0; size < NUM_TRANSFER_SIZES; ++size) {
+        m_ipuEngine->connectStream(channel.stream_names[ipu * NUM_TRANSFER_SIZES + size], src);
+      }
+    }
+  }
+}
+
+// The postprocess program, one per subsampling mode, the current image goes through. The specialised
+// vertices assume an MCU of 8 << downshift pixels each way with one chroma block per channel, which the
+// downshifts alone don't imply: all three channels 2x2, say, downshift by 0 in a 16x16 MCU //
+int JPGReader::subsamplingMode() {
+  if (m_scale_shift) return subsampling_generic;
+  if (m_num_channels == 1) return subsampling_grey;
+  const ColourChannel &Y = m_channels[0], &CB = m_channels[1], &CR = m_channels[2];
+  if (Y.downshift_x || Y.downshift_y || CB.downshift_x != CR.downshift_x || CB.downshift_y != CR.downshift_y) {
+    return subsampling_generic;
+  }
+  if (m_MCU_size_x != 8 << CB.downshift_x || m_MCU_size_y != 8 << CB.downshift_y || CB.samples_x != 1 ||
+      CB.samples_y != 1 || CR.samples_x != 1 || CR.samples_y != 1) {
+    return subsampling_generic;
+  }
+  if (CB.downshift_x == 0 && CB.downshift_y == 0) return subsampling_444;
+  if (CB.downshift_x == 1 && CB.downshift_y == 0) return subsampling_422;
+  if (CB.downshift_x == 1 && CB.downshift_y == 1) return subsampling_420;
+  return subsampling_generic;
+}
+
+// Pixels per row of the current image's raster output on the device, 0 if it stays tile-major because
+// raster output is off or its MCUs are narrower than a segment //
+int JPGReader::rasterStride() {
+  if (!m_raster_on_IPU || m_MCU_size_x % RASTER_SEGMENT_PIXELS) return 0;
+  return (m_width + RASTER_SEGMENT_PIXELS - 1) / RASTER_SEGMENT_PIXELS * RASTER_SEGMENT_PIXELS;
+}
+
+// The raster programs follow the NUM_SUBSAMPLINGS plain ones, in the same order //
+int JPGReader::postprocessProgram(int subsampling) {
+  return m_raster_on_IPU ? NUM_SUBSAMPLINGS + subsampling : subsampling;
+}
+
+void JPGReader::fillIPUParams(int *params) {
+  params[param_MCUs_per_tile] = m_MCUs_per_tile;
+  params[param_MCU_height] = m_MCU_size_y;
+  params[param_MCU_width] = m_MCU_size_x;
+  params[param_CB_downshift_x] = m_channels[1].downshift_x;
+  params[param_CB_downshift_y] = m_channels[1].downshift_y;
+  params[param_CR_downshift_x] = m_channels[2].downshift_x;
+  params[param_CR_downshift_y] = m_channels[2].downshift_y;
+  params[param_num_channels] = m_num_channels;
+  params[param_scale_shift] = m_scale_shift;
+  params[param_transfer_size] = 0;  // Set per IPU by setTransferSizes()
+  params[param_coefficient_format] = m_coefficient_format;
+  params[param_raster_stride] = rasterStride();
+  params[param_first_pixel] = m_first_tile * MAX_PIXELS_PER_TILE;
+  params[param_num_MCUs_x] = m_num_MCUs_x;
+  params[param_YCbCr_output] = m_output_format == PixelFormat::GRAY8 || m_output_format == PixelFormat::I420 ||
+                               m_output_format == PixelFormat::NV12;
+  for (int c = 0; c < m_num_channels; ++c) {
+    params[param_Y_tables + c] = m_channels[c].dc_id | (m_channels[c].ac_id << 2);
+  }
+}
+
+// The quantisers of each channel, for expanding the compact format, in the natural order of the
+// coefficients it indexes them by //
+void JPGReader::fillIPUQuantTables(unsigned char *quant) {
+  for (int c = 0; c < m_num_channels; ++c) {
+    const unsigned char *dq_table = m_dq_tables[m_channels[c].dq_id];
+    for (int pos = 0; pos < 64; ++pos) quant[c * 64 + deZigZagY[pos] * 8 + deZigZagX[pos]] = dq_table[pos];
+  }
+}
+
+// Pack the coefficients of the current image's first num_MCUs MCUs, or strip's, into the compact format
+// if the IPU does the iDCT at full size. Tiles are packed in parallel, and if any of them doesn't fit
+// its PACKED_BYTES_PER_TILE the image goes over as dense blocks instead. Entropy coded data left for
+// the device to decode is packed already //
+void JPGReader::packCoefficients(int num_MCUs) {
+  if (m_coefficient_format == coefficients_huffman) return;
+  m_coefficient_format = coefficients_dense;
+  if (!m_do_iDCT_on_IPU || m_scale_shift) return;
+  uint64_t start_time = TimingStats::now();
+
+  unsigned char quant[3 * 64];
+  fillIPUQuantTables(quant);
+  const int tiles_per_task = 64;
+  std::atomic<bool> fits(true);
+  m_thread_pool->parallelFor((m_num_active_tiles + tiles_per_task - 1) / tiles_per_task, [&](int task) {
+    int end_tile = std::min(m_num_active_tiles, (task + 1) * tiles_per_task);
+    for (int tile = task * tiles_per_task; tile < end_tile && fits; ++tile) {
+      if (!packTile(tile, num_MCUs - tile * m_MCUs_per_tile, quant)) fits = false;
+    }
+  });
+  if (fits) m_coefficient_format = coefficients_compact;
+
+  timings.record(stage_packCoefficients, start_time, 0, num_MCUs);
+}
+
+// Each block, MCU by MCU and within one channel by channel, is a count of its nonzero AC coefficients,
+// the dequantised DC in two bytes, little endian, then an entry per coefficient: a byte of its position
+// in natural order, with 0x80 set if two bytes of value follow rather than one, and 0x40 if the value is
+// dequantised already because dividing by its quantiser isn't exact. MCUs past num_MCUs are empty blocks.
+// Returns false if the tile doesn't fit //
+bool JPGReader::packTile(int tile, int num_MCUs, const unsigned char *quant) {
+  unsigned char *out = &m_packed_bytes[(size_t)(m_first_tile + tile) * PACKED_BYTES_PER_TILE];
+  unsigned char *end = out + PACKED_BYTES_PER_TILE;
+  for (int MCU = 0; MCU < m_MCUs_per_tile; ++MCU) {
+    for (int c = 0; c < m_num_channels; ++c) {
+      ColourChannel *channel = &m_channels[c];
+      const unsigned char *q = &quant[c * 64];
+      for (int sample_y = 0; sample_y < channel->samples_y; ++sample_y) {
+        for (int sample_x = 0; sample_x < channel->samples_x; ++sample_x) {
+          if (end - out < 3) return false;
+          unsigned char *block = out;
+          block[0] = block[1] = block[2] = 0;
+          out += 3;
+          if (MCU >= num_MCUs) continue;
+
+          int MCU_index = tile * m_MCUs_per_tile + MCU;
+          const short *D = &channel->frequencies[blockOffset(channel, MCU_index, sample_x, sample_y)];
+          block[1] = D[0] & 0xFF;
+          block[2] = (unsigned short)D[0] >> 8;
+          for (int y = 0; y < 8; ++y) {
+            const short *row = &D[y * channel->tile_stride];
+            // Most rows of most blocks are all zero //
+            uint64_t halves[2];
+            memcpy(halves, row, sizeof(halves));
+            if (!(halves[0] | halves[1])) continue;
+            for (int x = 0; x < 8; ++x) {
+              int pos = y * 8 + x;
+              int value = row[x];
+              if (!value || !pos) continue;
+              if (end - out < 3) return false;
+              ++block[0];
+              int quantised = q[pos] ? value / q[pos] : 0;
+              if (quantised * q[pos] != value) {
+                *out++ = pos | 0xC0;
+              } else if (quantised >= -128 && quantised < 128) {
+                *out++ = pos;
+                *out++ = (unsigned char)quantised;
+                continue;
+              } else {
+                *out++ = pos | 0x80;
+                value = quantised;
+              }
+              *out++ = value & 0xFF;
+              *out++ = (unsigned short)value >> 8;
+            }
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Virtual tiles at the start of an IPU's slice moved by its transfer of the given size //
+int JPGReader::transferTiles(int size) {
+  return std::max(1u, m_tiles_per_IPU >> (2 * (NUM_TRANSFER_SIZES - 1 - size)));
+}
+
+// Have each IPU transfer at least its part of tiles [first_tile, end_tile). Images start on an IPU
+// boundary, so that part is always at the start of its slice //
+void JPGReader::setTransferSizes(int first_tile, int end_tile) {
+  for (unsigned ipu = 0; ipu < m_num_IPUs; ++ipu) {
+    int ipu_start = ipu * m_tiles_per_IPU;
+    int used_tiles = std::min<int>(end_tile - ipu_start, m_tiles_per_IPU);
+    if (first_tile >= ipu_start + (int)m_tiles_per_IPU || used_tiles <= 0) continue;
+    int size = 0;
+    while (transferTiles(size) < used_tiles) ++size;
+    // Packed bytes have copies of their own, numbered after the dense ones //
+    int *params = &m_IPU_params_table[ipu * PARAMS_SIZE];
+    if (params[param_coefficient_format] != coefficients_dense) size += NUM_TRANSFER_SIZES;
+    params[param_transfer_size] = std::max(params[param_transfer_size], size + 1);
+  }
 }